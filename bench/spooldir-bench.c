@@ -0,0 +1,405 @@
+/*
+ * spooldir-bench.c
+ * Copyright (C) 2017 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "spooldir.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+/*
+ * Latencies are accumulated in log-linear histograms: each power of two
+ * is split in HIST_SUB buckets, which bounds the error to ~6%.
+ */
+enum {
+    HIST_SUB_BITS = 4,
+    HIST_SUB = 1 << HIST_SUB_BITS,
+    HIST_BUCKETS = 64 * HIST_SUB,
+};
+
+struct hist {
+    uint64_t count;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+
+static inline unsigned
+hist_bucket (uint64_t ns)
+{
+    if (ns < HIST_SUB)
+        return (unsigned) ns;
+    unsigned msb = 63 - __builtin_clzll (ns);
+    unsigned sub = (unsigned) (ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+
+static inline uint64_t
+hist_bucket_value (unsigned bucket)
+{
+    if (bucket < HIST_SUB)
+        return bucket;
+    unsigned msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB;
+    return ((uint64_t) HIST_SUB + sub) << (msb - HIST_SUB_BITS);
+}
+
+
+static inline void
+hist_add (struct hist *h, uint64_t ns)
+{
+    h->buckets[hist_bucket (ns)]++;
+    h->count++;
+}
+
+
+static void
+hist_merge (struct hist *dst, const struct hist *src)
+{
+    dst->count += src->count;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+
+static uint64_t
+hist_percentile (const struct hist *h, double p)
+{
+    uint64_t rank = (uint64_t) (p * (double) h->count);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_bucket_value (i);
+    }
+    return 0;
+}
+
+
+static inline uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+struct options {
+    const char *path;
+    size_t      items;
+    size_t      payload;
+    size_t      batch;
+    unsigned    max_workers;
+    unsigned    fanout;
+    bool        processes;
+    bool        sync;
+    bool        uring;
+};
+
+struct worker {
+    const struct options *opts;
+    size_t                items;   /* To add; for consumers, a limit. */
+    size_t                done;
+    unsigned              id;
+    int                   error;
+    struct hist           hist;
+    struct hist           commit_hist;  /* Consumers time picks separately. */
+};
+
+
+static spooldir*
+open_spool (const struct options *opts)
+{
+    spooldir *spool = spooldir_open_path (opts->path, 0777);
+    if (!spool) {
+        fprintf (stderr, "Cannot open spool '%s': %s\n", opts->path, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    if (opts->sync)
+        spooldir_set_durability (spool, SPOOLDIR_DURABILITY_ITEM, 0, 0);
+    if (opts->uring && spooldir_set_io_engine (spool, SPOOLDIR_IO_URING) < 0)
+        fprintf (stderr, "io_uring unavailable: %s\n", strerror (errno));
+    return spool;
+}
+
+
+static void*
+produce (void *data)
+{
+    struct worker *w = data;
+    spooldir *spool = open_spool (w->opts);
+    uint8_t *payload = calloc (1, w->opts->payload + 1);
+
+    for (; w->done < w->items; w->done++) {
+        uint64_t start = now_ns ();
+        spooltxn txn;
+        if (spooldir_add (spool, &txn) < 0 ||
+            (w->opts->payload && write (txn.fd, payload, w->opts->payload) < 0) ||
+            spooldir_commit (spool, &txn) < 0) {
+            w->error = errno;
+            break;
+        }
+        hist_add (&w->hist, now_ns () - start);
+    }
+
+    free (payload);
+    spooldir_close (spool);
+    return NULL;
+}
+
+
+static void*
+consume (void *data)
+{
+    struct worker *w = data;
+    spooldir *spool = open_spool (w->opts);
+    spooltxn *txns = calloc (w->opts->batch, sizeof (spooltxn));
+
+    /* With batches larger than one, each sample is the latency of a batch. */
+    while (w->done < w->items) {
+        uint64_t start = now_ns ();
+        ssize_t n = spooldir_pick_many (spool, txns, w->opts->batch);
+        if (n <= 0) {
+            if (n < 0)
+                w->error = errno;
+            break;
+        }
+        uint64_t picked = now_ns ();
+        hist_add (&w->hist, picked - start);
+
+        if (spooldir_commit_many (spool, txns, (size_t) n) < 0) {
+            w->error = errno;
+            break;
+        }
+        hist_add (&w->commit_hist, now_ns () - picked);
+        w->done += (size_t) n;
+    }
+
+    free (txns);
+    spooldir_close (spool);
+    return NULL;
+}
+
+
+/*
+ * Runs "n" workers as threads or processes; in the latter case their
+ * state lives in shared memory. Returns the elapsed time in nanoseconds.
+ */
+static uint64_t
+run_workers (struct worker *workers, unsigned n, bool processes, void* (*fn) (void*))
+{
+    uint64_t start = now_ns ();
+
+    if (processes) {
+        pid_t pids[n];
+        for (unsigned i = 0; i < n; i++) {
+            if ((pids[i] = fork ()) == 0) {
+                (*fn) (&workers[i]);
+                _exit (EXIT_SUCCESS);
+            }
+        }
+        for (unsigned i = 0; i < n; i++)
+            waitpid (pids[i], NULL, 0);
+    } else {
+        pthread_t threads[n];
+        for (unsigned i = 0; i < n; i++)
+            pthread_create (&threads[i], NULL, fn, &workers[i]);
+        for (unsigned i = 0; i < n; i++)
+            pthread_join (threads[i], NULL);
+    }
+
+    return now_ns () - start;
+}
+
+
+static void
+report (const char *name, const struct options *opts, unsigned n,
+        const struct worker *workers, uint64_t elapsed_ns, bool commits)
+{
+    /* Only consumers operate in batches. */
+    const bool batched = opts->batch > 1 && (commits || strcmp (name, "pick") == 0);
+    struct hist total = { 0 };
+    size_t done = 0;
+    int error = 0;
+    for (unsigned i = 0; i < n; i++) {
+        hist_merge (&total, commits ? &workers[i].commit_hist : &workers[i].hist);
+        done += workers[i].done;
+        if (!error)
+            error = workers[i].error;
+    }
+
+    const double seconds = (double) elapsed_ns / 1e9;
+    printf ("{\"bench\":\"%s\",\"workers\":%u,\"mode\":\"%s\",\"items\":%zu,"
+            "\"payload\":%zu,\"batch\":%zu,\"fanout\":%u,\"sync\":%s,\"uring\":%s,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"latency\":\"%s\","
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"error\":\"%s\"}\n",
+            name, n, opts->processes ? "processes" : "threads", done,
+            opts->payload, opts->batch, opts->fanout,
+            opts->sync ? "true" : "false", opts->uring ? "true" : "false",
+            seconds, seconds > 0 ? (double) done / seconds : 0.0,
+            batched ? "batch" : "item",
+            (unsigned long long) hist_percentile (&total, 0.5),
+            (unsigned long long) hist_percentile (&total, 0.99),
+            (unsigned long long) hist_percentile (&total, 0.999),
+            error ? strerror (error) : "");
+    fflush (stdout);
+}
+
+
+static void
+bench_keys (const struct options *opts)
+{
+    static const struct {
+        const char        *name;
+        enum spoolkey_mode mode;
+    } modes[] = {
+        { "key-hmac",    SPOOLKEY_HMAC_SHA256  },
+        { "key-siphash", SPOOLKEY_SIPHASH      },
+        { "key-time",    SPOOLKEY_TIME_ORDERED },
+    };
+
+    for (unsigned m = 0; m < sizeof (modes) / sizeof (modes[0]); m++) {
+        struct worker w = { .opts = opts, .items = opts->items };
+        spoolkey_inline storage;
+        uint64_t start = now_ns ();
+        for (; w.done < w.items; w.done++) {
+            uint64_t t = now_ns ();
+            spoolkey_init_new (&storage, modes[m].mode);
+            hist_add (&w.hist, now_ns () - t);
+        }
+        report (modes[m].name, opts, 1, &w, now_ns () - start, false);
+    }
+}
+
+
+static void
+bench_workers (const struct options *opts, unsigned n)
+{
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_ANONYMOUS | (opts->processes ? MAP_SHARED : MAP_PRIVATE);
+    struct worker *workers = mmap (NULL, n * sizeof (struct worker), prot, flags, -1, 0);
+    if (workers == MAP_FAILED) {
+        perror ("mmap");
+        exit (EXIT_FAILURE);
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        workers[i] = (struct worker) {
+            .opts = opts,
+            .id = i,
+            .items = opts->items / n + (i < opts->items % n),
+        };
+    }
+    report ("add", opts, n, workers, run_workers (workers, n, opts->processes, produce), false);
+
+    for (unsigned i = 0; i < n; i++)
+        workers[i] = (struct worker) { .opts = opts, .id = i, .items = opts->items };
+    uint64_t elapsed = run_workers (workers, n, opts->processes, consume);
+    report ("pick", opts, n, workers, elapsed, false);
+    report ("commit", opts, n, workers, elapsed, true);
+
+    munmap (workers, n * sizeof (struct worker));
+}
+
+
+static int
+remove_entry (const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    return remove (path);
+}
+
+
+static int
+usage (int code, const char *argv0)
+{
+    fprintf (code ? stderr : stdout,
+             "Usage: %s [options]\n"
+             "  -d PATH   spool directory to use (default: temporary)\n"
+             "  -n N      backlog depth, items added then picked (default: 100000)\n"
+             "  -s BYTES  payload size (default: 512)\n"
+             "  -b N      pick batch size, latencies are per batch if >1 (default: 64)\n"
+             "  -j N      scale from 1 up to N workers, doubling (default: 1)\n"
+             "  -f N      fan-out buckets, 0, 256 or 4096 (default: 0)\n"
+             "  -P        use processes instead of threads\n"
+             "  -S        sync each added item\n"
+             "  -U        use the io_uring engine\n"
+             "Writes one JSON object per line and measurement.\n",
+             argv0);
+    return code;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    struct options opts = {
+        .items = 100000,
+        .payload = 512,
+        .batch = 64,
+        .max_workers = 1,
+    };
+
+    int opt;
+    while ((opt = getopt (argc, argv, "d:n:s:b:j:f:PSUh")) != -1) {
+        switch (opt) {
+            case 'd': opts.path = optarg; break;
+            case 'n': opts.items = strtoull (optarg, NULL, 0); break;
+            case 's': opts.payload = strtoull (optarg, NULL, 0); break;
+            case 'b': opts.batch = strtoull (optarg, NULL, 0); break;
+            case 'j': opts.max_workers = (unsigned) strtoul (optarg, NULL, 0); break;
+            case 'f': opts.fanout = (unsigned) strtoul (optarg, NULL, 0); break;
+            case 'P': opts.processes = true; break;
+            case 'S': opts.sync = true; break;
+            case 'U': opts.uring = true; break;
+            case 'h': return usage (EXIT_SUCCESS, argv[0]);
+            default:  return usage (EXIT_FAILURE, argv[0]);
+        }
+    }
+    if (optind != argc || !opts.items || !opts.batch || !opts.max_workers)
+        return usage (EXIT_FAILURE, argv[0]);
+
+    char tmpdir[] = "/tmp/spooldir-bench-XXXXXX";
+    bool remove_spool = false;
+    if (!opts.path) {
+        if (!mkdtemp (tmpdir)) {
+            perror ("mkdtemp");
+            return EXIT_FAILURE;
+        }
+        opts.path = tmpdir;
+        remove_spool = true;
+    }
+
+    spooldir *spool = open_spool (&opts);
+    if (opts.fanout && spooldir_set_fanout (spool, opts.fanout) < 0) {
+        fprintf (stderr, "Cannot set fan-out: %s\n", strerror (errno));
+        return EXIT_FAILURE;
+    }
+    spooldir_close (spool);
+
+    bench_keys (&opts);
+    for (unsigned n = 1;; n *= 2) {
+        if (n > opts.max_workers)
+            n = opts.max_workers;
+        bench_workers (&opts, n);
+        if (n == opts.max_workers)
+            break;
+    }
+
+    if (remove_spool)
+        nftw (opts.path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
@@ -14,12 +14,16 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
 
 
 static int
 help_add_exit (int code, const char *argv0)
 {
-    fprintf (stderr, "Usage: %s <spooldir> [path]\n", argv0);
+    fprintf (stderr, "Usage: %s [-s] [-b [-z] | -p N] [-k hmac|siphash|time] <spooldir> [path]\n", argv0);
     exit (code);
     return code;
 }
@@ -42,74 +46,781 @@ enum {
     COPY_BUFSZ = 4096,
 };
 
-static _Bool
-copy_contents (FILE *i, FILE *o)
+
+/*
+ * Writes what remains to be read from "src_fd" to a new element.
+ */
+static int
+copy_to_txn (int src_fd, spooltxn *txn)
 {
     uint8_t buffer[COPY_BUFSZ];
-    size_t count;
+    for (;;) {
+        ssize_t count = read (src_fd, buffer, sizeof (buffer));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return (int) count;
+        for (ssize_t done = 0; done < count;) {
+            ssize_t written = write (txn->fd, buffer + done, (size_t) (count - done));
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return -1;
+            done += written;
+        }
+    }
+}
+
+
+/*
+ * Prints the counters of a spool handle to stderr as one JSON object when
+ * the "SPOOL_STATS" environment variable is set.
+ */
+static void
+dump_stats (const spooldir *spool)
+{
+    static const char *stage_names[SPOOLDIR_STAGE_COUNT] = {
+        [SPOOLDIR_STAGE_CREATE]  = "create",
+        [SPOOLDIR_STAGE_CLAIM]   = "claim",
+        [SPOOLDIR_STAGE_PUBLISH] = "publish",
+        [SPOOLDIR_STAGE_FINISH]  = "finish",
+        [SPOOLDIR_STAGE_SYNC]    = "sync",
+    };
+
+    struct spooldir_stats stats;
+    if (!getenv ("SPOOL_STATS") || spooldir_stats (spool, &stats) < 0)
+        return;
+
+    fprintf (stderr, "{\"adds\":%" PRIu64 ",\"commits\":%" PRIu64 ",\"rollbacks\":%" PRIu64
+             ",\"picks\":%" PRIu64 ",\"pick_races\":%" PRIu64 ",\"entries_scanned\":%" PRIu64
+             ",\"bytes_written\":%" PRIu64 ",\"latency_ns\":{",
+             stats.adds, stats.commits, stats.rollbacks, stats.picks, stats.pick_races,
+             stats.entries_scanned, stats.bytes_written);
+    for (unsigned stage = 0; stage < SPOOLDIR_STAGE_COUNT; stage++) {
+        /* Keys are the lower bounds of the non-empty buckets. */
+        fprintf (stderr, "%s\"%s\":{", stage ? "," : "", stage_names[stage]);
+        _Bool first = true;
+        for (unsigned i = 0; i < SPOOLDIR_STATS_BUCKETS; i++) {
+            if (!stats.latency[stage][i])
+                continue;
+            fprintf (stderr, "%s\"%" PRIu64 "\":%" PRIu64, first ? "" : ",",
+                     (uint64_t) 1 << i, stats.latency[stage][i]);
+            first = false;
+        }
+        fputc ('}', stderr);
+    }
+    fputs ("}}\n", stderr);
+}
+
+
+static _Bool
+parse_key_mode (const char *name, enum spoolkey_mode *mode)
+{
+    static const struct {
+        const char        *name;
+        enum spoolkey_mode mode;
+    } modes[] = {
+        { "hmac",    SPOOLKEY_HMAC_SHA256  },
+        { "siphash", SPOOLKEY_SIPHASH      },
+        { "time",    SPOOLKEY_TIME_ORDERED },
+    };
+
+    for (unsigned i = 0; i < sizeof (modes) / sizeof (modes[0]); i++) {
+        if (strcmp (name, modes[i].name) == 0) {
+            *mode = modes[i].mode;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Adds each record read from "input" as an element, printing their keys.
+ * Records end with a delimiter, which is stored along with the contents
+ * for newlines, and dropped otherwise.
+ */
+static int
+add_batch (spooldir *spool, FILE *input, int delim)
+{
+    spooldir_producer *producer = spooldir_producer_new (spool);
+    if (!producer)
+        return err_exit (errno, "Could not add items to spool");
 
-    while ((count = fread (buffer, 1, COPY_BUFSZ, i)) > 0) {
-        if (ferror (i))
-            return false;
-        if (fwrite (buffer, 1, count, o) < count && ferror (o))
-            return false;
+    char *record = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getdelim (&record, &size, delim, input)) > 0) {
+        if (delim != '\n' && record[len - 1] == delim)
+            len--;
+
+        const spoolkey *key;
+        if (spooldir_producer_add (producer, record, (size_t) len, &key) < 0) {
+            int e = errno;
+            spooldir_producer_free (producer);
+            free (record);
+            return err_exit (e, "Could not add item to spool");
+        }
+        printf ("%s\n", spoolkey_cstr (key));
     }
-    return !!feof(i);
+    free (record);
+    spooldir_producer_free (producer);
+
+    if (ferror (input))
+        return err_exit (errno, "Could not read items");
+    return EXIT_SUCCESS;
 }
 
 
 static int
 add_main (int argc, char *argv[])
 {
-    if (argc != 2 && argc != 3)
+    enum spoolkey_mode key_mode = SPOOLKEY_HMAC_SHA256;
+    _Bool sync = false;
+    _Bool batch = false;
+    int delim = '\n';
+    long priority = -1;
+
+    for (;;) {
+        if (argc > 2 && (strcmp (argv[1], "-k") == 0 || strcmp (argv[1], "--keys") == 0)) {
+            if (!parse_key_mode (argv[2], &key_mode))
+                return help_add_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 1 && (strcmp (argv[1], "-s") == 0 || strcmp (argv[1], "--sync") == 0)) {
+            sync = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 1 && (strcmp (argv[1], "-b") == 0 || strcmp (argv[1], "--batch") == 0)) {
+            batch = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 1 && (strcmp (argv[1], "-z") == 0 || strcmp (argv[1], "--null") == 0)) {
+            delim = '\0';
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 2 && (strcmp (argv[1], "-p") == 0 || strcmp (argv[1], "--priority") == 0)) {
+            char *end = NULL;
+            priority = strtol (argv[2], &end, 10);
+            if (!end || *end != '\0' || priority < 0 || priority > SPOOLDIR_PRIORITY_MAX)
+                return help_add_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+    if ((argc != 2 && argc != 3) || (batch && priority >= 0))
         return help_add_exit (EXIT_FAILURE, argv[0]);
     if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
         return help_add_exit (EXIT_SUCCESS, argv[0]);
 
-    FILE *fi = (argc == 3) ? fopen (argv[2], "rb") : stdin;
-    if (!fi)
+    int fd = (argc == 3) ? open (argv[2], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd < 0)
         return err_exit (errno, "Could not open '%s' for reading", argv[2]);
 
     spooldir *spool = spooldir_open_path (argv[1], 0777);
     if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+    spooldir_set_key_mode (spool, key_mode);
+    if (sync)
+        spooldir_set_durability (spool, SPOOLDIR_DURABILITY_ITEM, 0, 0);
 
+    if (batch) {
+        FILE *input = fdopen (fd, "r");
+        if (!input) {
+            int e = errno;
+            spooldir_close (spool);
+            return err_exit (e, "Could not read items");
+        }
+        int retval = add_batch (spool, input, delim);
+        fclose (input);
+        dump_stats (spool);
+        spooldir_close (spool);
+        return retval;
+    }
+
+    /* Create the element and put some content in it. */
     spooltxn txn;
-    if (spooldir_add (spool, &txn) < 0) {
+    if (priority >= 0) {
+        if (spooldir_add_with_priority (spool, &txn, (unsigned) priority) < 0) {
+            int e = errno;
+            spooldir_close (spool);
+            return err_exit (e, "Could not add item to spool");
+        }
+        if (copy_to_txn (fd, &txn) < 0) {
+            int e = errno;
+            spooldir_rollback (spool, &txn);
+            spooldir_close (spool);
+            return err_exit (e, "Could not add item to spool");
+        }
+    } else if (spooldir_add_from_fd (spool, fd, &txn) < 0) {
+        int e = errno;
         spooldir_close (spool);
-        return err_exit (errno, "Could not add item to spool");
+        return err_exit (e, "Could not add item to spool");
     }
+    if (fd != STDIN_FILENO)
+        close (fd);
 
-    /* Put some content in the newwly created spool element. */
-    FILE *fo = fdopen (spooltxn_take_fd (&txn), "w");
-    if (!(fo && copy_contents (fi, fo))) {
+    /* With deduplication the key is only known once contents are written. */
+    if (spooldir_get_dedup (spool) && spooldir_derive_key (spool, &txn) < 0) {
+        int e = errno;
         spooldir_rollback (spool, &txn);
         spooldir_close (spool);
-        return EXIT_FAILURE;
+        return err_exit (e, "Could not add item to spool");
     }
-    if (fo)
-        fclose (fo);
 
     /* Keep a copy around to be able to print the resulting filename. */
-    spoolkey *key = spoolkey_copy (txn.key);
+    spoolkey_inline key_storage;
+    spoolkey *key = spoolkey_init_inline (&key_storage, spoolkey_cstr (txn.key),
+                                          spoolkey_length (txn.key));
 
     if (spooldir_commit (spool, &txn) < 0) {
         int e = errno;
         spooldir_close (spool);
         return err_exit (e, "Coult not commit item to spool");
     }
+    dump_stats (spool);
     spooldir_close (spool);
 
     printf ("%s\n", spoolkey_cstr (key));
-    spoolkey_free (key);
 
     return EXIT_SUCCESS;
 }
 
 
+static int
+help_pick_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [-w] <spooldir>\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static void
+pick_notify_cb (spooldir *spool, enum spooldir_status status, spooltxn *txn, void *userdata)
+{
+}
+
+
 static int
 pick_main (int argc, char *argv[])
 {
-    fputs ("Unimplemented :-(\n", stderr);
+    _Bool wait = false;
+
+    if (argc == 3 && (strcmp (argv[1], "-w") == 0 || strcmp (argv[1], "--wait") == 0)) {
+        wait = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 2)
+        return help_pick_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_pick_exit (EXIT_SUCCESS, argv[0]);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0777);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    /* Start watching before picking, to avoid missing new elements. */
+    spooldir_notifier *notifier = NULL;
+    if (wait && !(notifier = spooldir_notifier_new (spool, pick_notify_cb, NULL))) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not watch spool '%s'", argv[1]);
+    }
+
+    spooltxn txn;
+    int retval;
+    while ((retval = spooldir_pick (spool, &txn)) != 0) {
+        if (retval != EOF || errno != 0) {
+            int e = errno;
+            spooldir_close (spool);
+            return err_exit (e, "Could not pick item from spool");
+        }
+        if (!wait) {
+            spooldir_close (spool);
+            return EXIT_FAILURE;
+        }
+
+        struct pollfd pfd = { .fd = spooldir_notifier_fd (notifier), .events = POLLIN };
+        if (poll (&pfd, 1, -1) < 0 && errno != EINTR) {
+            int e = errno;
+            spooldir_close (spool);
+            return err_exit (e, "Could not wait for items in spool");
+        }
+        spooldir_notifier_dispatch (notifier);
+    }
+    if (notifier)
+        spooldir_notifier_free (notifier);
+
+    uint8_t buffer[COPY_BUFSZ];
+    const void *data;
+    size_t len;
+    if (spooldir_map_buf (&txn, buffer, sizeof (buffer), &data, &len) < 0 ||
+        fwrite (data, 1, len, stdout) < len || fflush (stdout) != 0) {
+        spooldir_rollback (spool, &txn);
+        spooldir_close (spool);
+        return EXIT_FAILURE;
+    }
+
+    if (spooldir_commit (spool, &txn) < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not commit item to spool");
+    }
+    dump_stats (spool);
+    spooldir_close (spool);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_init_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [--fanout N] [--counters] [--dedup] [--codec none|zstd [--level N]] <spooldir>\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+init_main (int argc, char *argv[])
+{
+    unsigned long fanout = 0;
+    _Bool counters = false;
+    _Bool dedup = false;
+    enum spooldir_codec codec = SPOOLDIR_CODEC_NONE;
+    unsigned long level = 0;
+
+    for (;;) {
+        if (argc > 3 && (strcmp (argv[1], "-f") == 0 || strcmp (argv[1], "--fanout") == 0)) {
+            char *end = NULL;
+            fanout = strtoul (argv[2], &end, 0);
+            if (!end || *end != '\0')
+                return help_init_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && (strcmp (argv[1], "-c") == 0 || strcmp (argv[1], "--counters") == 0)) {
+            counters = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 2 && (strcmp (argv[1], "-d") == 0 || strcmp (argv[1], "--dedup") == 0)) {
+            dedup = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else if (argc > 3 && (strcmp (argv[1], "-z") == 0 || strcmp (argv[1], "--codec") == 0)) {
+            if (strcmp (argv[2], "none") == 0)
+                codec = SPOOLDIR_CODEC_NONE;
+            else if (strcmp (argv[2], "zstd") == 0)
+                codec = SPOOLDIR_CODEC_ZSTD;
+            else if (strcmp (argv[2], "lz4") == 0)
+                codec = SPOOLDIR_CODEC_LZ4;
+            else
+                return help_init_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 3 && (strcmp (argv[1], "-l") == 0 || strcmp (argv[1], "--level") == 0)) {
+            char *end = NULL;
+            level = strtoul (argv[2], &end, 0);
+            if (!end || *end != '\0' || level > UINT_MAX)
+                return help_init_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+    if (argc != 2)
+        return help_init_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_init_exit (EXIT_SUCCESS, argv[0]);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0777);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    if (spooldir_set_fanout (spool, (unsigned) fanout) < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not set fan-out for spool '%s'", argv[1]);
+    }
+    if (counters && spooldir_set_counters (spool, true) < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not create counters for spool '%s'", argv[1]);
+    }
+    if (dedup && spooldir_set_dedup (spool, true) < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not enable deduplication for spool '%s'", argv[1]);
+    }
+    if (spooldir_set_codec (spool, codec, (unsigned) level) < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not set the codec for spool '%s'", argv[1]);
+    }
+    spooldir_close (spool);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_count_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [-x] <spooldir> [new|wip|cur]\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+count_main (int argc, char *argv[])
+{
+    static const struct {
+        const char          *name;
+        enum spooldir_status status;
+    } statuses[] = {
+        { "new", SPOOLDIR_STATUS_NEW },
+        { "wip", SPOOLDIR_STATUS_WIP },
+        { "cur", SPOOLDIR_STATUS_CUR },
+    };
+    static const unsigned n_statuses = sizeof (statuses) / sizeof (statuses[0]);
+    unsigned flags = 0;
+
+    if (argc > 2 && (strcmp (argv[1], "-x") == 0 || strcmp (argv[1], "--exact") == 0)) {
+        flags |= SPOOLDIR_COUNT_EXACT;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 2 && argc != 3)
+        return help_count_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_count_exit (EXIT_SUCCESS, argv[0]);
+
+    unsigned first = 0, last = n_statuses;
+    if (argc == 3) {
+        for (first = 0; first < n_statuses; first++)
+            if (strcmp (argv[2], statuses[first].name) == 0)
+                break;
+        if (first == n_statuses)
+            return help_count_exit (EXIT_FAILURE, argv[0]);
+        last = first + 1;
+    }
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    for (unsigned i = first; i < last; i++) {
+        ssize_t count = spooldir_count (spool, statuses[i].status, flags);
+        if (count < 0) {
+            int e = errno;
+            spooldir_close (spool);
+            return err_exit (e, "Could not count items in spool");
+        }
+        if (argc == 3)
+            printf ("%zd\n", count);
+        else
+            printf ("%s %zd\n", statuses[i].name, count);
+    }
+    spooldir_close (spool);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_reap_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s <spooldir> <timeout>\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+reap_main (int argc, char *argv[])
+{
+    if (argc == 2 && (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0))
+        return help_reap_exit (EXIT_SUCCESS, argv[0]);
+    if (argc != 3)
+        return help_reap_exit (EXIT_FAILURE, argv[0]);
+
+    char *end = NULL;
+    unsigned long timeout = strtoul (argv[2], &end, 0);
+    if (!end || *end != '\0' || timeout > UINT_MAX)
+        return help_reap_exit (EXIT_FAILURE, argv[0]);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    ssize_t count = spooldir_reap (spool, (unsigned) timeout);
+    if (count < 0) {
+        int e = errno;
+        spooldir_close (spool);
+        return err_exit (e, "Could not reap items in spool");
+    }
+    spooldir_close (spool);
+
+    printf ("%zd\n", count);
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_recover_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [--tmp-age SECONDS] [--wip-timeout SECONDS] [--threads N] [-v] <spooldir>\n",
+             argv0);
+    exit (code);
+    return code;
+}
+
+
+static void
+recover_progress_cb (spooldir *spool, const struct spooldir_recover_stats *stats, void *userdata)
+{
+    fprintf (stderr, "\r%u/%u directories, %zu entries, %zu removed, %zu restored",
+             stats->dirs_done, stats->dirs_total, stats->scanned, stats->removed, stats->restored);
+}
+
+
+static int
+recover_main (int argc, char *argv[])
+{
+    struct spooldir_recover_policy policy = {
+        .tmp_age = SPOOLDIR_RECOVER_TMP_AGE,
+    };
+    _Bool verbose = false;
+
+    for (;;) {
+        unsigned *value = NULL;
+        if (argc > 3 && (strcmp (argv[1], "-t") == 0 || strcmp (argv[1], "--tmp-age") == 0))
+            value = &policy.tmp_age;
+        else if (argc > 3 && (strcmp (argv[1], "-w") == 0 || strcmp (argv[1], "--wip-timeout") == 0))
+            value = &policy.wip_timeout;
+        else if (argc > 3 && (strcmp (argv[1], "-j") == 0 || strcmp (argv[1], "--threads") == 0))
+            value = &policy.n_threads;
+
+        if (value) {
+            char *end = NULL;
+            unsigned long v = strtoul (argv[2], &end, 0);
+            if (!end || *end != '\0' || v > UINT_MAX)
+                return help_recover_exit (EXIT_FAILURE, argv[0]);
+            *value = (unsigned) v;
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && (strcmp (argv[1], "-v") == 0 || strcmp (argv[1], "--verbose") == 0)) {
+            verbose = true;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+    }
+    if (argc != 2)
+        return help_recover_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_recover_exit (EXIT_SUCCESS, argv[0]);
+
+    if (verbose)
+        policy.progress = recover_progress_cb;
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    struct spooldir_recover_stats stats;
+    int retval = spooldir_recover (spool, &policy, &stats);
+    int e = errno;
+    spooldir_close (spool);
+    if (verbose)
+        fputc ('\n', stderr);
+    if (retval < 0)
+        return err_exit (e, "Could not recover spool");
+
+    printf ("%zu %zu\n", stats.removed, stats.restored);
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_purge_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [--max-age SECONDS] [--keep N] [--archive FILE] [--new] <spooldir>\n",
+             argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+purge_main (int argc, char *argv[])
+{
+    enum spooldir_status status = SPOOLDIR_STATUS_CUR;
+    unsigned long max_age = 0;
+    unsigned long long keep = SIZE_MAX;
+    const char *archive = NULL;
+
+    for (;;) {
+        char *end = NULL;
+        if (argc > 3 && (strcmp (argv[1], "-a") == 0 || strcmp (argv[1], "--max-age") == 0)) {
+            max_age = strtoul (argv[2], &end, 0);
+            if (!end || *end != '\0' || max_age > UINT_MAX)
+                return help_purge_exit (EXIT_FAILURE, argv[0]);
+        } else if (argc > 3 && (strcmp (argv[1], "-k") == 0 || strcmp (argv[1], "--keep") == 0)) {
+            keep = strtoull (argv[2], &end, 0);
+            if (!end || *end != '\0')
+                return help_purge_exit (EXIT_FAILURE, argv[0]);
+        } else if (argc > 3 && (strcmp (argv[1], "-A") == 0 || strcmp (argv[1], "--archive") == 0)) {
+            archive = argv[2];
+        } else if (argc > 2 && (strcmp (argv[1], "-n") == 0 || strcmp (argv[1], "--new") == 0)) {
+            status = SPOOLDIR_STATUS_NEW;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+            continue;
+        } else {
+            break;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2)
+        return help_purge_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_purge_exit (EXIT_SUCCESS, argv[0]);
+
+    int archive_fd = -1;
+    if (archive && (archive_fd = open (archive, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0)
+        return err_exit (errno, "Could not open archive '%s'", archive);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+    spooldir_set_archive (spool, archive_fd);
+
+    ssize_t count = spooldir_purge (spool, status, (unsigned) max_age,
+                                    (keep > SIZE_MAX) ? SIZE_MAX : (size_t) keep);
+    int e = errno;
+    spooldir_close (spool);
+    if (archive_fd >= 0 && close (archive_fd) < 0 && count >= 0) {
+        e = errno;
+        count = -1;
+    }
+    if (count < 0)
+        return err_exit (e, "Could not purge items from spool");
+
+    printf ("%zd\n", count);
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_send_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [--follow] [--ack FD] <spooldir>\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+parse_fd (const char *arg)
+{
+    char *end = NULL;
+    unsigned long fd = strtoul (arg, &end, 0);
+    return (!end || *end != '\0' || fd > INT_MAX) ? -1 : (int) fd;
+}
+
+
+static int
+send_main (int argc, char *argv[])
+{
+    unsigned flags = 0;
+    int ack_fd = -1;
+
+    for (;;) {
+        if (argc > 3 && (strcmp (argv[1], "-a") == 0 || strcmp (argv[1], "--ack") == 0)) {
+            if ((ack_fd = parse_fd (argv[2])) < 0)
+                return help_send_exit (EXIT_FAILURE, argv[0]);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 2 && (strcmp (argv[1], "-f") == 0 || strcmp (argv[1], "--follow") == 0)) {
+            flags |= SPOOLDIR_REPLICATE_FOLLOW;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+    }
+    if (argc != 2)
+        return help_send_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_send_exit (EXIT_SUCCESS, argv[0]);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    int retval = spooldir_replicate_send (spool, STDOUT_FILENO, ack_fd, flags);
+    int e = errno;
+    spooldir_close (spool);
+    if (retval < 0)
+        return err_exit (e, "Could not send spool contents");
+    return EXIT_SUCCESS;
+}
+
+
+static int
+help_recv_exit (int code, const char *argv0)
+{
+    fprintf (stderr, "Usage: %s [--ack FD] <spooldir>\n", argv0);
+    exit (code);
+    return code;
+}
+
+
+static int
+recv_main (int argc, char *argv[])
+{
+    int ack_fd = -1;
+
+    if (argc > 3 && (strcmp (argv[1], "-a") == 0 || strcmp (argv[1], "--ack") == 0)) {
+        if ((ack_fd = parse_fd (argv[2])) < 0)
+            return help_recv_exit (EXIT_FAILURE, argv[0]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2)
+        return help_recv_exit (EXIT_FAILURE, argv[0]);
+    if (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)
+        return help_recv_exit (EXIT_SUCCESS, argv[0]);
+
+    spooldir *spool = spooldir_open_path (argv[1], 0);
+    if (!spool) return err_exit (errno, "Could not open spool '%s'", argv[1]);
+
+    int retval = spooldir_replicate_recv (spool, STDIN_FILENO, ack_fd);
+    int e = errno;
+    spooldir_close (spool);
+    if (retval < 0)
+        return err_exit (e, "Could not receive spool contents");
     return EXIT_SUCCESS;
 }
 
@@ -119,6 +830,13 @@ main (int argc, char *argv[])
 {
     static const char *cmd_add_names[] = { "spool-add", "spool", "add", NULL };
     static const char *cmd_pick_names[] = { "spool-pick", "pick", NULL };
+    static const char *cmd_init_names[] = { "spool-init", "init", NULL };
+    static const char *cmd_count_names[] = { "spool-count", "count", NULL };
+    static const char *cmd_reap_names[] = { "spool-reap", "reap", NULL };
+    static const char *cmd_recover_names[] = { "spool-recover", "recover", NULL };
+    static const char *cmd_send_names[] = { "spool-send", "send", NULL };
+    static const char *cmd_recv_names[] = { "spool-recv", "recv", NULL };
+    static const char *cmd_purge_names[] = { "spool-purge", "purge", NULL };
 
     static const struct {
         int (*run) (int, char*[]);
@@ -126,6 +844,13 @@ main (int argc, char *argv[])
     } cmds[] = {
         { add_main, cmd_add_names },
         { pick_main, cmd_pick_names },
+        { init_main, cmd_init_names },
+        { count_main, cmd_count_names },
+        { reap_main, cmd_reap_names },
+        { recover_main, cmd_recover_names },
+        { purge_main, cmd_purge_names },
+        { send_main, cmd_send_names },
+        { recv_main, cmd_recv_names },
     };
     static const __auto_type n_cmds = sizeof (cmds) / sizeof (cmds[0]);
 
@@ -12,14 +12,28 @@
 #include "mkdirp/mkdirp.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#if SPOOLDIR_WITH_ZSTD
+#include <zstd.h>
+#endif /* SPOOLDIR_WITH_ZSTD */
 
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
@@ -41,6 +55,10 @@
 #warning Your system headers do not define O_PATH
 #endif /* !O_PATH */
 
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif /* !MAP_POPULATE */
+
 
 enum {
     SPOOLDIR_DIR_O_FLAGS = O_DIRECTORY | O_NOFOLLOW | O_PATH,
@@ -51,21 +69,163 @@ enum {
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 # define HAVE_ARC4RANDOM 1
 # define HAVE_RENAMEAT   1
+# define HAVE_KQUEUE     1
+# include <sys/event.h>
 #elif defined(__linux) || defined(__linux__)
 # define HAVE_RENAMEAT   1
+# define HAVE_RENAMEAT2  1
+# define HAVE_GETDENTS64 1
+# define HAVE_INOTIFY    1
+# define HAVE_COPY_FILE_RANGE 1
+# define HAVE_SPLICE     1
+# define HAVE_EVENTFD    1
+# define HAVE_SENDFILE   1
+# define HAVE_POSIX_FADVISE 1
+# include <sys/inotify.h>
+# include <sys/eventfd.h>
+# include <sys/sendfile.h>
+# include <sys/ioctl.h>
 # include <linux/fs.h>
 # include <syscall.h>
-# define renameat(ifd, iname, ofd, oname) \
-    (syscall (SYS_renameat2, (ifd), (iname), (ofd), (oname), RENAME_NOREPLACE))
+# ifdef FICLONE
+#  define HAVE_FICLONE 1
+# endif
+# ifdef O_TMPFILE
+#  define HAVE_O_TMPFILE 1
+# endif
+# if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   include <linux/io_uring.h>
+#   ifdef IORING_FEAT_CQE_SKIP  /* Headers from Linux 5.17 or newer. */
+#    define HAVE_IO_URING 1
+#   endif
+#  endif
+# endif
 #endif
 
+#ifndef HAVE_RENAMEAT2
+#define HAVE_RENAMEAT2 0
+#endif /* !HAVE_RENAMEAT2 */
+
+#ifndef HAVE_O_TMPFILE
+#define HAVE_O_TMPFILE 0
+#endif /* !HAVE_O_TMPFILE */
+
+#ifndef HAVE_IO_URING
+#define HAVE_IO_URING 0
+#endif /* !HAVE_IO_URING */
+
+#ifndef HAVE_COPY_FILE_RANGE
+#define HAVE_COPY_FILE_RANGE 0
+#endif /* !HAVE_COPY_FILE_RANGE */
+
+#ifndef HAVE_SPLICE
+#define HAVE_SPLICE 0
+#endif /* !HAVE_SPLICE */
+
+#ifndef HAVE_FICLONE
+#define HAVE_FICLONE 0
+#endif /* !HAVE_FICLONE */
+
+#ifndef HAVE_EVENTFD
+#define HAVE_EVENTFD 0
+#endif /* !HAVE_EVENTFD */
+
+#ifndef HAVE_SENDFILE
+#define HAVE_SENDFILE 0
+#endif /* !HAVE_SENDFILE */
+
+#ifndef HAVE_POSIX_FADVISE
+#define HAVE_POSIX_FADVISE 0
+#endif /* !HAVE_POSIX_FADVISE */
+
+#ifndef SPOOLDIR_WITH_ZSTD
+#define SPOOLDIR_WITH_ZSTD 0
+#endif /* !SPOOLDIR_WITH_ZSTD */
+
 
 struct _spoolkey {
     _Bool    inheap;
+    _Bool    isinline;  /* Storage provided by a "spoolkey_inline". */
     uint16_t length;
     char    *bytes;
 };
 
+_Static_assert (sizeof (struct _spoolkey) <= sizeof (((spoolkey_inline*) 0)->__priv),
+                "struct _spoolkey does not fit in spoolkey_inline");
+
+
+/*
+ * Commits waiting to be made durable together. The first committer which
+ * finds no leader becomes one: it waits for more commits to arrive, then
+ * syncs and publishes all of them, and wakes up the other committers.
+ */
+struct group_entry {
+    spooltxn           *txn;
+    int                 result;
+    int                 error;
+    bool                done;
+    struct group_entry *next;
+};
+
+struct commit_group {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    struct group_entry *head;
+    struct group_entry **tail;
+    size_t              count;
+    bool                leader;
+    unsigned            window_usec;
+    unsigned            max_count;
+};
+
+
+/*
+ * Instrumentation, compiled in only when SPOOLDIR_ENABLE_STATS is defined.
+ * Latencies go to histograms with power-of-two buckets, in nanoseconds.
+ */
+#if SPOOLDIR_ENABLE_STATS
+struct stats {
+    atomic_uint_fast64_t adds;
+    atomic_uint_fast64_t commits;
+    atomic_uint_fast64_t rollbacks;
+    atomic_uint_fast64_t picks;
+    atomic_uint_fast64_t pick_races;
+    atomic_uint_fast64_t entries_scanned;
+    atomic_uint_fast64_t bytes_written;
+    atomic_uint_fast64_t latency[SPOOLDIR_STAGE_COUNT][SPOOLDIR_STATS_BUCKETS];
+};
+
+static inline uint64_t
+stats_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static inline void
+stats_record (struct stats *stats, enum spooldir_stage stage, uint64_t start)
+{
+    uint64_t ns = stats_now () - start;
+    unsigned bucket = ns ? 63 - __builtin_clzll (ns) : 0;
+    if (bucket >= SPOOLDIR_STATS_BUCKETS)
+        bucket = SPOOLDIR_STATS_BUCKETS - 1;
+    atomic_fetch_add_explicit (&stats->latency[stage][bucket], 1, memory_order_relaxed);
+}
+
+# define STAT_ADD(spool, name, n) \
+    atomic_fetch_add_explicit (&(spool)->stats.name, (n), memory_order_relaxed)
+# define STAT_TIME_START(var)  const uint64_t var = stats_now ()
+# define STAT_TIME_END(spool, stage, var)  stats_record (&(spool)->stats, (stage), (var))
+#else
+# define STAT_ADD(spool, name, n)          ((void) 0)
+# define STAT_TIME_START(var)              ((void) 0)
+# define STAT_TIME_END(spool, stage, var)  ((void) 0)
+#endif /* SPOOLDIR_ENABLE_STATS */
+
+#define STAT_INC(spool, name) STAT_ADD (spool, name, 1)
+
 
 struct _spooldir {
     int dir_fd;
@@ -73,37 +233,123 @@ struct _spooldir {
     int new_fd;
     int wip_fd;
     int cur_fd;
+
+    /* Number of hex digits used to name fan-out buckets, zero if none. */
+    unsigned fanout_digits;
+
+    /* Keys of new elements are derived from their contents. */
+    bool dedup;
+
+    /* Compression applied to contents of elements added in one go. */
+    enum spooldir_codec codec;
+    unsigned            codec_level;  /* Zero for the codec default. */
+
+    enum spoolkey_mode key_mode;
+
+    enum spooldir_durability durability;
+    struct commit_group      group;
+    enum spooldir_pick_order pick_order;
+
+    struct uring *uring;  /* Non-NULL when using the io_uring engine. */
+
+    /* Cleared at runtime when the file system does not support them. */
+    atomic_bool have_renameat2;
+    atomic_bool have_tmpfile;
+
+    pthread_mutex_t  pick_lock;
+    spooldir_cursor *pick_cursor;
+
+    spooldir_notifier *notifier;
+
+    struct spool_index *index;  /* Non-NULL when enabled. */
+    struct counts_file *counts; /* Mapped counters file, or NULL. */
+    unsigned lease_secs;        /* Lease stamped on picked elements. */
+    unsigned prefetch_window;   /* Upcoming candidates read ahead when picking. */
+    int archive_fd;             /* Purged elements are archived here. */
+
+#if SPOOLDIR_ENABLE_STATS
+    struct stats stats;
+#endif
+};
+
+
+/*
+ * Private part of a transaction, stored in "spooltxn.__pad".
+ */
+struct txn_priv {
+    uint16_t flags;
+    uint16_t shard;    /* Index of the spool in a spoolset. */
+    void    *map;      /* Mapping from spooldir_map(), or NULL. */
+    size_t   map_len;
+};
+
+enum {
+    TXN_TMPFILE  = 1 << 0,  /* File created with O_TMPFILE, without a name. */
+    TXN_DERIVED  = 1 << 1,  /* Key already derived from the contents. */
+    TXN_MAP_HEAP = 1 << 2,  /* Mapping holds decoded contents from malloc(). */
 };
 
+_Static_assert (sizeof (struct txn_priv) <= SPOOLTXN__PAD,
+                "struct txn_priv does not fit in spooltxn");
+
+static inline struct txn_priv*
+txn_priv (spooltxn *txn)
+{
+    return (struct txn_priv*) txn->__pad;
+}
+
+static inline void
+txn_priv_init (spooltxn *txn)
+{
+    memset (txn->__pad, 0, sizeof (struct txn_priv));
+}
+
 
 #define RNG_KEY_SIZE HMAC_SHA256_DIGEST_SIZE
 
+enum {
+    SIPHASH_KEY_SIZE = 16,
+    SIPHASH_DIGEST_SIZE = 16,
+    SPOOLKEY_GENERATED_MAX = RNG_KEY_SIZE * 2,
+    PRIORITY_PREFIX_LEN = 2,  /* A digit and a dash. */
+};
+
 
 static void
 random_bytes (void *buffer, size_t len)
 {
-    FILE *f;
+#if HAVE_ARC4RANDOM
+    arc4random_buf (buffer, len);
+#else
     size_t pos = 0;
 
-    if ((f = fopen ("/dev/urandom", "rb"))) {
-        /* Assume that each fread() will return one byte at least */
-        size_t tries = len;
-        while (pos < len && tries--) {
-            pos += fread (buffer, 1, len, f);
+#if defined(SYS_getrandom)
+    while (pos < len) {
+        long nread = syscall (SYS_getrandom, ((uint8_t*) buffer) + pos, len - pos, 0);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
         }
-        fclose (f);
-        if (pos >= len) {
-            return;
+        pos += (size_t) nread;
+    }
+#endif
+
+    int fd;
+    if (pos < len && (fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC)) >= 0) {
+        while (pos < len) {
+            ssize_t nread = read (fd, ((uint8_t*) buffer) + pos, len - pos);
+            if (nread <= 0) {
+                if (nread < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            pos += (size_t) nread;
         }
+        close (fd);
     }
 
     /* Use the fall-back mechanism to read (len-pos) bytes. */
-    assert_ok (pos < len);
-
-#if HAVE_ARC4RANDOM
-    arc4random_buf (((uint8_t*) buffer) + pos, len - pos);
-#else
-    /* TODO: Try using getrandom() on GNU/Linux, or rand48(). */
     while (pos < len) ((uint8_t*) buffer)[pos++] = rand ();
 #endif
 }
@@ -112,16 +358,36 @@ random_bytes (void *buffer, size_t len)
 struct rng {
     uint8_t  key[RNG_KEY_SIZE];
     uint64_t count;
+    uint64_t last_msec;     /* Used for time-ordered keys. */
+    uint16_t msec_count;
 };
 
 static pthread_key_t rng_tls_key;
 static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+static unsigned rng_generation;  /* Incremented in forked children. */
+
+
+/*
+ * A forked child inherits the key generator state of the thread which
+ * called fork(), and would generate exactly the same keys as its parent.
+ */
+static void
+rng_atfork_child (void)
+{
+    struct rng *r = pthread_getspecific (rng_tls_key);
+    if (r) {
+        random_bytes (r->key, RNG_KEY_SIZE);
+        r->count = 0;
+    }
+    rng_generation++;
+}
 
 
 static void
 init_rng_tls_key (void)
 {
-    (void) pthread_key_create (&rng_tls_key, NULL);
+    (void) pthread_key_create (&rng_tls_key, free);
+    (void) pthread_atfork (NULL, NULL, rng_atfork_child);
     srand ((unsigned int) (getpid () ^ time (NULL)));
 }
 
@@ -142,35 +408,218 @@ get_rng (void)
 }
 
 
+static inline uint64_t
+load_le64 (const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (unsigned i = 0; i < 8; i++)
+        v |= ((uint64_t) p[i]) << (8 * i);
+    return v;
+}
+
+
+static inline void
+store_le64 (uint8_t *p, uint64_t v)
+{
+    for (unsigned i = 0; i < 8; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+
+#define SIPHASH_ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3)                                   \
+    do {                                                                \
+        v0 += v1; v1 = SIPHASH_ROTL (v1, 13); v1 ^= v0;                 \
+        v0 = SIPHASH_ROTL (v0, 32);                                     \
+        v2 += v3; v3 = SIPHASH_ROTL (v3, 16); v3 ^= v2;                 \
+        v0 += v3; v3 = SIPHASH_ROTL (v3, 21); v3 ^= v0;                 \
+        v2 += v1; v1 = SIPHASH_ROTL (v1, 17); v1 ^= v2;                 \
+        v2 = SIPHASH_ROTL (v2, 32);                                     \
+    } while (0)
+
+/*
+ * SipHash-2-4 with 128-bit output, specialized for a single 64-bit word
+ * of input data.
+ */
+static void
+siphash_u64 (uint8_t digest[SIPHASH_DIGEST_SIZE], uint64_t m,
+             const uint8_t key[SIPHASH_KEY_SIZE])
+{
+    const uint64_t k0 = load_le64 (key);
+    const uint64_t k1 = load_le64 (key + 8);
+    const uint64_t b = ((uint64_t) sizeof (m)) << 56;
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    v3 ^= m;
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    v0 ^= m;
+
+    v3 ^= b;
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    for (unsigned i = 0; i < 4; i++)
+        SIPHASH_ROUND (v0, v1, v2, v3);
+    store_le64 (digest, v0 ^ v1 ^ v2 ^ v3);
+
+    v1 ^= 0xdd;
+    for (unsigned i = 0; i < 4; i++)
+        SIPHASH_ROUND (v0, v1, v2, v3);
+    store_le64 (digest + 8, v0 ^ v1 ^ v2 ^ v3);
+}
+
+
 /*
- * Generates a new unique key (filename) to be used for a spool element. The original
- * algorithm is described in the Maildir specification by Daniel J. Bernstein:
- * http://cr.yp.to/proto/maildir.html
+ * Writes the characters of a new key into "bytes", which must have room
+ * for SPOOLKEY_GENERATED_MAX characters plus the terminating null, and
+ * returns the length of the key.
+ *
+ * The original algorithm is described in the Maildir specification by
+ * Daniel J. Bernstein: http://cr.yp.to/proto/maildir.html
  *
  * Unfortunately, the original algorithm leaks some host specific information, which
  * would be nicer to avoid. Instead, this uses HMAC-SHA256 with a random seed as key,
  * and the bytes of en ever-increasing counter as data payload. This approach is used
  * in Salvatore “antirez” Sanfillippo's Disque: http://antirez.com/news/99
+ *
+ * SipHash is a much cheaper keyed PRF, which is used in the same way. Its
+ * 128-bit output is enough to avoid collisions.
+ *
+ * Time-ordered keys start with the current time in milliseconds (48 bits)
+ * and a counter (16 bits) which keeps keys generated by the same thread
+ * ordered during the same millisecond, followed by 64 bits of SipHash
+ * output. Sorting them by name yields approximately the order in which
+ * they were created.
  */
-spoolkey*
-spoolkey_new (void)
+static size_t
+generate_key_rng (struct rng *rng, enum spoolkey_mode mode, char *bytes)
 {
-    uint8_t digest[HMAC_SHA256_DIGEST_SIZE];
+    uint8_t digest[RNG_KEY_SIZE];
+    size_t digest_size;
+
+    switch (mode) {
+        case SPOOLKEY_SIPHASH:
+            siphash_u64 (digest, rng->count, rng->key);
+            digest_size = SIPHASH_DIGEST_SIZE;
+            break;
+
+        case SPOOLKEY_TIME_ORDERED: {
+            struct timespec ts;
+            clock_gettime (CLOCK_REALTIME, &ts);
+            uint64_t msec = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+            /* Never go backwards, even if the clock does. */
+            if (msec <= rng->last_msec) {
+                msec = rng->last_msec;
+                if (++rng->msec_count == 0)
+                    msec = ++rng->last_msec;
+            } else {
+                rng->last_msec = msec;
+                rng->msec_count = 0;
+            }
+
+            for (unsigned i = 0; i < 6; i++)
+                digest[i] = (uint8_t) (msec >> (8 * (5 - i)));
+            digest[6] = (uint8_t) (rng->msec_count >> 8);
+            digest[7] = (uint8_t) rng->msec_count;
+
+            uint8_t tail[SIPHASH_DIGEST_SIZE];
+            siphash_u64 (tail, rng->count, rng->key);
+            memcpy (digest + 8, tail, 8);
+            digest_size = 16;
+            break;
+        }
 
-    /* Generate HMAC-SHA256(K, count) */
-    struct rng *rng = get_rng ();
-    hmac_sha256 (digest,
-                 (const uint8_t*) &rng->count, sizeof (rng->count),
-                 rng->key, RNG_KEY_SIZE);
+        case SPOOLKEY_HMAC_SHA256:
+        default:
+            /* Generate HMAC-SHA256(K, count) */
+            hmac_sha256 (digest,
+                         (const uint8_t*) &rng->count, sizeof (rng->count),
+                         rng->key, RNG_KEY_SIZE);
+            digest_size = HMAC_SHA256_DIGEST_SIZE;
+            break;
+    }
     rng->count++;
 
-    spoolkey *key = (spoolkey*) calloc (1, sizeof(spoolkey) + RNG_KEY_SIZE * 2 + 1);
+    int nbytes = hexify (digest, digest_size, bytes, SPOOLKEY_GENERATED_MAX + 1);
+    assert_equal ((size_t) nbytes, digest_size * 2);
+    return (size_t) nbytes;
+}
+
+
+static inline size_t
+generate_key (enum spoolkey_mode mode, char *bytes)
+{
+    return generate_key_rng (get_rng (), mode, bytes);
+}
+
+
+spoolkey*
+spoolkey_new_with_mode (enum spoolkey_mode mode)
+{
+    spoolkey *key = (spoolkey*) calloc (1, sizeof(spoolkey) + SPOOLKEY_GENERATED_MAX + 1);
     key->inheap = false;
-    key->length = RNG_KEY_SIZE * 2;
     key->bytes = (char*) &key[1];
-    int nbytes = hexify (digest, HMAC_SHA256_DIGEST_SIZE, key->bytes, key->length + 1);
-    assert_equal (nbytes, key->length);
-    (void) nbytes;
+    key->length = generate_key (mode, key->bytes);
+    return key;
+}
+
+
+spoolkey*
+spoolkey_new (void)
+{
+    return spoolkey_new_with_mode (SPOOLKEY_HMAC_SHA256);
+}
+
+
+static inline spoolkey*
+inline_key (spoolkey_inline *storage)
+{
+    spoolkey *key = (spoolkey*) storage->__priv;
+    key->inheap = false;
+    key->isinline = true;
+    key->bytes = storage->__bytes;
+    return key;
+}
+
+
+spoolkey*
+spoolkey_init_new (spoolkey_inline *storage, enum spoolkey_mode mode)
+{
+    api_check_return_val (storage, NULL);
+
+    _Static_assert ((int) SPOOLKEY_GENERATED_MAX + PRIORITY_PREFIX_LEN <= (int) SPOOLKEY_INLINE_SIZE,
+                    "generated keys do not fit in spoolkey_inline");
+
+    spoolkey *key = inline_key (storage);
+    key->length = generate_key (mode, key->bytes);
+    return key;
+}
+
+
+spoolkey*
+spoolkey_init_inline (spoolkey_inline *storage, const void *bytes, size_t len)
+{
+    api_check_return_val (storage, NULL);
+    api_check_return_val (bytes, NULL);
+    api_check_return_val (len > 0, NULL);
+
+    if (len > SPOOLKEY_INLINE_SIZE) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    spoolkey *key = inline_key (storage);
+    key->length = len;
+    memcpy (key->bytes, bytes, len);
+    key->bytes[len] = '\0';
     return key;
 }
 
@@ -208,15 +657,38 @@ spoolkey_cstr (const spoolkey *key)
 }
 
 
+size_t
+spoolkey_length (const spoolkey *key)
+{
+    api_check_return_val (key, 0);
+    return key->length;
+}
+
+
 void
 spoolkey_free (spoolkey *key)
 {
     api_check_return (key);
+    if (key->isinline) return;
     if (key->inheap) free (key->bytes);
     free (key);
 }
 
 
+/*
+ * Keys for names which do not fit in the inline storage of a transaction
+ * are allocated in the heap.
+ */
+static inline spoolkey*
+txn_key_from_name (spooltxn *txn, const char *name)
+{
+    size_t len = strlen (name);
+    return (len <= SPOOLKEY_INLINE_SIZE)
+        ? spoolkey_init_inline (&txn->__key, name, len)
+        : spoolkey_new_from_mem (name, len, true, true);
+}
+
+
 spoolkey*
 spooltxn_take_key (spooltxn *txn)
 {
@@ -224,7 +696,28 @@ spooltxn_take_key (spooltxn *txn)
 
     spoolkey *key = txn->key;
     txn->key = NULL;
-    return key;
+
+    /* The storage of inline keys is reused by the next transaction. */
+    return (key && key->isinline) ? spoolkey_copy (key) : key;
+}
+
+
+spoolkey*
+spooltxn_take_key_inline (spooltxn *txn, spoolkey_inline *storage)
+{
+    api_check_return_val (txn, NULL);
+    api_check_return_val (storage, NULL);
+
+    spoolkey *key = txn->key;
+    if (!key)
+        return NULL;
+
+    spoolkey *result = spoolkey_init_inline (storage, key->bytes, key->length);
+    if (result) {
+        spoolkey_free (key);
+        txn->key = NULL;
+    }
+    return result;
 }
 
 
@@ -233,113 +726,115 @@ spooltxn_take_fd (spooltxn *txn)
 {
     api_check_return_val (txn, -1);
 
+    /*
+     * Files without a name can only be linked into the spool while being
+     * open: hand out a duplicate and keep the original descriptor.
+     */
+    if (txn->status == SPOOLDIR_STATUS_TMP && (txn_priv (txn)->flags & TXN_TMPFILE))
+        return dup (txn->fd);
+
     int fd = txn->fd;
     txn->fd = -1;
     return fd;
 }
 
 
-static int
-open_or_create_subdir (int dir_fd, const char *subdir)
+int
+spooldir_set_key_mode (spooldir *spool, enum spoolkey_mode mode)
 {
-    struct stat sb;
-    if (fstatat (dir_fd, subdir, &sb, AT_SYMLINK_NOFOLLOW)) {
-        if (errno == ENOENT) {
-            /* Create. */
-            if (mkdirat (dir_fd, subdir, S_IRWXU) && errno != EEXIST) {
-                return -1;
-            }
-        } else {
-            return -1;
-        }
+    api_check_return_val (spool, -1);
+
+    switch (mode) {
+        case SPOOLKEY_HMAC_SHA256:
+        case SPOOLKEY_SIPHASH:
+        case SPOOLKEY_TIME_ORDERED:
+            spool->key_mode = mode;
+            return 0;
     }
 
-    return openat (dir_fd, subdir, O_RDWR | SPOOLDIR_DIR_O_FLAGS);
+    errno = EINVAL;
+    return -1;
 }
 
 
-spooldir*
-spooldir_open_path (const char *path, uint32_t mode)
+enum spoolkey_mode
+spooldir_get_key_mode (const spooldir *spool)
 {
-    api_check_return_val (path, NULL);
+    api_check_return_val (spool, SPOOLKEY_HMAC_SHA256);
+    return spool->key_mode;
+}
 
-    int dir_fd = open (path, O_RDWR | SPOOLDIR_DIR_O_FLAGS, 0);
-    if (dir_fd < 0) {
-        if (mode && errno == ENOENT) {
-            if ((mkdirp (path, (mode_t) mode) == -1) ||
-                (dir_fd = open (path, O_RDWR | SPOOLDIR_DIR_O_FLAGS, 0)) == -1)
-            {
-                return NULL;
-            }
-        } else {
-            return NULL;
-        }
+
+int
+spooldir_set_pick_order (spooldir *spool, enum spooldir_pick_order order)
+{
+    api_check_return_val (spool, -1);
+
+    switch (order) {
+        case SPOOLDIR_PICK_ANY:
+        case SPOOLDIR_PICK_FIFO:
+        case SPOOLDIR_PICK_KEY:
+            spool->pick_order = order;
+            return 0;
     }
 
-    spooldir *spool = spooldir_open (dir_fd);
-    if (!spool) close (dir_fd);
-    return spool;
+    errno = EINVAL;
+    return -1;
 }
 
 
-/*
- * TODO: This should flock() the top-level directory to ensure that two
- * different processes do not try to mkdir() the subdirectories at the
- * same time!
- */
-spooldir* spooldir_open (int dir_fd)
+int
+spooldir_set_prefetch (spooldir *spool, unsigned window)
 {
-    api_check_return_val (dir_fd >= 0, NULL);
+    api_check_return_val (spool, -1);
 
-    /* Check for existence, create if needed (and requested). */
-    struct stat sb;
-    if (fstat (dir_fd, &sb)) {
-        /* TODO: Report errors. */
-        return NULL;
-    }
-    if (!S_ISDIR (sb.st_mode)) {
-        /* TODO: Report errors. */
-        return NULL;
+    if (window > SPOOLDIR_PREFETCH_MAX) {
+        errno = EINVAL;
+        return -1;
     }
+    spool->prefetch_window = window;
+    return 0;
+}
 
-    int tmp_fd = -1, new_fd = -1, wip_fd = -1, cur_fd = -1;
-    if ((tmp_fd = open_or_create_subdir (dir_fd, "tmp")) < 0 ||
-        (new_fd = open_or_create_subdir (dir_fd, "new")) < 0 ||
-        (wip_fd = open_or_create_subdir (dir_fd, "wip")) < 0 ||
-        (cur_fd = open_or_create_subdir (dir_fd, "cur")) < 0)
-    {
-        /* TODO: Report errors. */
-        goto close_and_cleanup;
-    }
 
-    spooldir *spool = (spooldir*) calloc (1, sizeof (spooldir));
-    spool->dir_fd = dir_fd;
-    spool->tmp_fd = tmp_fd;
-    spool->new_fd = new_fd;
-    spool->wip_fd = wip_fd;
-    spool->cur_fd = cur_fd;
-    return spool;
-
-close_and_cleanup:
-    if (tmp_fd >= 0) close (tmp_fd);
-    if (new_fd >= 0) close (new_fd);
-    if (wip_fd >= 0) close (wip_fd);
-    if (cur_fd >= 0) close (cur_fd);
-    return NULL;
+enum spooldir_pick_order
+spooldir_get_pick_order (const spooldir *spool)
+{
+    api_check_return_val (spool, SPOOLDIR_PICK_ANY);
+    return spool->pick_order;
 }
 
 
-void
-spooldir_close (spooldir *spool)
+int
+spooldir_set_durability (spooldir *spool, enum spooldir_durability durability,
+                         unsigned window_usec, unsigned max_count)
 {
-    api_check_return (spool);
+    api_check_return_val (spool, -1);
 
-    close (spool->tmp_fd);
-    close (spool->new_fd);
-    close (spool->wip_fd);
-    close (spool->cur_fd);
+    switch (durability) {
+        case SPOOLDIR_DURABILITY_NONE:
+        case SPOOLDIR_DURABILITY_ITEM:
+        case SPOOLDIR_DURABILITY_GROUP:
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
 
-    free (spool);
+    pthread_mutex_lock (&spool->group.lock);
+    spool->durability = durability;
+    spool->group.window_usec = window_usec;
+    spool->group.max_count = max_count ? max_count : 1;
+    pthread_mutex_unlock (&spool->group.lock);
+    return 0;
+}
+
+
+enum spooldir_durability
+spooldir_get_durability (const spooldir *spool)
+{
+    api_check_return_val (spool, SPOOLDIR_DURABILITY_NONE);
+    return spool->durability;
 }
 
 
@@ -358,249 +853,7294 @@ status_to_fd (const spooldir *spool, enum spooldir_status status)
 
 
 /*
- * We cannot directly rename() files, because that could overwrite existing
- * files at the destination directory. Instead, prefer to use link(), which
- * behaves atomically:
- *
- *    1. Link the file under the destination directory.
- *    2. Open the file at the destination directory. On failure:
- *         2.1. Unlink from the destination directory.
- *    3. Unlink from the source directory. On failure:
- *         3.1. Unlink from the destination directory.
- *         3.2. Close the open file descriptor.
+ * Directory scanning. On GNU/Linux getdents64() is used directly with a
+ * large buffer, which allows fetching many entries per system call; other
+ * systems use the readdir() family of functions.
  */
-static inline int
-relink_and_open (int src_fd, int dst_fd, const char *name)
+enum {
+    DIRSCAN_BUFSZ = 64 * 1024,
+};
+
+struct dirscan {
+    int   fd;
+#if HAVE_GETDENTS64
+    size_t pos;
+    size_t len;
+    unsigned fills;  /* Times the buffer has been (re)filled. */
+    char   buf[DIRSCAN_BUFSZ];
+#else
+    DIR   *dirp;
+#endif
+};
+
+#if HAVE_GETDENTS64
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+#endif
+
+
+static int
+dirscan_init (struct dirscan *scan, int dir_fd, const char *path)
 {
-    assert_ok (src_fd >= 0);
-    assert_ok (dst_fd >= 0);
-    assert_ok (name != NULL);
+    assert_not_null (scan);
+    assert_ok (dir_fd >= 0);
+    assert_not_null (path);
 
-    int retval = -1;
-    int fd = -1;
+    /* Subdirectories are opened with O_PATH, which cannot be read. */
+    if ((scan->fd = openat (dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
 
-    if ((retval = linkat (src_fd, name, dst_fd, name, 0)) < 0) {
-        retval = -errno;
-        goto error;
-    }
-    if ((fd = openat (dst_fd, name, O_RDWR | SPOOLDIR_FILE_O_FLAGS, 0)) < 0) {
-        retval = -errno;
-        goto error_unlink_dst;
-    }
-    if ((retval = unlinkat (src_fd, name, 0)) <  0) {
-        retval = -errno;
-        goto error_unlink_dst_close_fd;
+#if HAVE_GETDENTS64
+    scan->pos = scan->len = 0;
+    scan->fills = 0;
+#else
+    if (!(scan->dirp = fdopendir (scan->fd))) {
+        int saved_errno = errno;
+        close (scan->fd);
+        errno = saved_errno;
+        return -1;
     }
-    return fd;
-
-error_unlink_dst_close_fd:
-    assert_ok (fd >= 0);
-    close (fd);
-error_unlink_dst:
-    unlinkat (dst_fd, name, 0);
-error:
-    return retval;
+#endif
+    return 0;
 }
 
 
-int
-spooldir__open_file (spooldir *spool, const spoolkey *key,
-                     enum spooldir_status status, int oflag)
+static void
+dirscan_fini (struct dirscan *scan)
 {
-    api_check_return_val (spool, -1);
-    api_check_return_val (key, -1);
-    api_check_return_val (status != SPOOLDIR_STATUS_FIN, -1);
+    assert_not_null (scan);
 
-    int subdir_fd = status_to_fd (spool, status);
-    if (subdir_fd < 0)
-        return -1;
-
-    return openat (subdir_fd, key->bytes, oflag | SPOOLDIR_FILE_O_FLAGS);
+#if HAVE_GETDENTS64
+    if (scan->fd >= 0) close (scan->fd);
+#else
+    if (scan->dirp) closedir (scan->dirp);
+    scan->dirp = NULL;
+#endif
+    scan->fd = -1;
 }
 
 
-int
-spooldir_add (spooldir *spool, spooltxn *txn)
+static void
+dirscan_rewind (struct dirscan *scan)
 {
-    api_check_return_val (spool, -1);
-    api_check_return_val (txn, -1);
+    assert_not_null (scan);
 
-    txn->key = spoolkey_new ();
-    txn->fd = openat (spool->tmp_fd, txn->key->bytes,
-                      O_CREAT | O_EXCL | O_RDWR | SPOOLDIR_FILE_O_FLAGS, 0666);
+#if HAVE_GETDENTS64
+    (void) lseek (scan->fd, 0, SEEK_SET);
+    scan->pos = scan->len = 0;
+    scan->fills++;
+#else
+    rewinddir (scan->dirp);
+#endif
+}
 
-    if (txn->fd < 0) {
-        spoolkey_free (txn->key);
-        txn->key = NULL;
-    } else {
-        txn->status = SPOOLDIR_STATUS_TMP;
+
+/*
+ * Obtains the next entry from a directory scan. Returns "1" when an entry
+ * has been read, "0" at the end of the directory, and "-1" on errors.
+ */
+static int
+dirscan_next (struct dirscan *scan, const char **name, unsigned char *type)
+{
+    assert_not_null (scan);
+    assert_not_null (name);
+    assert_not_null (type);
+
+#if HAVE_GETDENTS64
+    if (scan->pos >= scan->len) {
+        long nread = syscall (SYS_getdents64, scan->fd, scan->buf, DIRSCAN_BUFSZ);
+        if (nread <= 0)
+            return (nread < 0) ? -1 : 0;
+        scan->len = (size_t) nread;
+        scan->pos = 0;
+        scan->fills++;
     }
 
-    return txn->fd;
+    const struct linux_dirent64 *de =
+        (const struct linux_dirent64*) (scan->buf + scan->pos);
+    scan->pos += de->d_reclen;
+    *name = de->d_name;
+    *type = de->d_type;
+#else
+    errno = 0;
+    struct dirent *de = readdir (scan->dirp);
+    if (!de)
+        return errno ? -1 : 0;
+    *name = de->d_name;
+    *type = de->d_type;
+#endif
+    return 1;
 }
 
 
-int
-spooldir_commit (spooldir *spool, spooltxn *txn)
+/*
+ * Reads entries until a regular, non-hidden file is found.
+ */
+static int
+dirscan_next_file (struct dirscan *scan, const char **name)
 {
-    api_check_return_val (spool, -1);
-    api_check_return_val (txn, -1);
+    unsigned char type;
+    int retval;
 
-    int retval = -1;
+    while ((retval = dirscan_next (scan, name, &type)) > 0) {
+        if ((*name)[0] == '.')  /* Skip hidden files */
+            continue;
 
-    switch (txn->status) {
-        case SPOOLDIR_STATUS_TMP:
-            txn->status = SPOOLDIR_STATUS_NEW;
-            retval = renameat (spool->tmp_fd, txn->key->bytes,
-                               spool->new_fd, txn->key->bytes);
-            break;
+        /* Use fstatat() as fall-back to fill the field. */
+        if (type == DT_UNKNOWN) {
+            struct stat sb;
+            if (fstatat (scan->fd, *name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            if (S_ISREG (sb.st_mode))  /* We are only interested in regular files */
+                type = DT_REG;
+        }
 
-        case SPOOLDIR_STATUS_WIP:
-            txn->status = SPOOLDIR_STATUS_CUR;
-            retval = renameat (spool->wip_fd, txn->key->bytes,
-                               spool->cur_fd, txn->key->bytes);
+        if (type == DT_REG)
             break;
-
-        case SPOOLDIR_STATUS_CUR:
-        case SPOOLDIR_STATUS_NEW:
-        case SPOOLDIR_STATUS_FIN:
-            api_check_return_val (false, -1);
-            errno = EINVAL;
-            return -1;
     }
+    return retval;
+}
 
-    if (txn->key) {
-        spoolkey_free (txn->key);
-        txn->key = NULL;
+
+/*
+ * Spool metadata is stored in the ".spooldir" file at the top-level
+ * directory, so all the processes using a spool agree on its layout. Each
+ * line contains a setting name and its value, separated by a space.
+ */
+static const char spooldir_meta_name[] = ".spooldir";
+
+enum {
+    META_BUFSZ = 4096,
+};
+
+
+static int
+read_meta (spooldir *spool)
+{
+    int fd = openat (spool->dir_fd, spooldir_meta_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    char buffer[META_BUFSZ];
+    ssize_t nread = read (fd, buffer, sizeof (buffer) - 1);
+    int saved_errno = errno;
+    close (fd);
+    if (nread < 0) {
+        errno = saved_errno;
+        return -1;
     }
-    if (txn->fd >= 0) {
-        close (txn->fd);
-        txn->fd = -1;
+    buffer[nread] = '\0';
+
+    char *saveptr = NULL;
+    for (char *line = strtok_r (buffer, "\n", &saveptr); line;
+         line = strtok_r (NULL, "\n", &saveptr))
+    {
+        char name[32];
+        unsigned long value;
+        if (sscanf (line, "%31s %lu", name, &value) != 2)
+            continue;
+
+        if (strcmp (name, "fanout") == 0) {
+            switch (value) {
+                case 0:
+                case 1:    spool->fanout_digits = 0; break;
+                case 256:  spool->fanout_digits = 2; break;
+                case 4096: spool->fanout_digits = 3; break;
+                default:
+                    errno = EINVAL;
+                    return -1;
+            }
+        } else if (strcmp (name, "dedup") == 0) {
+            spool->dedup = (value != 0);
+        } else if (strcmp (name, "codec") == 0) {
+            /* Unknown codecs are kept: elements are written uncompressed. */
+            spool->codec = (enum spooldir_codec) value;
+        } else if (strcmp (name, "codec-level") == 0) {
+            spool->codec_level = (value > UINT_MAX) ? 0 : (unsigned) value;
+        }
     }
-    return retval;
+    return 0;
 }
 
 
-int
-spooldir_rollback (spooldir *spool, spooltxn *txn)
+static int
+write_meta (const spooldir *spool)
 {
-    api_check_return_val (spool, -1);
-    api_check_return_val (txn, -1);
-
-    int retval = -1;
+    static const char tmp_name[] = ".spooldir.tmp";
 
-    switch (txn->status) {
-        case SPOOLDIR_STATUS_TMP:
-            retval = unlinkat (spool->tmp_fd, txn->key->bytes, 0);
-            break;
+    char buffer[META_BUFSZ];
+    int len = snprintf (buffer, sizeof (buffer), "fanout %u\ndedup %u\ncodec %u\ncodec-level %u\n",
+                        spool->fanout_digits ? 1u << (4 * spool->fanout_digits) : 0,
+                        spool->dedup ? 1u : 0u,
+                        (unsigned) spool->codec, spool->codec_level);
 
-        case SPOOLDIR_STATUS_WIP:
-            txn->status = SPOOLDIR_STATUS_NEW;
-            retval = renameat (spool->wip_fd, txn->key->bytes,
-                               spool->new_fd, txn->key->bytes);
-            break;
+    int fd = openat (spool->dir_fd, tmp_name,
+                     O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS, 0666);
+    if (fd < 0)
+        return -1;
 
-        case SPOOLDIR_STATUS_NEW:
-        case SPOOLDIR_STATUS_CUR:
-        case SPOOLDIR_STATUS_FIN:
-            api_check_return_val (false, -1);
-            errno = EINVAL;
-            return -1;
+    if (write (fd, buffer, len) != len || fsync (fd) < 0) {
+        int saved_errno = errno;
+        close (fd);
+        unlinkat (spool->dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
     }
+    close (fd);
 
-    if (txn->key) {
-        spoolkey_free (txn->key);
-        txn->key = NULL;
-    }
-    if (txn->fd >= 0) {
-        close (txn->fd);
-        txn->fd = -1;
+    /* Replacing the previous metadata file is intended here. */
+    if (renameat (spool->dir_fd, tmp_name, spool->dir_fd, spooldir_meta_name) < 0) {
+        int saved_errno = errno;
+        unlinkat (spool->dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
     }
-    return retval;
+    return 0;
 }
 
 
-struct pick_txn {
-    spooltxn txn_base;
-    DIR     *dirp;
-};
+static inline unsigned
+spool_nbuckets (const spooldir *spool)
+{
+    return spool->fanout_digits ? 1u << (4 * spool->fanout_digits) : 1;
+}
 
 
-int
-spooldir_pick (spooldir *spool, spooltxn *txn)
+static inline void
+bucket_name (const spooldir *spool, unsigned bucket, char *name)
 {
-    api_check_return_val (spool, -1);
-    api_check_return_val (spool->new_fd >= 0, -1);
-    api_check_return_val (spool->wip_fd >= 0, -1);
-    api_check_return_val (txn, -1);
+    if (spool->fanout_digits)
+        sprintf (name, "%0*x", (int) spool->fanout_digits, bucket);
+    else
+        strcpy (name, ".");
+}
 
-    struct pick_txn *ptxn = (struct pick_txn*) txn;
 
-    int dir_fd = dup (spool->new_fd);
-    if (dir_fd < 0)
-        return dir_fd;
+/*
+ * Paths of elements relative to their status directory include the
+ * fan-out bucket, if any.
+ */
+enum {
+    SPOOLDIR_FANOUT_MAX_DIGITS = 3,
+    BUCKET_NAME_BUFSZ = SPOOLDIR_FANOUT_MAX_DIGITS + 1,
+    KEY_PATH_BUFSZ = SPOOLDIR_FANOUT_MAX_DIGITS + 1 + NAME_MAX + 1,
+};
 
-    if (!(ptxn->dirp = fdopendir (dir_fd)))
-        return -1;
 
-    struct dirent *de = NULL;
-    int retval = -1;
+/*
+ * Builds the path, relative to a status subdirectory, of an entry read from
+ * one of its buckets. Returns false if it does not fit.
+ */
+static inline bool
+bucket_entry_path (const spooldir *spool, const char *bucket, const char *name,
+                   char path[KEY_PATH_BUFSZ])
+{
+    int len = spool->fanout_digits
+        ? snprintf (path, KEY_PATH_BUFSZ, "%s/%s", bucket, name)
+        : snprintf (path, KEY_PATH_BUFSZ, "%s", name);
+    return len > 0 && len < KEY_PATH_BUFSZ;
+}
 
-    for (;;) {
-        errno = 0;
-        if (!(de = readdir (ptxn->dirp))) {
-            if (!errno) retval = EOF;
-            goto cleanup;
-        }
 
-        if (de->d_name[0] == '.')  /* Skip hidden files */
-            continue;
+static inline bool
+is_lower_xdigit (char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
 
-        /* Use fstatat() as fall-back to fill the field. */
-        if (de->d_type == DT_UNKNOWN) {
-            struct stat sb;
-            if (fstatat (spool->new_fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
-                goto cleanup;
-            if (S_ISREG (sb.st_mode))  /* We are only interested in regular files */
-                de->d_type = DT_REG;
-        }
 
-        if (de->d_type == DT_REG)
-            break;
-    }
+static inline uint32_t
+fnv1a (const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) s[i]) * 16777619u;
+    return hash;
+}
 
-    if ((txn->fd = relink_and_open (spool->new_fd, spool->wip_fd, de->d_name)) < 0)
-        goto cleanup;
 
-    txn->key = spoolkey_new_from_string (de->d_name, true, true);
-    txn->status = SPOOLDIR_STATUS_WIP;
-    return 0;
+/*
+ * The bucket is chosen using the trailing hex digits of a key, which are
+ * uniformly distributed for generated keys, even for those which start
+ * with a timestamp. Keys which do not end in hex digits are hashed.
+ */
+static const char*
+key_path (const spooldir *spool, const char *name, char path[KEY_PATH_BUFSZ])
+{
+    const unsigned digits = spool->fanout_digits;
+    if (!digits)
+        return name;
 
-cleanup:
-    {
-        int saved_errno = errno;  /* Can be changed by closedir. */
-        if (ptxn->dirp) {
-            closedir (ptxn->dirp);
-            ptxn->dirp = NULL;
-        }
-        errno = saved_errno;
+    size_t len = strlen (name);
+    if (len > NAME_MAX)
+        return name;  /* Let the system call report the error. */
+
+    bool hex = len >= digits;
+    for (unsigned i = 0; hex && i < digits; i++)
+        hex = is_lower_xdigit (name[len - digits + i]);
+
+    if (hex) {
+        memcpy (path, name + len - digits, digits);
+    } else {
+        uint32_t hash = fnv1a (name, len);
+        char bucket[BUCKET_NAME_BUFSZ];
+        bucket_name (spool, hash & (spool_nbuckets (spool) - 1), bucket);
+        memcpy (path, bucket, digits);
     }
-    return retval;
+    path[digits] = '/';
+    memcpy (path + digits + 1, name, len + 1);
+    return path;
 }
 
 
-_Bool
-spooldir_has_status (const spooldir *spool, const spoolkey *key,
+static bool
+subdir_is_empty (int dir_fd, const char *path)
+{
+    struct dirscan scan;
+    const char *name;
+    unsigned char type;
+    bool empty = true;
+
+    if (dirscan_init (&scan, dir_fd, path) < 0)
+        return false;
+
+    while (empty && dirscan_next (&scan, &name, &type) > 0)
+        empty = (name[0] == '.');
+
+    dirscan_fini (&scan);
+    return empty;
+}
+
+
+static const enum spooldir_status layout_statuses[] = {
+    SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_CUR,
+};
+
+static bool
+layout_is_empty (const spooldir *spool)
+{
+    for (unsigned i = 0; i < sizeof (layout_statuses) / sizeof (layout_statuses[0]); i++) {
+        int subdir_fd = status_to_fd (spool, layout_statuses[i]);
+        for (unsigned bucket = 0; bucket < spool_nbuckets (spool); bucket++) {
+            char name[BUCKET_NAME_BUFSZ];
+            bucket_name (spool, bucket, name);
+            if (!subdir_is_empty (subdir_fd, name))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+static void
+layout_remove_buckets (const spooldir *spool, unsigned digits)
+{
+    if (!digits)
+        return;
+
+    for (unsigned i = 0; i < sizeof (layout_statuses) / sizeof (layout_statuses[0]); i++) {
+        int subdir_fd = status_to_fd (spool, layout_statuses[i]);
+        for (unsigned bucket = 0; bucket < 1u << (4 * digits); bucket++) {
+            char name[BUCKET_NAME_BUFSZ];
+            sprintf (name, "%0*x", (int) digits, bucket);
+            (void) unlinkat (subdir_fd, name, AT_REMOVEDIR);
+        }
+    }
+}
+
+
+/*
+ * Changing the layout of a spool which contains elements would make them
+ * impossible to find, so only empty spools are changed. The index, if any,
+ * is rebuilt for the new buckets.
+ */
+int
+spooldir_set_fanout (spooldir *spool, unsigned buckets)
+{
+    api_check_return_val (spool, -1);
+
+    unsigned digits;
+    switch (buckets) {
+        case 0:
+        case 1:    digits = 0; break;
+        case 256:  digits = 2; break;
+        case 4096: digits = 3; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (digits == spool->fanout_digits)
+        return 0;
+
+    if (!layout_is_empty (spool)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    const bool indexed = (spool->index != NULL);
+    const unsigned old_digits = spool->fanout_digits;
+    spooldir_set_index (spool, false);
+    spool->fanout_digits = digits;
+
+    for (unsigned i = 0; i < sizeof (layout_statuses) / sizeof (layout_statuses[0]); i++) {
+        int subdir_fd = status_to_fd (spool, layout_statuses[i]);
+        for (unsigned bucket = 0; bucket < spool_nbuckets (spool); bucket++) {
+            char name[BUCKET_NAME_BUFSZ];
+            bucket_name (spool, bucket, name);
+            if (mkdirat (subdir_fd, name, S_IRWXU) < 0 && errno != EEXIST)
+                goto error;
+        }
+    }
+
+    if (write_meta (spool) < 0)
+        goto error;
+
+    /* Empty buckets of the previous layout are left behind otherwise. */
+    layout_remove_buckets (spool, old_digits);
+
+    /* Directory streams for the previous layout are no longer useful. */
+    pthread_mutex_lock (&spool->pick_lock);
+    if (spool->pick_cursor) {
+        spooldir_cursor_close (spool->pick_cursor);
+        spool->pick_cursor = NULL;
+    }
+    pthread_mutex_unlock (&spool->pick_lock);
+    return indexed ? spooldir_set_index (spool, true) : 0;
+
+error:
+    {
+        int saved_errno = errno;
+        spool->fanout_digits = old_digits;
+        if (indexed)
+            spooldir_set_index (spool, true);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+
+unsigned
+spooldir_get_fanout (const spooldir *spool)
+{
+    api_check_return_val (spool, 0);
+    return spool->fanout_digits ? spool_nbuckets (spool) : 0;
+}
+
+
+int
+spooldir_set_dedup (spooldir *spool, _Bool enable)
+{
+    api_check_return_val (spool, -1);
+
+    if (spool->dedup == enable)
+        return 0;
+
+    spool->dedup = enable;
+    if (write_meta (spool) < 0) {
+        int saved_errno = errno;
+        spool->dedup = !enable;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+_Bool
+spooldir_get_dedup (const spooldir *spool)
+{
+    api_check_return_val (spool, false);
+    return spool->dedup;
+}
+
+
+static inline bool
+codec_supported (enum spooldir_codec codec)
+{
+    switch (codec) {
+        case SPOOLDIR_CODEC_NONE:
+            return true;
+        case SPOOLDIR_CODEC_ZSTD:
+            return SPOOLDIR_WITH_ZSTD;
+        case SPOOLDIR_CODEC_LZ4:
+            return false;
+    }
+    return false;
+}
+
+
+int
+spooldir_set_codec (spooldir *spool, enum spooldir_codec codec, unsigned level)
+{
+    api_check_return_val (spool, -1);
+
+    if (!codec_supported (codec)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (spool->codec == codec && spool->codec_level == level)
+        return 0;
+
+    const enum spooldir_codec old_codec = spool->codec;
+    const unsigned old_level = spool->codec_level;
+    spool->codec = codec;
+    spool->codec_level = level;
+    if (write_meta (spool) < 0) {
+        int saved_errno = errno;
+        spool->codec = old_codec;
+        spool->codec_level = old_level;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+enum spooldir_codec
+spooldir_get_codec (const spooldir *spool)
+{
+    api_check_return_val (spool, SPOOLDIR_CODEC_NONE);
+    return spool->codec;
+}
+
+
+/*
+ * Spools may keep approximate element counts in the ".spooldir.counts"
+ * file, which every handle maps shared and updates with atomic operations
+ * as elements change status. Counts may drift when processes crash, or for
+ * changes made by handles opened before the file was created.
+ */
+static const char spooldir_counts_name[] = ".spooldir.counts";
+static const char spooldir_counts_magic[8] = "SPOOLCNT";
+
+enum {
+    COUNTS_NEW,
+    COUNTS_WIP,
+    COUNTS_CUR,
+    COUNTS_N,
+};
+
+struct counts_file {
+    char           magic[8];
+    atomic_llong   count[COUNTS_N];
+};
+
+static inline int
+status_to_counts (enum spooldir_status status)
+{
+    switch (status) {
+        case SPOOLDIR_STATUS_NEW: return COUNTS_NEW;
+        case SPOOLDIR_STATUS_WIP: return COUNTS_WIP;
+        case SPOOLDIR_STATUS_CUR: return COUNTS_CUR;
+        default: return -1;
+    }
+}
+
+
+static inline void
+counts_move (spooldir *spool, enum spooldir_status from, enum spooldir_status to)
+{
+    struct counts_file *counts = spool->counts;
+    if (!counts)
+        return;
+
+    int i;
+    if ((i = status_to_counts (from)) >= 0)
+        atomic_fetch_sub_explicit (&counts->count[i], 1, memory_order_relaxed);
+    if ((i = status_to_counts (to)) >= 0)
+        atomic_fetch_add_explicit (&counts->count[i], 1, memory_order_relaxed);
+}
+
+
+static void index_record (spooldir *spool, enum spooldir_status status, const char *path);
+
+/*
+ * Accounts for an element moved through the handle; its path may include
+ * the bucket.
+ */
+static inline void
+spool_moved (spooldir *spool, enum spooldir_status from, enum spooldir_status to,
+             const char *path)
+{
+    counts_move (spool, from, to);
+    if (spool->index)
+        index_record (spool, to, path);
+}
+
+
+static int
+counts_map (spooldir *spool)
+{
+#if ATOMIC_LLONG_LOCK_FREE == 2
+    int fd = openat (spool->dir_fd, spooldir_counts_name, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    struct stat sb;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &sb) == 0 && sb.st_size == sizeof (struct counts_file))
+        map = mmap (NULL, sizeof (struct counts_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    /* A damaged file is ignored, and gets replaced when counters are enabled. */
+    if (map == MAP_FAILED || memcmp (map, spooldir_counts_magic, sizeof (spooldir_counts_magic))) {
+        if (map != MAP_FAILED)
+            munmap (map, sizeof (struct counts_file));
+        return 0;
+    }
+    spool->counts = map;
+#else
+    (void) spool;
+#endif
+    return 0;
+}
+
+
+static void
+counts_unmap (spooldir *spool)
+{
+    if (spool->counts) {
+        munmap (spool->counts, sizeof (struct counts_file));
+        spool->counts = NULL;
+    }
+}
+
+
+/*
+ * Counts the elements with a given status by scanning every bucket.
+ */
+static ssize_t
+count_scan (const spooldir *spool, enum spooldir_status status)
+{
+    int subdir_fd = status_to_fd (spool, status);
+    if (subdir_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct dirscan *scan = malloc (sizeof (struct dirscan));
+    if (!scan)
+        return -1;
+
+    ssize_t count = 0;
+    const unsigned nbuckets = spool_nbuckets (spool);
+    for (unsigned bucket = 0; bucket < nbuckets && count >= 0; bucket++) {
+        char name[BUCKET_NAME_BUFSZ];
+        bucket_name (spool, bucket, name);
+        if (dirscan_init (scan, subdir_fd, name) < 0) {
+            count = -1;
+            break;
+        }
+
+        const char *entry;
+        int retval;
+        while ((retval = dirscan_next_file (scan, &entry)) > 0)
+            count++;
+        if (retval < 0)
+            count = -1;
+
+        int saved_errno = errno;
+        dirscan_fini (scan);
+        errno = saved_errno;
+    }
+
+    int saved_errno = errno;
+    free (scan);
+    errno = saved_errno;
+    return count;
+}
+
+
+int
+spooldir_set_counters (spooldir *spool, _Bool enable)
+{
+    api_check_return_val (spool, -1);
+
+    if (!enable) {
+        counts_unmap (spool);
+        return (unlinkat (spool->dir_fd, spooldir_counts_name, 0) < 0 && errno != ENOENT) ? -1 : 0;
+    }
+    if (spool->counts)
+        return 0;
+
+#if ATOMIC_LLONG_LOCK_FREE == 2
+    struct counts_file counts;
+    memcpy (counts.magic, spooldir_counts_magic, sizeof (counts.magic));
+    for (enum spooldir_status status = SPOOLDIR_STATUS_NEW; status <= SPOOLDIR_STATUS_CUR; status++) {
+        ssize_t count = count_scan (spool, status);
+        if (count < 0)
+            return -1;
+        atomic_init (&counts.count[status_to_counts (status)], count);
+    }
+
+    /* Publish the file complete, so other handles never see partial contents. */
+    static const char tmp_name[] = ".spooldir.counts.tmp";
+    int fd = openat (spool->dir_fd, tmp_name,
+                     O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS, 0666);
+    if (fd < 0)
+        return -1;
+
+    if (write (fd, &counts, sizeof (counts)) != sizeof (counts)) {
+        int saved_errno = errno;
+        close (fd);
+        unlinkat (spool->dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    close (fd);
+
+    if (renameat (spool->dir_fd, tmp_name, spool->dir_fd, spooldir_counts_name) < 0) {
+        int saved_errno = errno;
+        unlinkat (spool->dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return counts_map (spool);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+static int
+open_or_create_subdir (int dir_fd, const char *subdir)
+{
+    /* Subdirectories of existing spools are opened with a single call. */
+    int fd = openat (dir_fd, subdir, O_RDWR | SPOOLDIR_DIR_O_FLAGS);
+    if (fd >= 0 || errno != ENOENT)
+        return fd;
+
+    /*
+     * Creation is serialized with other processes opening the spool, using
+     * a lock on the top-level directory which cannot be taken on O_PATH
+     * descriptors.
+     */
+    int lock_fd = openat (dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lock_fd < 0)
+        return -1;
+
+    while (flock (lock_fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            int saved_errno = errno;
+            close (lock_fd);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    if (mkdirat (dir_fd, subdir, S_IRWXU) == 0 || errno == EEXIST)
+        fd = openat (dir_fd, subdir, O_RDWR | SPOOLDIR_DIR_O_FLAGS);
+
+    int saved_errno = errno;
+    close (lock_fd);  /* Releases the lock. */
+    errno = saved_errno;
+    return fd;
+}
+
+
+spooldir*
+spooldir_open_path (const char *path, uint32_t mode)
+{
+    api_check_return_val (path, NULL);
+
+    int dir_fd = open (path, O_RDWR | SPOOLDIR_DIR_O_FLAGS, 0);
+    if (dir_fd < 0) {
+        if (mode && errno == ENOENT) {
+            if ((mkdirp (path, (mode_t) mode) == -1) ||
+                (dir_fd = open (path, O_RDWR | SPOOLDIR_DIR_O_FLAGS, 0)) == -1)
+            {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+    }
+
+    spooldir *spool = spooldir_open (dir_fd);
+    if (!spool) close (dir_fd);
+    return spool;
+}
+
+
+spooldir* spooldir_open (int dir_fd)
+{
+    api_check_return_val (dir_fd >= 0, NULL);
+
+    /* Check for existence, create if needed (and requested). */
+    struct stat sb;
+    if (fstat (dir_fd, &sb)) {
+        /* TODO: Report errors. */
+        return NULL;
+    }
+    if (!S_ISDIR (sb.st_mode)) {
+        /* TODO: Report errors. */
+        return NULL;
+    }
+
+    int tmp_fd = -1, new_fd = -1, wip_fd = -1, cur_fd = -1;
+    if ((tmp_fd = open_or_create_subdir (dir_fd, "tmp")) < 0 ||
+        (new_fd = open_or_create_subdir (dir_fd, "new")) < 0 ||
+        (wip_fd = open_or_create_subdir (dir_fd, "wip")) < 0 ||
+        (cur_fd = open_or_create_subdir (dir_fd, "cur")) < 0)
+    {
+        /* TODO: Report errors. */
+        goto close_and_cleanup;
+    }
+
+    spooldir *spool = (spooldir*) calloc (1, sizeof (spooldir));
+    spool->dir_fd = dir_fd;
+    spool->tmp_fd = tmp_fd;
+    spool->new_fd = new_fd;
+    spool->wip_fd = wip_fd;
+    spool->cur_fd = cur_fd;
+    spool->archive_fd = -1;
+    atomic_init (&spool->have_renameat2, HAVE_RENAMEAT2);
+    /* Linking O_TMPFILE files into a directory needs /proc/self/fd. */
+    atomic_init (&spool->have_tmpfile, HAVE_O_TMPFILE &&
+                 faccessat (AT_FDCWD, "/proc/self/fd", X_OK, 0) == 0);
+    pthread_mutex_init (&spool->pick_lock, NULL);
+    pthread_mutex_init (&spool->group.lock, NULL);
+    pthread_cond_init (&spool->group.cond, NULL);
+    spool->group.tail = &spool->group.head;
+
+    if (read_meta (spool) < 0 || counts_map (spool) < 0) {
+        /* TODO: Report errors. */
+        spooldir_close (spool);
+        return NULL;
+    }
+    return spool;
+
+close_and_cleanup:
+    if (tmp_fd >= 0) close (tmp_fd);
+    if (new_fd >= 0) close (new_fd);
+    if (wip_fd >= 0) close (wip_fd);
+    if (cur_fd >= 0) close (cur_fd);
+    return NULL;
+}
+
+
+void
+spooldir_close (spooldir *spool)
+{
+    api_check_return (spool);
+
+    close (spool->tmp_fd);
+    close (spool->new_fd);
+    close (spool->wip_fd);
+    close (spool->cur_fd);
+
+    if (spool->pick_cursor)
+        spooldir_cursor_close (spool->pick_cursor);
+    if (spool->notifier)
+        spooldir_notifier_free (spool->notifier);
+    spooldir_set_io_engine (spool, SPOOLDIR_IO_SYNC);
+    spooldir_set_index (spool, false);
+    counts_unmap (spool);
+    pthread_mutex_destroy (&spool->pick_lock);
+    pthread_mutex_destroy (&spool->group.lock);
+    pthread_cond_destroy (&spool->group.cond);
+
+    free (spool);
+}
+
+
+/*
+ * We cannot directly rename() files, because that could overwrite existing
+ * files at the destination directory. On GNU/Linux renameat2() is used with
+ * RENAME_NOREPLACE, which is the fastest option; but it is not supported by
+ * older kernels and some file systems. The fall-back is to use link(), which
+ * behaves atomically, followed by unlink().
+ */
+static int
+rename_noreplace (spooldir *spool, int src_fd, const char *src_name,
+                  int dst_fd, const char *dst_name)
+{
+    assert_ok (src_fd >= 0);
+    assert_ok (dst_fd >= 0);
+    assert_ok (src_name != NULL);
+    assert_ok (dst_name != NULL);
+
+#if HAVE_RENAMEAT2
+    if (atomic_load_explicit (&spool->have_renameat2, memory_order_relaxed)) {
+        if (syscall (SYS_renameat2, src_fd, src_name, dst_fd, dst_name, RENAME_NOREPLACE) == 0)
+            return 0;
+        if (errno != ENOSYS && errno != EINVAL)
+            return -1;
+        atomic_store_explicit (&spool->have_renameat2, false, memory_order_relaxed);
+    }
+#endif
+
+    if (linkat (src_fd, src_name, dst_fd, dst_name, 0) < 0)
+        return -1;
+    if (unlinkat (src_fd, src_name, 0) < 0) {
+        int saved_errno = errno;
+        unlinkat (dst_fd, dst_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * When renameat2() cannot be used, the link()-based fall-back opens the
+ * file before removing it from the source directory:
+ *
+ *    1. Link the file under the destination directory.
+ *    2. Open the file at the destination directory. On failure:
+ *         2.1. Unlink from the destination directory.
+ *    3. Unlink from the source directory. On failure:
+ *         3.1. Unlink from the destination directory.
+ *         3.2. Close the open file descriptor.
+ */
+static inline int
+relink_and_open (int src_fd, int dst_fd, const char *name)
+{
+    assert_ok (src_fd >= 0);
+    assert_ok (dst_fd >= 0);
+    assert_ok (name != NULL);
+
+    int retval = -1;
+    int fd = -1;
+
+    if ((retval = linkat (src_fd, name, dst_fd, name, 0)) < 0) {
+        retval = -errno;
+        goto error;
+    }
+    if ((fd = openat (dst_fd, name, O_RDWR | SPOOLDIR_FILE_O_FLAGS, 0)) < 0) {
+        retval = -errno;
+        goto error_unlink_dst;
+    }
+    if ((retval = unlinkat (src_fd, name, 0)) <  0) {
+        retval = -errno;
+        goto error_unlink_dst_close_fd;
+    }
+    return fd;
+
+error_unlink_dst_close_fd:
+    assert_ok (fd >= 0);
+    close (fd);
+error_unlink_dst:
+    unlinkat (dst_fd, name, 0);
+error:
+    return retval;
+}
+
+
+/*
+ * Moves an element between two directories and opens it. Returns the
+ * file descriptor, or a negative "errno" value on failure.
+ */
+static int
+rename_and_open (spooldir *spool, int src_fd, int dst_fd, const char *name)
+{
+#if HAVE_RENAMEAT2
+    if (atomic_load_explicit (&spool->have_renameat2, memory_order_relaxed)) {
+        if (syscall (SYS_renameat2, src_fd, name, dst_fd, name, RENAME_NOREPLACE) == 0) {
+            int fd = openat (dst_fd, name, O_RDWR | SPOOLDIR_FILE_O_FLAGS, 0);
+            if (fd < 0) {
+                int retval = -errno;
+                rename_noreplace (spool, dst_fd, name, src_fd, name);
+                return retval;
+            }
+            return fd;
+        }
+        if (errno != ENOSYS && errno != EINVAL)
+            return -errno;
+        atomic_store_explicit (&spool->have_renameat2, false, memory_order_relaxed);
+    }
+#endif
+    return relink_and_open (src_fd, dst_fd, name);
+}
+
+
+/*
+ * Claims an element, accounting for the time spent and lost races.
+ */
+static inline int
+move_and_open (spooldir *spool, int src_fd, int dst_fd, const char *name)
+{
+    STAT_TIME_START (start);
+    int fd = rename_and_open (spool, src_fd, dst_fd, name);
+    STAT_TIME_END (spool, SPOOLDIR_STAGE_CLAIM, start);
+    if (fd == -ENOENT || fd == -EEXIST)
+        STAT_INC (spool, pick_races);
+    return fd;
+}
+
+
+/*
+ * Gives a name in the "new" directory to an element created with O_TMPFILE.
+ * Like link(), this never overwrites an existing file.
+ */
+static int
+link_tmpfile (int fd, int dst_fd, const char *name)
+{
+    char path[sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+    return linkat (AT_FDCWD, path, dst_fd, name, AT_SYMLINK_FOLLOW);
+}
+
+
+#if HAVE_IO_URING
+/*
+ * Minimal io_uring support, using the system calls directly. Rings are
+ * shared by all the threads using a spool handle, and protected by a lock;
+ * each user submits a batch of requests and waits for all of them.
+ */
+enum {
+    URING_ENTRIES = 256,
+    URING_BATCH = 32,  /* Elements per submission, each needs up to two entries. */
+};
+
+struct uring {
+    pthread_mutex_t      lock;
+    int                  fd;
+    unsigned             sq_entries;
+    unsigned             sq_local_tail;
+    unsigned             stale;  /* Completions owed by a failed batch. */
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t               sq_len;
+    size_t               cq_len;
+    size_t               sqes_len;
+};
+
+
+static void
+uring_free (struct uring *r)
+{
+    if (r->sqes) munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap (r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap (r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close (r->fd);
+    pthread_mutex_destroy (&r->lock);
+    free (r);
+}
+
+
+static bool
+uring_probe (int fd)
+{
+    static const uint8_t required_ops[] = {
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_RENAMEAT,
+        IORING_OP_LINKAT, IORING_OP_UNLINKAT, IORING_OP_STATX,
+    };
+
+    const size_t n_ops = 256;
+    struct io_uring_probe *probe =
+        calloc (1, sizeof (struct io_uring_probe) + n_ops * sizeof (struct io_uring_probe_op));
+    if (!probe)
+        return false;
+
+    bool ok = syscall (SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, n_ops) == 0;
+    for (unsigned i = 0; ok && i < sizeof (required_ops); i++) {
+        ok = required_ops[i] <= probe->last_op &&
+            (probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free (probe);
+    return ok;
+}
+
+
+static struct uring*
+uring_new (void)
+{
+    struct uring *r = calloc (1, sizeof (struct uring));
+    if (!r)
+        return NULL;
+
+    pthread_mutex_init (&r->lock, NULL);
+
+    struct io_uring_params params;
+    memset (&params, 0, sizeof (params));
+    if ((r->fd = syscall (SYS_io_uring_setup, URING_ENTRIES, &params)) < 0)
+        goto error;
+
+    if (!uring_probe (r->fd)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    r->sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    r->cq_len = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap (NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto error;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap (NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto error;
+        }
+    }
+
+    r->sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = mmap (NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto error;
+    }
+
+    r->sq_entries = params.sq_entries;
+    r->sq_head = (unsigned*) ((char*) r->sq_ptr + params.sq_off.head);
+    r->sq_tail = (unsigned*) ((char*) r->sq_ptr + params.sq_off.tail);
+    r->sq_mask = (unsigned*) ((char*) r->sq_ptr + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*) ((char*) r->sq_ptr + params.sq_off.array);
+    r->cq_head = (unsigned*) ((char*) r->cq_ptr + params.cq_off.head);
+    r->cq_tail = (unsigned*) ((char*) r->cq_ptr + params.cq_off.tail);
+    r->cq_mask = (unsigned*) ((char*) r->cq_ptr + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) ((char*) r->cq_ptr + params.cq_off.cqes);
+    r->sq_local_tail = *r->sq_tail;
+    return r;
+
+error:
+    {
+        int saved_errno = errno;
+        uring_free (r);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+
+/*
+ * Obtains an entry from the submission queue. The ring is never filled by
+ * a batch, so this always succeeds.
+ */
+static struct io_uring_sqe*
+uring_sqe (struct uring *r, uint8_t opcode, int fd, uint64_t user_data)
+{
+    assert_ok (r->sq_local_tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) < r->sq_entries);
+
+    unsigned idx = r->sq_local_tail++ & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+
+/*
+ * Submits the published entries, reaping completions until "n" are counted
+ * in "reaped". Results go to "results" when their "user_data" is below
+ * "n_results", and are discarded otherwise.
+ */
+static int
+uring_wait (struct uring *r, int32_t *results, unsigned n_results, unsigned n, unsigned *reaped)
+{
+    while (*reaped < n) {
+        unsigned to_submit = __atomic_load_n (r->sq_tail, __ATOMIC_RELAXED) -
+                             __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall (SYS_io_uring_enter, r->fd, to_submit, n - *reaped,
+                     IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return -1;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, (*reaped)++) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data < n_results)
+                results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+
+/*
+ * Submits the queued entries, and waits until "n" completions have been
+ * reaped. The result of each one is stored in "results", which has room
+ * for "n_results" values, at the index given by its "user_data". On
+ * failure entries not taken by the kernel are dropped, and completions
+ * of the ones which were are discarded by the next batch.
+ */
+static int
+uring_submit_and_wait (struct uring *r, int32_t *results, unsigned n_results, unsigned n)
+{
+    unsigned reaped = 0;
+    if (r->stale) {
+        int retval = uring_wait (r, NULL, 0, r->stale, &reaped);
+        r->stale -= reaped;
+        if (retval < 0)
+            goto discard;
+        reaped = 0;
+    }
+
+    const unsigned head = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n (r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    if (uring_wait (r, results, n_results, n, &reaped) == 0)
+        return 0;
+
+    {
+        unsigned submitted = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) - head;
+        if (submitted > reaped)
+            r->stale += submitted - reaped;
+    }
+
+discard:
+    {
+        int saved_errno = errno;
+        r->sq_local_tail = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n (r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+
+static inline void
+uring_prep_rename (struct io_uring_sqe *sqe, const char *src_name, int dst_fd,
+                   const char *dst_name)
+{
+    sqe->addr = (uintptr_t) src_name;
+    sqe->len = (uint32_t) dst_fd;
+    sqe->addr2 = (uintptr_t) dst_name;
+    sqe->rename_flags = RENAME_NOREPLACE;
+}
+#endif /* HAVE_IO_URING */
+
+
+int
+spooldir_set_io_engine (spooldir *spool, enum spooldir_io_engine engine)
+{
+    api_check_return_val (spool, -1);
+
+    switch (engine) {
+        case SPOOLDIR_IO_SYNC:
+#if HAVE_IO_URING
+            if (spool->uring) {
+                uring_free (spool->uring);
+                spool->uring = NULL;
+            }
+#endif
+            return 0;
+
+        case SPOOLDIR_IO_URING:
+#if HAVE_IO_URING
+            if (!spool->uring && !(spool->uring = uring_new ()))
+                return -1;
+            return 0;
+#else
+            errno = ENOSYS;
+            return -1;
+#endif
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+enum spooldir_io_engine
+spooldir_get_io_engine (const spooldir *spool)
+{
+    api_check_return_val (spool, SPOOLDIR_IO_SYNC);
+    return spool->uring ? SPOOLDIR_IO_URING : SPOOLDIR_IO_SYNC;
+}
+
+
+/*
+ * Moves an element being added to the "new" directory.
+ */
+static int
+publish_new (spooldir *spool, spooltxn *txn, const char *path)
+{
+    STAT_TIME_START (start);
+    int retval = (txn_priv (txn)->flags & TXN_TMPFILE)
+        ? link_tmpfile (txn->fd, spool->new_fd, path)
+        : rename_noreplace (spool, spool->tmp_fd, txn->key->bytes, spool->new_fd, path);
+    STAT_TIME_END (spool, SPOOLDIR_STAGE_PUBLISH, start);
+    return retval;
+}
+
+
+/*
+ * Flushes the contents of an element being added to disk. The descriptor
+ * may have been taken from the transaction, then the file is reopened.
+ */
+static int
+sync_tmp_contents (spooldir *spool, spooltxn *txn)
+{
+    if (txn->fd >= 0) {
+        STAT_TIME_START (start);
+        int retval = fdatasync (txn->fd);
+        STAT_TIME_END (spool, SPOOLDIR_STAGE_SYNC, start);
+        return retval;
+    }
+
+    int fd = openat (spool->tmp_fd, txn->key->bytes, O_RDONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS);
+    if (fd < 0)
+        return -1;
+
+    int retval = fdatasync (fd);
+    int saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return retval;
+}
+
+
+/*
+ * Flushes a directory entry under "new" to disk. Directories are opened
+ * with O_PATH, so a readable descriptor is needed.
+ */
+static int
+sync_new_subdir (spooldir *spool, const char *bucket)
+{
+    int fd = openat (spool->new_fd, bucket, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    STAT_TIME_START (start);
+    int retval = fsync (fd);
+    STAT_TIME_END (spool, SPOOLDIR_STAGE_SYNC, start);
+    int saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return retval;
+}
+
+
+static int
+commit_tmp_item (spooldir *spool, spooltxn *txn, const char *path)
+{
+    if (sync_tmp_contents (spool, txn) < 0 || publish_new (spool, txn, path) < 0)
+        return -1;
+
+    char bucket[BUCKET_NAME_BUFSZ];
+    if (spool->fanout_digits) {
+        memcpy (bucket, path, spool->fanout_digits);
+        bucket[spool->fanout_digits] = '\0';
+    } else {
+        strcpy (bucket, ".");
+    }
+    return sync_new_subdir (spool, bucket);
+}
+
+
+/*
+ * Syncs and publishes a batch of elements on behalf of their committers,
+ * with a single fsync() for each directory where entries were added.
+ */
+static void
+commit_group_run (spooldir *spool, struct group_entry *batch)
+{
+    bool *touched = calloc (spool_nbuckets (spool), sizeof (bool));
+
+    for (struct group_entry *e = batch; e; e = e->next) {
+        if (sync_tmp_contents (spool, e->txn) < 0) {
+            e->result = -1;
+            e->error = errno;
+        }
+    }
+
+    for (struct group_entry *e = batch; e; e = e->next) {
+        if (e->result < 0)
+            continue;
+
+        char path_buf[KEY_PATH_BUFSZ];
+        const char *path = key_path (spool, e->txn->key->bytes, path_buf);
+        if (publish_new (spool, e->txn, path) < 0) {
+            e->result = -1;
+            e->error = errno;
+        } else if (touched && spool->fanout_digits) {
+            unsigned long bucket = strtoul (path, NULL, 16);
+            if (bucket < spool_nbuckets (spool))
+                touched[bucket] = true;
+        }
+    }
+
+    int sync_error = 0;
+    for (unsigned bucket = 0; bucket < spool_nbuckets (spool); bucket++) {
+        if (spool->fanout_digits && touched && !touched[bucket])
+            continue;
+        char name[BUCKET_NAME_BUFSZ];
+        bucket_name (spool, bucket, name);
+        if (sync_new_subdir (spool, name) < 0 && !sync_error)
+            sync_error = errno;
+    }
+    free (touched);
+
+    if (sync_error) {
+        for (struct group_entry *e = batch; e; e = e->next) {
+            if (e->result == 0) {
+                e->result = -1;
+                e->error = sync_error;
+            }
+        }
+    }
+}
+
+
+static int
+commit_tmp_group (spooldir *spool, spooltxn *txn)
+{
+    struct commit_group *g = &spool->group;
+    struct group_entry entry = { .txn = txn };
+
+    pthread_mutex_lock (&g->lock);
+
+    *g->tail = &entry;
+    g->tail = &entry.next;
+    if (++g->count >= g->max_count)
+        pthread_cond_broadcast (&g->cond);
+
+    while (!entry.done) {
+        if (g->leader) {
+            pthread_cond_wait (&g->cond, &g->lock);
+            continue;
+        }
+
+        /* Become the leader, and wait for more commits to arrive. */
+        g->leader = true;
+
+        struct timespec deadline;
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (g->window_usec % 1000000) * 1000;
+        deadline.tv_sec += g->window_usec / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        while (g->count < g->max_count) {
+            if (pthread_cond_timedwait (&g->cond, &g->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        struct group_entry *batch = g->head;
+        g->head = NULL;
+        g->tail = &g->head;
+        g->count = 0;
+        pthread_mutex_unlock (&g->lock);
+
+        commit_group_run (spool, batch);
+
+        pthread_mutex_lock (&g->lock);
+        for (struct group_entry *e = batch; e; e = e->next)
+            e->done = true;
+        g->leader = false;
+        pthread_cond_broadcast (&g->cond);
+    }
+
+    pthread_mutex_unlock (&g->lock);
+
+    errno = entry.error;
+    return entry.result;
+}
+
+
+int
+spooldir__open_file (spooldir *spool, const spoolkey *key,
+                     enum spooldir_status status, int oflag)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (key, -1);
+    api_check_return_val (status != SPOOLDIR_STATUS_FIN, -1);
+
+    int subdir_fd = status_to_fd (spool, status);
+    if (subdir_fd < 0)
+        return -1;
+
+    char path[KEY_PATH_BUFSZ];
+    const char *name = (status == SPOOLDIR_STATUS_TMP)
+        ? key->bytes : key_path (spool, key->bytes, path);
+    return openat (subdir_fd, name, oflag | SPOOLDIR_FILE_O_FLAGS);
+}
+
+
+/*
+ * Creates the file for an element being added, once its key is known.
+ */
+static int
+create_file (spooldir *spool, spooltxn *txn)
+{
+    txn_priv_init (txn);
+
+#if HAVE_O_TMPFILE
+    /*
+     * Files created with O_TMPFILE do not have a name until they are
+     * committed, which saves creating and removing an entry in "tmp".
+     */
+    if (atomic_load_explicit (&spool->have_tmpfile, memory_order_relaxed)) {
+        txn->fd = openat (spool->tmp_fd, ".", O_TMPFILE | O_RDWR, 0666);
+        if (txn->fd >= 0) {
+            txn_priv (txn)->flags |= TXN_TMPFILE;
+            txn->status = SPOOLDIR_STATUS_TMP;
+            return txn->fd;
+        }
+        if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)
+            atomic_store_explicit (&spool->have_tmpfile, false, memory_order_relaxed);
+    }
+#endif
+
+    txn->fd = openat (spool->tmp_fd, txn->key->bytes,
+                      O_CREAT | O_EXCL | O_RDWR | SPOOLDIR_FILE_O_FLAGS, 0666);
+
+    if (txn->fd < 0) {
+        spoolkey_free (txn->key);
+        txn->key = NULL;
+    } else {
+        txn->status = SPOOLDIR_STATUS_TMP;
+    }
+
+    return txn->fd;
+}
+
+
+static inline int
+add_with_key (spooldir *spool, spooltxn *txn)
+{
+    STAT_TIME_START (start);
+    int fd = create_file (spool, txn);
+    STAT_TIME_END (spool, SPOOLDIR_STAGE_CREATE, start);
+    if (fd >= 0)
+        STAT_INC (spool, adds);
+    return fd;
+}
+
+
+int
+spooldir_add (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txn, -1);
+
+    txn->key = spoolkey_init_new (&txn->__key, spool->key_mode);
+    return add_with_key (spool, txn);
+}
+
+
+/*
+ * Priorities are stored as a "<class>-" prefix in front of the generated
+ * key; the inline storage of keys has room for it. Elements with the
+ * default priority get no prefix.
+ */
+int
+spooldir_add_with_priority (spooldir *spool, spooltxn *txn, unsigned priority)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txn, -1);
+    api_check_return_val (priority <= SPOOLDIR_PRIORITY_MAX, -1);
+
+    spoolkey *key = txn->key = spoolkey_init_new (&txn->__key, spool->key_mode);
+    if (priority != SPOOLDIR_PRIORITY_DEFAULT) {
+        memmove (key->bytes + PRIORITY_PREFIX_LEN, key->bytes, key->length + 1);
+        key->length += PRIORITY_PREFIX_LEN;
+        key->bytes[0] = (char) ('0' + priority);
+        key->bytes[1] = '-';
+    }
+    return add_with_key (spool, txn);
+}
+
+
+static inline unsigned
+name_priority (const char *name)
+{
+    return (name[0] >= '0' && name[0] <= '0' + SPOOLDIR_PRIORITY_MAX && name[1] == '-')
+        ? (unsigned) (name[0] - '0') : SPOOLDIR_PRIORITY_DEFAULT;
+}
+
+enum {
+    COPY_CHUNK_SIZE = 1024 * 1024,
+    COPY_BUFFER_SIZE = 128 * 1024,
+};
+
+/*
+ * Copies from the current position of "src_fd" until its end using a
+ * buffer, for when the kernel cannot move the data by itself.
+ */
+static int
+copy_fd_buffered (int src_fd, int dst_fd)
+{
+    uint8_t *buffer = malloc (COPY_BUFFER_SIZE);
+    if (!buffer)
+        return -1;
+
+    int retval = 0;
+    for (;;) {
+        ssize_t count = read (src_fd, buffer, COPY_BUFFER_SIZE);
+        if (count == 0)
+            break;
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            retval = -1;
+            break;
+        }
+        for (ssize_t done = 0; done < count;) {
+            ssize_t written = write (dst_fd, buffer + done, (size_t) (count - done));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                retval = -1;
+                goto out;
+            }
+            done += written;
+        }
+    }
+
+out:
+    {
+        int saved_errno = errno;
+        free (buffer);
+        errno = saved_errno;
+    }
+    return retval;
+}
+
+
+/*
+ * Copies the contents of "src_fd", from its current position, to "dst_fd",
+ * avoiding copies of the data through user space when possible: regular
+ * files are cloned or copied with copy_file_range(), and data from pipes is
+ * moved with splice(). Any of them may be unsupported between the given
+ * files, in which case the next option is tried, with a plain read/write
+ * loop as the last resort. All of them continue from the current file
+ * offsets, so a fall-back can happen after copying some of the data.
+ */
+static int
+copy_fd (int src_fd, int dst_fd)
+{
+    struct stat sb;
+    if (fstat (src_fd, &sb) < 0)
+        return -1;
+
+    if (S_ISREG (sb.st_mode)) {
+        off_t offset = lseek (src_fd, 0, SEEK_CUR);
+        if (offset >= 0 && sb.st_size > offset) {
+#if HAVE_FICLONE
+            /* Whole files may share their data blocks. */
+            if (offset == 0 && ioctl (dst_fd, FICLONE, src_fd) == 0)
+                return (lseek (dst_fd, 0, SEEK_END) < 0 ||
+                        lseek (src_fd, 0, SEEK_END) < 0) ? -1 : 0;
+#endif
+            /* Failure is not fatal: writing may still succeed. */
+            posix_fallocate (dst_fd, 0, sb.st_size - offset);
+        }
+
+#if HAVE_COPY_FILE_RANGE
+        for (;;) {
+            ssize_t count = copy_file_range (src_fd, NULL, dst_fd, NULL, COPY_CHUNK_SIZE, 0);
+            if (count == 0)
+                return 0;
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                    errno != EOPNOTSUPP && errno != EBADF)
+                    return -1;
+                break;
+            }
+        }
+#endif
+    }
+#if HAVE_SPLICE
+    else if (S_ISFIFO (sb.st_mode)) {
+        for (;;) {
+            ssize_t count = splice (src_fd, NULL, dst_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+            if (count == 0)
+                return 0;
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EINVAL && errno != ENOSYS)
+                    return -1;
+                break;
+            }
+        }
+    }
+#endif
+
+    return copy_fd_buffered (src_fd, dst_fd);
+}
+
+
+static int
+write_full (int fd, const void *data, size_t len)
+{
+    for (size_t done = 0; done < len;) {
+        ssize_t written = write (fd, (const uint8_t*) data + done, len - done);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t) written;
+    }
+    return 0;
+}
+
+
+/*
+ * Encoded elements start with a header recording their codec and decoded
+ * size, so elements with and without compression can be mixed in a spool.
+ * Readers detect it by its magic, which text contents cannot start with.
+ */
+struct codec_header {
+    uint8_t magic[6];
+    uint8_t codec;
+    uint8_t reserved;
+    uint8_t size[8];  /* Decoded size, LE64. */
+};
+
+_Static_assert (sizeof (struct codec_header) == 16, "struct codec_header is not packed");
+
+static const uint8_t codec_magic[6] = { 0x89, 'S', 'P', 'Z', '\r', '\n' };
+
+enum {
+    ENCODER_BUFSZ = 64 * 1024,
+};
+
+struct encoder {
+    enum spooldir_codec codec;
+    unsigned            level;
+    uint64_t            decoded;  /* Bytes encoded so far. */
+#if SPOOLDIR_WITH_ZSTD
+    ZSTD_CCtx          *zstd;
+#endif
+    uint8_t             in[ENCODER_BUFSZ];
+    uint8_t             out[ENCODER_BUFSZ];
+};
+
+
+static inline bool
+codec_header_valid (const uint8_t *data, size_t len)
+{
+    return len >= sizeof (struct codec_header) && memcmp (data, codec_magic, sizeof (codec_magic)) == 0;
+}
+
+
+static void
+encoder_free (void *data)
+{
+    struct encoder *enc = data;
+    if (enc) {
+#if SPOOLDIR_WITH_ZSTD
+        ZSTD_freeCCtx (enc->zstd);
+#endif
+        free (enc);
+    }
+}
+
+
+static struct encoder*
+encoder_new (enum spooldir_codec codec, unsigned level)
+{
+    if (!codec_supported (codec) || codec == SPOOLDIR_CODEC_NONE) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    struct encoder *enc = calloc (1, sizeof (struct encoder));
+    if (!enc)
+        return NULL;
+    enc->codec = codec;
+    enc->level = level;
+
+#if SPOOLDIR_WITH_ZSTD
+    if (!(enc->zstd = ZSTD_createCCtx ()) ||
+        (level && ZSTD_isError (ZSTD_CCtx_setParameter (enc->zstd, ZSTD_c_compressionLevel, (int) level))))
+    {
+        encoder_free (enc);
+        errno = ENOMEM;
+        return NULL;
+    }
+#endif
+    return enc;
+}
+
+
+/*
+ * Contexts are kept per thread for elements added in a single call,
+ * because creating them is expensive.
+ */
+static pthread_key_t encoder_tls_key;
+static pthread_once_t encoder_once = PTHREAD_ONCE_INIT;
+
+
+static void
+init_encoder_tls_key (void)
+{
+    (void) pthread_key_create (&encoder_tls_key, encoder_free);
+}
+
+
+/*
+ * Obtains the encoder of the calling thread for a spool, or NULL when
+ * contents are written as-is.
+ */
+static struct encoder*
+spool_encoder (const spooldir *spool)
+{
+    if (spool->codec == SPOOLDIR_CODEC_NONE || !codec_supported (spool->codec))
+        return NULL;
+
+    (void) pthread_once (&encoder_once, init_encoder_tls_key);
+    struct encoder *enc = pthread_getspecific (encoder_tls_key);
+    if (enc && (enc->codec != spool->codec || enc->level != spool->codec_level)) {
+        encoder_free (enc);
+        enc = NULL;
+    }
+    if (!enc)
+        enc = encoder_new (spool->codec, spool->codec_level);
+    (void) pthread_setspecific (encoder_tls_key, enc);
+    return enc;  /* Without memory, falling back to no compression is fine. */
+}
+
+
+/*
+ * Writes the header, whose size is filled by "encoder_end()".
+ */
+static int
+encoder_begin (struct encoder *enc, int fd)
+{
+    struct codec_header header = { .codec = (uint8_t) enc->codec };
+    memcpy (header.magic, codec_magic, sizeof (codec_magic));
+    enc->decoded = 0;
+#if SPOOLDIR_WITH_ZSTD
+    ZSTD_CCtx_reset (enc->zstd, ZSTD_reset_session_only);
+#endif
+    return write_full (fd, &header, sizeof (header));
+}
+
+
+static int
+encoder_put (struct encoder *enc, int fd, const void *data, size_t len, bool end)
+{
+#if SPOOLDIR_WITH_ZSTD
+    ZSTD_inBuffer in = { data, len, 0 };
+    for (;;) {
+        ZSTD_outBuffer out = { enc->out, sizeof (enc->out), 0 };
+        size_t left = ZSTD_compressStream2 (enc->zstd, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError (left)) {
+            errno = EIO;
+            return -1;
+        }
+        if (out.pos && write_full (fd, enc->out, out.pos) < 0)
+            return -1;
+        if (end ? (left == 0) : (in.pos == in.size))
+            break;
+    }
+    enc->decoded += len;
+    return 0;
+#else
+    (void) enc;
+    (void) fd;
+    (void) data;
+    (void) len;
+    (void) end;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+
+static inline int
+encoder_write (struct encoder *enc, int fd, const void *data, size_t len)
+{
+    return len ? encoder_put (enc, fd, data, len, false) : 0;
+}
+
+
+static int
+encoder_end (struct encoder *enc, int fd)
+{
+    if (encoder_put (enc, fd, NULL, 0, true) < 0)
+        return -1;
+
+    uint8_t size[8];
+    store_le64 (size, enc->decoded);
+    ssize_t written = pwrite (fd, size, sizeof (size), offsetof (struct codec_header, size));
+    if (written < 0)
+        return -1;
+    if (written != sizeof (size)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+encode_fd (struct encoder *enc, int src_fd, int dst_fd)
+{
+    if (encoder_begin (enc, dst_fd) < 0)
+        return -1;
+    for (;;) {
+        ssize_t count = read (src_fd, enc->in, sizeof (enc->in));
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (count == 0)
+            return encoder_end (enc, dst_fd);
+        if (encoder_write (enc, dst_fd, enc->in, (size_t) count) < 0)
+            return -1;
+    }
+}
+
+
+static int
+encode_iov (struct encoder *enc, int fd, const struct iovec *iov, int iovcnt)
+{
+    if (encoder_begin (enc, fd) < 0)
+        return -1;
+    for (int i = 0; i < iovcnt; i++)
+        if (encoder_write (enc, fd, iov[i].iov_base, iov[i].iov_len) < 0)
+            return -1;
+    return encoder_end (enc, fd);
+}
+
+
+#if SPOOLDIR_WITH_ZSTD
+enum {
+    ZSTD_BLOCK_MIN_SIZE = 3,           /* Just a block header. */
+    ZSTD_BLOCK_MAX_DECODED = 128 * 1024,
+};
+#endif
+
+
+/*
+ * Checks the decoded size recorded in a header against what the encoded
+ * data can produce, before memory is allocated for it.
+ */
+static int
+codec_check_size (uint8_t codec, const void *src, size_t src_len, uint64_t size)
+{
+    switch (codec) {
+        case SPOOLDIR_CODEC_NONE:
+            if (size != src_len)
+                break;
+            return 0;
+
+#if SPOOLDIR_WITH_ZSTD
+        case SPOOLDIR_CODEC_ZSTD: {
+            /* Streamed frames may not record their size, bound it by blocks. */
+            unsigned long long content_size = ZSTD_getFrameContentSize (src, src_len);
+            if (content_size == ZSTD_CONTENTSIZE_ERROR)
+                break;
+            if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+                if (size / ZSTD_BLOCK_MAX_DECODED > src_len / ZSTD_BLOCK_MIN_SIZE)
+                    break;
+            } else if (content_size != size) {
+                break;
+            }
+            return 0;
+        }
+#endif
+
+        default:
+            errno = ENOTSUP;
+            return -1;
+    }
+
+    errno = EBADMSG;
+    return -1;
+}
+
+
+static int
+codec_decode (uint8_t codec, const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    switch (codec) {
+        case SPOOLDIR_CODEC_NONE:
+            if (src_len != dst_len)
+                break;
+            if (src_len)
+                memcpy (dst, src, src_len);
+            return 0;
+
+#if SPOOLDIR_WITH_ZSTD
+        case SPOOLDIR_CODEC_ZSTD: {
+            size_t len = ZSTD_decompress (dst, dst_len, src, src_len);
+            if (ZSTD_isError (len) || len != dst_len)
+                break;
+            return 0;
+        }
+#endif
+
+        default:
+            errno = ENOTSUP;
+            return -1;
+    }
+
+    errno = EBADMSG;
+    return -1;
+}
+
+
+int
+spooldir_add_from_fd (spooldir *spool, int src_fd, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (src_fd >= 0, -1);
+    api_check_return_val (txn, -1);
+
+    if (spooldir_add (spool, txn) < 0)
+        return -1;
+
+    struct encoder *enc = spool_encoder (spool);
+    if ((enc ? encode_fd (enc, src_fd, txn->fd) : copy_fd (src_fd, txn->fd)) < 0) {
+        int saved_errno = errno;
+        spooldir_rollback (spool, txn);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Producers own everything needed to add elements one after another: key
+ * generator state, a transaction with inline key storage, and a buffer to
+ * coalesce small writes. After creation they do not allocate memory.
+ */
+enum {
+    PRODUCER_BUFSZ = 64 * 1024,
+};
+
+struct _spooldir_producer {
+    spooldir       *spool;
+    struct rng      rng;
+    unsigned        rng_generation;
+    bool            active;
+    spooltxn        txn;
+    spoolkey_inline last_key;  /* Key of the last committed element. */
+    struct encoder *encoder;   /* Compresses contents, or NULL. */
+    size_t          len;
+    uint8_t         buffer[PRODUCER_BUFSZ];
+};
+
+
+static inline void
+producer_reseed (spooldir_producer *producer)
+{
+    random_bytes (producer->rng.key, RNG_KEY_SIZE);
+    producer->rng.count = 0;
+    producer->rng_generation = rng_generation;
+}
+
+
+spooldir_producer*
+spooldir_producer_new (spooldir *spool)
+{
+    api_check_return_val (spool, NULL);
+
+    spooldir_producer *producer = calloc (1, sizeof (spooldir_producer));
+    if (!producer)
+        return NULL;
+
+    (void) pthread_once (&rng_once, init_rng_tls_key);
+    producer->spool = spool;
+    producer_reseed (producer);
+
+    if (spool->codec != SPOOLDIR_CODEC_NONE && codec_supported (spool->codec) &&
+        !(producer->encoder = encoder_new (spool->codec, spool->codec_level)))
+    {
+        int saved_errno = errno;
+        free (producer);
+        errno = saved_errno;
+        return NULL;
+    }
+    return producer;
+}
+
+
+void
+spooldir_producer_free (spooldir_producer *producer)
+{
+    api_check_return (producer);
+
+    if (producer->active)
+        spooldir_producer_rollback (producer);
+    encoder_free (producer->encoder);
+    free (producer);
+}
+
+
+spooltxn*
+spooldir_producer_begin (spooldir_producer *producer)
+{
+    api_check_return_val (producer, NULL);
+    api_check_return_val (!producer->active, NULL);
+
+    /* Keys generated in a forked child must differ from the parent's. */
+    if (producer->rng_generation != rng_generation)
+        producer_reseed (producer);
+
+    spooltxn *txn = &producer->txn;
+    spoolkey *key = txn->key = inline_key (&txn->__key);
+    key->length = generate_key_rng (&producer->rng, producer->spool->key_mode, key->bytes);
+    if (add_with_key (producer->spool, txn) < 0)
+        return NULL;
+    if (producer->encoder && encoder_begin (producer->encoder, txn->fd) < 0) {
+        int saved_errno = errno;
+        spooldir_rollback (producer->spool, txn);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    producer->active = true;
+    producer->len = 0;
+    return txn;
+}
+
+
+static inline int
+producer_emit (spooldir_producer *producer, const void *data, size_t len)
+{
+    return producer->encoder
+        ? encoder_write (producer->encoder, producer->txn.fd, data, len)
+        : write_full (producer->txn.fd, data, len);
+}
+
+
+static int
+producer_flush (spooldir_producer *producer)
+{
+    if (!producer->len)
+        return 0;
+    size_t len = producer->len;
+    producer->len = 0;
+    return producer_emit (producer, producer->buffer, len);
+}
+
+
+int
+spooldir_producer_write (spooldir_producer *producer, const void *data, size_t len)
+{
+    api_check_return_val (producer, -1);
+    api_check_return_val (producer->active, -1);
+    api_check_return_val (data || !len, -1);
+
+    if (producer->len + len > PRODUCER_BUFSZ && producer_flush (producer) < 0)
+        return -1;
+    if (len >= PRODUCER_BUFSZ)
+        return producer_emit (producer, data, len);
+
+    memcpy (producer->buffer + producer->len, data, len);
+    producer->len += len;
+    return 0;
+}
+
+
+int
+spooldir_producer_commit (spooldir_producer *producer, const spoolkey **key)
+{
+    api_check_return_val (producer, -1);
+    api_check_return_val (producer->active, -1);
+
+    spooltxn *txn = &producer->txn;
+    if (producer_flush (producer) < 0 ||
+        (producer->encoder && encoder_end (producer->encoder, txn->fd) < 0))
+    {
+        int saved_errno = errno;
+        spooldir_producer_rollback (producer);
+        errno = saved_errno;
+        return -1;
+    }
+    if (producer->spool->dedup && spooldir_derive_key (producer->spool, txn) < 0) {
+        int saved_errno = errno;
+        spooldir_producer_rollback (producer);
+        errno = saved_errno;
+        return -1;
+    }
+    spoolkey *last = spoolkey_init_inline (&producer->last_key, txn->key->bytes, txn->key->length);
+
+    producer->active = false;
+    int retval = spooldir_commit (producer->spool, txn);
+    if (retval >= 0 && key)
+        *key = last;
+    return retval;
+}
+
+
+int
+spooldir_producer_rollback (spooldir_producer *producer)
+{
+    api_check_return_val (producer, -1);
+    api_check_return_val (producer->active, -1);
+
+    producer->active = false;
+    producer->len = 0;
+    return spooldir_rollback (producer->spool, &producer->txn);
+}
+
+
+int
+spooldir_producer_add (spooldir_producer *producer, const void *data, size_t len,
+                       const spoolkey **key)
+{
+    api_check_return_val (producer, -1);
+
+    if (!spooldir_producer_begin (producer))
+        return -1;
+    if (spooldir_producer_write (producer, data, len) < 0) {
+        int saved_errno = errno;
+        spooldir_producer_rollback (producer);
+        errno = saved_errno;
+        return -1;
+    }
+    return spooldir_producer_commit (producer, key);
+}
+
+
+/*
+ * Decodes an encoded element from "raw" into "buf" when it fits, or into
+ * memory owned by the transaction otherwise.
+ */
+static int
+map_decode (struct txn_priv *priv, const uint8_t *raw, size_t raw_len,
+            void *buf, size_t bufsz, const void **data, size_t *len)
+{
+    const uint8_t codec = raw[offsetof (struct codec_header, codec)];
+    const uint8_t *src = raw + sizeof (struct codec_header);
+    const size_t src_len = raw_len - sizeof (struct codec_header);
+    const uint64_t decoded = load_le64 (raw + offsetof (struct codec_header, size));
+    if (codec_check_size (codec, src, src_len, decoded) < 0)
+        return -1;
+    if (decoded > SIZE_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    const size_t size = (size_t) decoded;
+    uint8_t *dst = buf;
+    if (size > bufsz && !(dst = malloc (size)))
+        return -1;
+
+    if (codec_decode (codec, src, src_len, dst, size) < 0)
+    {
+        if (dst != buf) {
+            int saved_errno = errno;
+            free (dst);
+            errno = saved_errno;
+        }
+        return -1;
+    }
+
+    if (dst != buf) {
+        priv->map = dst;
+        priv->map_len = size;
+        priv->flags |= TXN_MAP_HEAP;
+    }
+    *data = dst ? (const void*) dst : "";
+    *len = size;
+    return 0;
+}
+
+
+int
+spooldir_map_buf (spooltxn *txn, void *buf, size_t bufsz, const void **data, size_t *len)
+{
+    api_check_return_val (txn, -1);
+    api_check_return_val (data, -1);
+    api_check_return_val (len, -1);
+    api_check_return_val (buf || !bufsz, -1);
+
+    struct txn_priv *priv = txn_priv (txn);
+    if (priv->map) {
+        *data = priv->map;
+        *len = priv->map_len;
+        return 0;
+    }
+
+    struct stat sb;
+    if (fstat (txn->fd, &sb) < 0)
+        return -1;
+
+    const size_t size = (size_t) sb.st_size;
+    if (size <= bufsz || size == 0) {
+        /* Small elements are cheaper to read than to map. */
+        size_t done = 0;
+        while (done < size) {
+            ssize_t count = pread (txn->fd, (uint8_t*) buf + done, size - done, (off_t) done);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                return -1;
+            if (count == 0)
+                break;
+            done += (size_t) count;
+        }
+
+        if (codec_header_valid (buf, done)) {
+            /* Move the encoded data out of the way when the result fits. */
+            uint8_t *raw = buf;
+            const uint64_t decoded = load_le64 (raw + offsetof (struct codec_header, size));
+            if (decoded <= bufsz - done) {
+                raw = memmove ((uint8_t*) buf + bufsz - done, buf, done);
+                return map_decode (priv, raw, done, buf, bufsz - done, data, len);
+            }
+            return map_decode (priv, raw, done, NULL, 0, data, len);
+        }
+
+        *data = buf ? buf : "";
+        *len = done;
+        return 0;
+    }
+
+    void *map = mmap (NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, txn->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise (map, size, MADV_SEQUENTIAL);
+
+    if (codec_header_valid (map, size)) {
+        int retval = map_decode (priv, map, size, buf, bufsz, data, len);
+        int saved_errno = errno;
+        munmap (map, size);
+        errno = saved_errno;
+        return retval;
+    }
+
+    priv->map = map;
+    priv->map_len = size;
+    *data = map;
+    *len = size;
+    return 0;
+}
+
+
+int
+spooldir_map (spooltxn *txn, const void **data, size_t *len)
+{
+    return spooldir_map_buf (txn, NULL, 0, data, len);
+}
+
+
+void
+spooldir_unmap (spooltxn *txn)
+{
+    api_check_return (txn);
+
+    struct txn_priv *priv = txn_priv (txn);
+    if (priv->flags & TXN_MAP_HEAP) {
+        free (priv->map);
+        priv->flags &= ~TXN_MAP_HEAP;
+        priv->map = NULL;
+        priv->map_len = 0;
+    } else if (priv->map) {
+        munmap (priv->map, priv->map_len);
+        priv->map = NULL;
+        priv->map_len = 0;
+    }
+}
+
+
+/*
+ * Content keys chain HMAC-SHA256 over fixed-size chunks of the file, using
+ * the digest of the previous chunk as the key for the next one. The result
+ * only depends on the contents, not on how they were written.
+ */
+static const uint8_t dedup_label[] = "spooldir-dedup-v1";
+
+enum {
+    DEDUP_CHUNK_SIZE = 64 * 1024,
+};
+
+
+static int
+content_key (int fd, char bytes[SPOOLKEY_GENERATED_MAX + 1])
+{
+    uint8_t *chunk = malloc (DEDUP_CHUNK_SIZE);
+    if (!chunk)
+        return -1;
+
+    uint8_t digest[HMAC_SHA256_DIGEST_SIZE];
+    hmac_sha256 (digest, dedup_label, 0, dedup_label, sizeof (dedup_label) - 1);
+
+    off_t offset = 0;
+    for (;;) {
+        ssize_t count = pread (fd, chunk, DEDUP_CHUNK_SIZE, offset);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            int saved_errno = errno;
+            free (chunk);
+            errno = saved_errno;
+            return -1;
+        }
+        if (count == 0)
+            break;
+
+        uint8_t previous[HMAC_SHA256_DIGEST_SIZE];
+        memcpy (previous, digest, sizeof (previous));
+        hmac_sha256 (digest, chunk, (size_t) count, previous, sizeof (previous));
+        offset += count;
+    }
+    free (chunk);
+
+    int nbytes = hexify (digest, sizeof (digest), bytes, SPOOLKEY_GENERATED_MAX + 1);
+    assert_equal ((size_t) nbytes, sizeof (digest) * 2);
+    return nbytes;
+}
+
+
+int
+spooldir_derive_key (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txn, -1);
+    api_check_return_val (txn->status == SPOOLDIR_STATUS_TMP, -1);
+
+    if (txn_priv (txn)->flags & TXN_DERIVED)
+        return 0;
+
+    int fd = txn->fd;
+    if (fd < 0 && (fd = openat (spool->tmp_fd, txn->key->bytes,
+                                O_RDONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS)) < 0)
+        return -1;
+
+    /* The priority class is kept, and also part of the lookup. */
+    const size_t prefix_len = (name_priority (txn->key->bytes) != SPOOLDIR_PRIORITY_DEFAULT)
+        ? PRIORITY_PREFIX_LEN : 0;
+    char bytes[PRIORITY_PREFIX_LEN + SPOOLKEY_GENERATED_MAX + 1];
+    memcpy (bytes, txn->key->bytes, prefix_len);
+
+    int nbytes = content_key (fd, bytes + prefix_len);
+    int saved_errno = errno;
+    if (fd != txn->fd)
+        close (fd);
+    if (nbytes < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    nbytes += (int) prefix_len;
+
+    /*
+     * Named files are renamed in "tmp" as well. When identical contents
+     * are being added concurrently the random key is kept: the other
+     * transaction may still be rolled back.
+     */
+    if (!(txn_priv (txn)->flags & TXN_TMPFILE) &&
+        rename_noreplace (spool, spool->tmp_fd, txn->key->bytes, spool->tmp_fd, bytes) < 0)
+        return (errno == EEXIST) ? 0 : -1;
+
+    spoolkey_free (txn->key);
+    txn->key = spoolkey_init_inline (&txn->__key, bytes, (size_t) nbytes);
+    txn_priv (txn)->flags |= TXN_DERIVED;
+    return 0;
+}
+
+
+/*
+ * Checks whether an element with the same contents exists already in the
+ * "wip" or "cur" directories; ones in "new" are found when publishing.
+ */
+static inline bool
+dedup_exists (spooldir *spool, const char *path)
+{
+    struct stat sb;
+    return fstatat (spool->wip_fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0
+        || fstatat (spool->cur_fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+
+int
+spooldir_commit (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txn, -1);
+
+    if (spool->dedup && txn->status == SPOOLDIR_STATUS_TMP && spooldir_derive_key (spool, txn) < 0) {
+        int saved_errno = errno;
+        spooldir_rollback (spool, txn);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, txn->key->bytes, path_buf);
+    int retval = -1;
+    const enum spooldir_status from = txn->status;
+
+#if SPOOLDIR_ENABLE_STATS
+    /* Sized before publishing, which may close the descriptor. */
+    struct stat sb;
+    uint64_t bytes = 0;
+    if (txn->status == SPOOLDIR_STATUS_TMP && txn->fd >= 0 && fstat (txn->fd, &sb) == 0)
+        bytes = (uint64_t) sb.st_size;
+#endif
+
+    switch (txn->status) {
+        case SPOOLDIR_STATUS_TMP:
+            if ((txn_priv (txn)->flags & TXN_DERIVED) && dedup_exists (spool, path)) {
+                errno = EEXIST;
+                break;
+            }
+            txn->status = SPOOLDIR_STATUS_NEW;
+            switch (spool->durability) {
+                case SPOOLDIR_DURABILITY_NONE:
+                    retval = publish_new (spool, txn, path);
+                    break;
+                case SPOOLDIR_DURABILITY_ITEM:
+                    retval = commit_tmp_item (spool, txn, path);
+                    break;
+                case SPOOLDIR_DURABILITY_GROUP:
+                    retval = commit_tmp_group (spool, txn);
+                    break;
+            }
+            break;
+
+        case SPOOLDIR_STATUS_WIP: {
+            STAT_TIME_START (start);
+            txn->status = SPOOLDIR_STATUS_CUR;
+            retval = rename_noreplace (spool, spool->wip_fd, path, spool->cur_fd, path);
+            STAT_TIME_END (spool, SPOOLDIR_STAGE_FINISH, start);
+            break;
+        }
+
+        case SPOOLDIR_STATUS_CUR:
+        case SPOOLDIR_STATUS_NEW:
+        case SPOOLDIR_STATUS_FIN:
+            api_check_return_val (false, -1);
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (retval == 0) {
+        STAT_INC (spool, commits);
+        STAT_ADD (spool, bytes_written, bytes);
+        spool_moved (spool, from, txn->status, txn->key->bytes);
+    } else if (errno == EEXIST && (txn_priv (txn)->flags & TXN_DERIVED)) {
+        /* Same contents present already: drop the copy being added. */
+        if (!(txn_priv (txn)->flags & TXN_TMPFILE))
+            unlinkat (spool->tmp_fd, txn->key->bytes, 0);
+        retval = SPOOLDIR_DUPLICATE;
+    }
+
+    if (txn->key) {
+        spoolkey_free (txn->key);
+        txn->key = NULL;
+    }
+    spooldir_unmap (txn);
+    if (txn->fd >= 0) {
+        close (txn->fd);
+        txn->fd = -1;
+    }
+    return retval;
+}
+
+
+int
+spooldir_rollback (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txn, -1);
+
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, txn->key->bytes, path_buf);
+    int retval = -1;
+    const enum spooldir_status from = txn->status;
+
+    switch (txn->status) {
+        case SPOOLDIR_STATUS_TMP:
+            /* Unnamed files vanish once their descriptor is closed. */
+            retval = (txn_priv (txn)->flags & TXN_TMPFILE)
+                ? 0 : unlinkat (spool->tmp_fd, txn->key->bytes, 0);
+            break;
+
+        case SPOOLDIR_STATUS_WIP: {
+            STAT_TIME_START (start);
+            txn->status = SPOOLDIR_STATUS_NEW;
+            retval = rename_noreplace (spool, spool->wip_fd, path, spool->new_fd, path);
+            STAT_TIME_END (spool, SPOOLDIR_STAGE_FINISH, start);
+            break;
+        }
+
+        case SPOOLDIR_STATUS_NEW:
+        case SPOOLDIR_STATUS_CUR:
+        case SPOOLDIR_STATUS_FIN:
+            api_check_return_val (false, -1);
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (retval == 0) {
+        STAT_INC (spool, rollbacks);
+        spool_moved (spool, from, txn->status, txn->key->bytes);
+    }
+
+    if (txn->key) {
+        spoolkey_free (txn->key);
+        txn->key = NULL;
+    }
+    spooldir_unmap (txn);
+    if (txn->fd >= 0) {
+        close (txn->fd);
+        txn->fd = -1;
+    }
+    return retval;
+}
+
+
+#if HAVE_IO_URING
+/*
+ * Commits or rolls back a batch of transactions with io_uring. Each element
+ * needs at most a rename, link or unlink, linked to the closing of its file
+ * descriptor; when the first fails the close is cancelled, and it is done
+ * after trying the synchronous fall-back.
+ */
+static int
+finish_uring_batch (spooldir *spool, spooltxn *txns, unsigned n, bool commit)
+{
+    struct uring *r = spool->uring;
+    char paths[URING_BATCH][KEY_PATH_BUFSZ];
+    char procs[URING_BATCH][sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    int32_t results[2 * URING_BATCH];
+    bool queued[URING_BATCH];
+    unsigned n_cqes = 0;
+    int saved_errno = 0;
+#if SPOOLDIR_ENABLE_STATS
+    uint64_t bytes[URING_BATCH];
+#endif
+
+    pthread_mutex_lock (&r->lock);
+    for (unsigned i = 0; i < n; i++) {
+        spooltxn *txn = &txns[i];
+        const char *path = key_path (spool, txn->key->bytes, paths[i]);
+        struct io_uring_sqe *sqe = NULL;
+
+        results[2 * i] = results[2 * i + 1] = -ECANCELED;
+#if SPOOLDIR_ENABLE_STATS
+        struct stat sb;
+        bytes[i] = (commit && txn->status == SPOOLDIR_STATUS_TMP && txn->fd >= 0 &&
+                    fstat (txn->fd, &sb) == 0) ? (uint64_t) sb.st_size : 0;
+#endif
+
+        if (txn->status == SPOOLDIR_STATUS_WIP) {
+            sqe = uring_sqe (r, IORING_OP_RENAMEAT, spool->wip_fd, 2 * i);
+            uring_prep_rename (sqe, path, commit ? spool->cur_fd : spool->new_fd, path);
+        } else if (txn->status == SPOOLDIR_STATUS_TMP && (txn_priv (txn)->flags & TXN_TMPFILE)) {
+            if (commit) {
+                snprintf (procs[i], sizeof (procs[i]), "/proc/self/fd/%d", txn->fd);
+                sqe = uring_sqe (r, IORING_OP_LINKAT, AT_FDCWD, 2 * i);
+                sqe->addr = (uintptr_t) procs[i];
+                sqe->len = (uint32_t) spool->new_fd;
+                sqe->addr2 = (uintptr_t) path;
+                sqe->hardlink_flags = AT_SYMLINK_FOLLOW;
+            } else {
+                results[2 * i] = 0;  /* Closing the descriptor is enough. */
+            }
+        } else if (txn->status == SPOOLDIR_STATUS_TMP) {
+            if (commit) {
+                sqe = uring_sqe (r, IORING_OP_RENAMEAT, spool->tmp_fd, 2 * i);
+                uring_prep_rename (sqe, txn->key->bytes, spool->new_fd, path);
+            } else {
+                sqe = uring_sqe (r, IORING_OP_UNLINKAT, spool->tmp_fd, 2 * i);
+                sqe->addr = (uintptr_t) txn->key->bytes;
+            }
+        }
+
+        if ((queued[i] = (sqe != NULL)))
+            n_cqes++;
+        if (sqe && txn->fd >= 0) {
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe = uring_sqe (r, IORING_OP_CLOSE, txn->fd, 2 * i + 1);
+            n_cqes++;
+        }
+    }
+    if (uring_submit_and_wait (r, results, 2 * n, n_cqes) < 0)
+        saved_errno = errno;
+    pthread_mutex_unlock (&r->lock);
+
+    for (unsigned i = 0; i < n; i++) {
+        spooltxn *txn = &txns[i];
+        int retval = results[2 * i];
+
+        if (!queued[i] && txn->status != SPOOLDIR_STATUS_TMP) {
+            /* Invalid status: let the synchronous version report it. */
+            retval = commit ? spooldir_commit (spool, txn) : spooldir_rollback (spool, txn);
+            if (retval < 0 && !saved_errno)
+                saved_errno = errno;
+            continue;
+        }
+
+        const char *path = paths[i];
+        const enum spooldir_status from = txn->status;
+        if (txn->status == SPOOLDIR_STATUS_WIP) {
+            if (retval == -EINVAL || retval == -ENOSYS) {
+                atomic_store_explicit (&spool->have_renameat2, false, memory_order_relaxed);
+                retval = rename_noreplace (spool, spool->wip_fd, path,
+                                           commit ? spool->cur_fd : spool->new_fd, path) < 0
+                    ? -errno : 0;
+            }
+            txn->status = commit ? SPOOLDIR_STATUS_CUR : SPOOLDIR_STATUS_NEW;
+        } else if (commit) {
+            if ((retval == -EINVAL || retval == -ENOSYS) && !(txn_priv (txn)->flags & TXN_TMPFILE)) {
+                atomic_store_explicit (&spool->have_renameat2, false, memory_order_relaxed);
+                retval = publish_new (spool, txn, path) < 0 ? -errno : 0;
+            }
+            txn->status = SPOOLDIR_STATUS_NEW;
+        }
+
+        if (retval < 0 && !saved_errno)
+            saved_errno = -retval;
+        if (retval == 0) {
+            if (commit) {
+                STAT_INC (spool, commits);
+                STAT_ADD (spool, bytes_written, bytes[i]);
+            } else {
+                STAT_INC (spool, rollbacks);
+            }
+            spool_moved (spool, from, txn->status, path);
+        }
+
+        spooldir_unmap (txn);
+        if (txn->fd >= 0 && results[2 * i + 1] == -ECANCELED)
+            close (txn->fd);
+        txn->fd = -1;
+        spoolkey_free (txn->key);
+        txn->key = NULL;
+    }
+
+    if (saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+finish_uring (spooldir *spool, spooltxn *txns, size_t n, bool commit)
+{
+    int saved_errno = 0;
+    for (size_t i = 0; i < n; i += URING_BATCH) {
+        unsigned count = (n - i < URING_BATCH) ? (unsigned) (n - i) : URING_BATCH;
+        if (finish_uring_batch (spool, &txns[i], count, commit) < 0 && !saved_errno)
+            saved_errno = errno;
+    }
+
+    if (saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+#endif /* HAVE_IO_URING */
+
+
+/*
+ * The io_uring engine is used only when it can replace the synchronous
+ * operations one by one: renames must support RENAME_NOREPLACE, and new
+ * elements must not need flushing to disk nor hashing their contents.
+ */
+static inline bool
+use_uring (spooldir *spool, bool commit)
+{
+#if HAVE_IO_URING
+    return spool->uring
+        && atomic_load_explicit (&spool->have_renameat2, memory_order_relaxed)
+        && (!commit || (spool->durability == SPOOLDIR_DURABILITY_NONE && !spool->dedup));
+#else
+    (void) spool;
+    (void) commit;
+    return false;
+#endif
+}
+
+
+static int
+finish_many (spooldir *spool, spooltxn *txns, size_t n,
+             int (*finish) (spooldir*, spooltxn*))
+{
+    int saved_errno = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((*finish) (spool, &txns[i]) < 0 && !saved_errno)
+            saved_errno = errno;
+    }
+
+    if (saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+int
+spooldir_commit_many (spooldir *spool, spooltxn *txns, size_t n)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txns, -1);
+#if HAVE_IO_URING
+    if (use_uring (spool, true))
+        return finish_uring (spool, txns, n, true);
+#endif
+    return finish_many (spool, txns, n, spooldir_commit);
+}
+
+
+int
+spooldir_rollback_many (spooldir *spool, spooltxn *txns, size_t n)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txns, -1);
+#if HAVE_IO_URING
+    if (use_uring (spool, false))
+        return finish_uring (spool, txns, n, false);
+#endif
+    return finish_many (spool, txns, n, spooldir_rollback);
+}
+
+
+/*
+ * Writes the data from a vector of buffers which follows the first "done"
+ * bytes, at the same offset of a file.
+ */
+static int
+pwritev_all (int fd, const struct iovec *iov, int iovcnt, size_t done)
+{
+    off_t offset = (off_t) done;
+    for (;;) {
+        /* Skip the buffers written completely, then finish a partial one. */
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0)
+            return 0;
+
+        ssize_t written;
+        if (done > 0) {
+            written = pwrite (fd, (const uint8_t*) iov->iov_base + done,
+                              iov->iov_len - done, offset);
+        } else {
+            written = pwritev (fd, iov, iovcnt, offset);
+        }
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += written;
+        done += (size_t) written;
+    }
+}
+
+
+#if HAVE_IO_URING
+/*
+ * Writes the contents of a new element, publishes it and closes its file
+ * with a single submission of linked requests. Returns "1" when done, "0"
+ * if the synchronous path has to finish the job (the file is still open
+ * then, and "*written" bytes have been written), and "-1" on failure.
+ */
+static int
+add_iov_uring (spooldir *spool, spooltxn *txn, const char *path,
+               const struct iovec *iov, int iovcnt, size_t total, size_t *written)
+{
+    struct uring *r = spool->uring;
+    char proc[sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    int32_t results[3] = { -ECANCELED, -ECANCELED, -ECANCELED };
+
+    pthread_mutex_lock (&r->lock);
+    struct io_uring_sqe *sqe = uring_sqe (r, IORING_OP_WRITEV, txn->fd, 0);
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = (uint32_t) iovcnt;
+    sqe->off = 0;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    if (txn_priv (txn)->flags & TXN_TMPFILE) {
+        snprintf (proc, sizeof (proc), "/proc/self/fd/%d", txn->fd);
+        sqe = uring_sqe (r, IORING_OP_LINKAT, AT_FDCWD, 1);
+        sqe->addr = (uintptr_t) proc;
+        sqe->len = (uint32_t) spool->new_fd;
+        sqe->addr2 = (uintptr_t) path;
+        sqe->hardlink_flags = AT_SYMLINK_FOLLOW;
+    } else {
+        sqe = uring_sqe (r, IORING_OP_RENAMEAT, spool->tmp_fd, 1);
+        uring_prep_rename (sqe, txn->key->bytes, spool->new_fd, path);
+    }
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_sqe (r, IORING_OP_CLOSE, txn->fd, 2);
+
+    int retval = uring_submit_and_wait (r, results, 3, 3);
+    pthread_mutex_unlock (&r->lock);
+    if (retval < 0)
+        return -1;
+
+    if (results[1] == 0) {
+        if (results[2] == -ECANCELED)
+            close (txn->fd);
+        txn->fd = -1;
+        return 1;
+    }
+
+    /* Short writes and unsupported renames break the chain, retry those. */
+    *written = (results[0] > 0) ? (size_t) results[0] : 0;
+    if (results[0] < 0 && results[0] != -ECANCELED) {
+        errno = -results[0];
+        return -1;
+    }
+    if ((size_t) results[0] == total) {
+        if (results[1] == -EINVAL || results[1] == -ENOSYS)
+            atomic_store_explicit (&spool->have_renameat2, false, memory_order_relaxed);
+        else if (results[1] < 0 && results[1] != -ECANCELED) {
+            errno = -results[1];
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif /* HAVE_IO_URING */
+
+
+int
+spooldir_add_iov (spooldir *spool, const struct iovec *iov, int iovcnt, spoolkey **out_key)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (iov || !iovcnt, -1);
+    api_check_return_val (iovcnt >= 0 && iovcnt <= IOV_MAX, -1);
+
+    spooltxn txn;
+    if (spooldir_add (spool, &txn) < 0)
+        return -1;
+
+    spoolkey *key = NULL;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    size_t written = 0;
+    struct encoder *enc = spool_encoder (spool);
+#if HAVE_IO_URING
+    if (!enc && use_uring (spool, true)) {
+        if (out_key && !(key = spoolkey_copy (txn.key)))
+            goto error;
+
+        char path_buf[KEY_PATH_BUFSZ];
+        const char *path = key_path (spool, txn.key->bytes, path_buf);
+        int retval = add_iov_uring (spool, &txn, path, iov, iovcnt, total, &written);
+        if (retval < 0)
+            goto error;
+        if (retval > 0) {
+            STAT_INC (spool, commits);
+            STAT_ADD (spool, bytes_written, total);
+            spool_moved (spool, SPOOLDIR_STATUS_TMP, SPOOLDIR_STATUS_NEW, path);
+            txn.status = SPOOLDIR_STATUS_NEW;
+            spoolkey_free (txn.key);
+            goto done;
+        }
+    }
+#endif
+
+    /* Continue after what the io_uring path managed to write, if anything. */
+    if ((enc ? encode_iov (enc, txn.fd, iov, iovcnt) : pwritev_all (txn.fd, iov, iovcnt, written)) < 0 ||
+        (spool->dedup && spooldir_derive_key (spool, &txn) < 0) ||
+        (out_key && !key && !(key = spoolkey_copy (txn.key))))
+        goto error;
+
+    int retval = spooldir_commit (spool, &txn);
+    if (retval < 0)
+        goto error;
+
+    if (out_key)
+        *out_key = key;
+    return retval;
+
+done:
+    if (out_key)
+        *out_key = key;
+    return 0;
+
+error:
+    {
+        int saved_errno = errno;
+        if (txn.status == SPOOLDIR_STATUS_TMP)
+            spooldir_rollback (spool, &txn);
+        spoolkey_free (key);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+
+/*
+ * Leases of claimed elements are kept in their access time, which is set
+ * to the deadline; the modification time is left alone as it is used for
+ * ordering. Elements without a lease expire some time after entering "wip",
+ * which is when their inode change time was last updated.
+ */
+static int
+lease_stamp (int fd, unsigned seconds)
+{
+    struct timespec times[2];
+    clock_gettime (CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec += seconds;
+    times[1].tv_nsec = UTIME_OMIT;
+    return futimens (fd, times);
+}
+
+
+int
+spooldir_set_lease (spooldir *spool, unsigned seconds)
+{
+    api_check_return_val (spool, -1);
+    spool->lease_secs = seconds;
+    return 0;
+}
+
+
+int
+spooldir_renew_lease (spooltxn *txn, unsigned seconds)
+{
+    api_check_return_val (txn, -1);
+    api_check_return_val (txn->status == SPOOLDIR_STATUS_WIP, -1);
+    api_check_return_val (txn->fd >= 0, -1);
+    return lease_stamp (txn->fd, seconds);
+}
+
+
+enum {
+    REAP_BATCH = 32,
+};
+
+struct reap_batch {
+    unsigned        n;
+    char            paths[REAP_BATCH][KEY_PATH_BUFSZ];
+    struct timespec deadline[REAP_BATCH];
+    bool            valid[REAP_BATCH];
+};
+
+
+static inline struct timespec
+lease_deadline (struct timespec atime, struct timespec ctime, unsigned timeout)
+{
+    ctime.tv_sec += timeout;
+    return (atime.tv_sec > ctime.tv_sec ||
+            (atime.tv_sec == ctime.tv_sec && atime.tv_nsec > ctime.tv_nsec)) ? atime : ctime;
+}
+
+
+/*
+ * Deadlines of elements in "wip" come from their leases; for files in
+ * "tmp" ("lease" is false) counting from their last modification.
+ */
+static inline struct timespec
+batch_deadline (struct timespec atime, struct timespec ctime, struct timespec mtime,
+                unsigned timeout, bool lease)
+{
+    if (lease)
+        return lease_deadline (atime, ctime, timeout);
+    mtime.tv_sec += timeout;
+    return mtime;
+}
+
+
+static void
+reap_batch_stat (spooldir *spool, int dir_fd, struct reap_batch *batch, unsigned timeout, bool lease)
+{
+#if HAVE_IO_URING && defined(STATX_CTIME)
+    if (use_uring (spool, false)) {
+        struct uring *r = spool->uring;
+        struct statx stx[REAP_BATCH];
+        int32_t results[REAP_BATCH];
+
+        pthread_mutex_lock (&r->lock);
+        for (unsigned i = 0; i < batch->n; i++) {
+            struct io_uring_sqe *sqe = uring_sqe (r, IORING_OP_STATX, dir_fd, i);
+            sqe->addr = (uintptr_t) batch->paths[i];
+            sqe->len = STATX_ATIME | STATX_CTIME | STATX_MTIME;
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+            sqe->off = (uintptr_t) &stx[i];
+            results[i] = -ECANCELED;
+        }
+        int retval = uring_submit_and_wait (r, results, batch->n, batch->n);
+        pthread_mutex_unlock (&r->lock);
+
+        if (retval == 0) {
+            for (unsigned i = 0; i < batch->n; i++) {
+                if (!(batch->valid[i] = (results[i] == 0)))
+                    continue;
+                const struct timespec atime = { stx[i].stx_atime.tv_sec, stx[i].stx_atime.tv_nsec };
+                const struct timespec ctime = { stx[i].stx_ctime.tv_sec, stx[i].stx_ctime.tv_nsec };
+                const struct timespec mtime = { stx[i].stx_mtime.tv_sec, stx[i].stx_mtime.tv_nsec };
+                batch->deadline[i] = batch_deadline (atime, ctime, mtime, timeout, lease);
+            }
+            return;
+        }
+    }
+#endif
+
+    for (unsigned i = 0; i < batch->n; i++) {
+        struct stat sb;
+        if ((batch->valid[i] = (fstatat (dir_fd, batch->paths[i], &sb, AT_SYMLINK_NOFOLLOW) == 0)))
+            batch->deadline[i] = batch_deadline (sb.st_atim, sb.st_ctim, sb.st_mtim, timeout, lease);
+    }
+}
+
+
+/*
+ * Moves the expired elements of a batch from "wip" back to "new", or
+ * unlinks them from "src_fd" when "dst_fd" is negative. Returns how many.
+ */
+static ssize_t
+reap_batch_move (spooldir *spool, int src_fd, int dst_fd, struct reap_batch *batch,
+                 const struct timespec *now)
+{
+    bool expired[REAP_BATCH];
+    for (unsigned i = 0; i < batch->n; i++) {
+        const struct timespec *d = &batch->deadline[i];
+        expired[i] = batch->valid[i] &&
+            (d->tv_sec < now->tv_sec || (d->tv_sec == now->tv_sec && d->tv_nsec <= now->tv_nsec));
+    }
+
+    int32_t results[REAP_BATCH];
+    for (unsigned i = 0; i < batch->n; i++)
+        results[i] = -EINVAL;
+
+#if HAVE_IO_URING
+    if (use_uring (spool, false)) {
+        struct uring *r = spool->uring;
+        int32_t moved[REAP_BATCH];
+        unsigned queued[REAP_BATCH];
+        unsigned n_cqes = 0;
+
+        /* Completions are indexed by submission order, not by position. */
+        pthread_mutex_lock (&r->lock);
+        for (unsigned i = 0; i < batch->n; i++) {
+            if (!expired[i])
+                continue;
+            struct io_uring_sqe *sqe;
+            if (dst_fd >= 0) {
+                sqe = uring_sqe (r, IORING_OP_RENAMEAT, src_fd, n_cqes);
+                uring_prep_rename (sqe, batch->paths[i], dst_fd, batch->paths[i]);
+            } else {
+                sqe = uring_sqe (r, IORING_OP_UNLINKAT, src_fd, n_cqes);
+                sqe->addr = (uintptr_t) batch->paths[i];
+            }
+            moved[n_cqes] = -ECANCELED;
+            queued[n_cqes++] = i;
+        }
+        if (uring_submit_and_wait (r, moved, n_cqes, n_cqes) == 0) {
+            for (unsigned j = 0; j < n_cqes; j++)
+                results[queued[j]] = moved[j];
+        }
+        pthread_mutex_unlock (&r->lock);
+    }
+#endif
+
+    ssize_t count = 0;
+    int saved_errno = 0;
+    for (unsigned i = 0; i < batch->n; i++) {
+        if (!expired[i])
+            continue;
+
+        int retval = results[i];
+        if (retval == -EINVAL || retval == -ENOSYS || retval == -ECANCELED) {
+            retval = ((dst_fd >= 0)
+                      ? rename_noreplace (spool, src_fd, batch->paths[i], dst_fd, batch->paths[i])
+                      : unlinkat (src_fd, batch->paths[i], 0)) < 0 ? -errno : 0;
+        }
+        if (retval == 0) {
+            if (dst_fd >= 0) {
+                STAT_INC (spool, rollbacks);
+                spool_moved (spool, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_NEW, batch->paths[i]);
+            }
+            count++;
+        } else if (retval != -ENOENT && retval != -EEXIST && !saved_errno) {
+            /* Elements may be committed or rolled back meanwhile. */
+            saved_errno = -retval;
+        }
+    }
+
+    if (saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return count;
+}
+
+
+ssize_t
+spooldir_reap (spooldir *spool, unsigned timeout)
+{
+    api_check_return_val (spool, -1);
+
+    struct dirscan *scan = malloc (sizeof (struct dirscan));
+    struct reap_batch *batch = malloc (sizeof (struct reap_batch));
+    if (!scan || !batch) {
+        free (scan);
+        free (batch);
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+
+    ssize_t count = 0;
+    const unsigned nbuckets = spool_nbuckets (spool);
+    for (unsigned bucket = 0; bucket < nbuckets && count >= 0; bucket++) {
+        char name[BUCKET_NAME_BUFSZ];
+        bucket_name (spool, bucket, name);
+        if (dirscan_init (scan, spool->wip_fd, name) < 0) {
+            count = -1;
+            break;
+        }
+
+        /* Entries are handled in batches while the directory is read. */
+        int retval;
+        do {
+            const char *entry;
+            batch->n = 0;
+            while (batch->n < REAP_BATCH && (retval = dirscan_next_file (scan, &entry)) > 0) {
+                if (bucket_entry_path (spool, name, entry, batch->paths[batch->n]))
+                    batch->n++;
+            }
+            if (batch->n) {
+                reap_batch_stat (spool, spool->wip_fd, batch, timeout, true);
+                ssize_t moved = reap_batch_move (spool, spool->wip_fd, spool->new_fd, batch, &now);
+                if (moved < 0)
+                    retval = -1;
+                else
+                    count += moved;
+            }
+        } while (retval > 0);
+        if (retval < 0)
+            count = -1;
+
+        int saved_errno = errno;
+        dirscan_fini (scan);
+        errno = saved_errno;
+    }
+
+    int saved_errno = errno;
+    free (scan);
+    free (batch);
+    errno = saved_errno;
+    return count;
+}
+
+
+/*
+ * Recovery splits the work by directory: "tmp" and each bucket of "wip".
+ * Threads take the next directory to scan from a shared index, so buckets
+ * are handled in parallel, and entries in each one in batches.
+ */
+enum {
+    RECOVER_PROGRESS_EVERY = 64,  /* Batches between progress reports. */
+    RECOVER_MAX_THREADS = 64,
+};
+
+struct recover_job {
+    spooldir                              *spool;
+    const struct spooldir_recover_policy  *policy;
+    struct timespec                        now;
+    unsigned                               n_dirs;
+    atomic_uint                            next_dir;
+    pthread_mutex_t                        lock;
+    struct spooldir_recover_stats          stats;  /* Protected by "lock". */
+    int                                    error;  /* Protected by "lock". */
+};
+
+
+static void
+recover_report (struct recover_job *job, size_t scanned, size_t removed, size_t restored,
+                bool dir_done, int error)
+{
+    pthread_mutex_lock (&job->lock);
+    job->stats.scanned += scanned;
+    job->stats.removed += removed;
+    job->stats.restored += restored;
+    if (dir_done)
+        job->stats.dirs_done++;
+    if (error && !job->error)
+        job->error = error;
+    if (job->policy->progress)
+        (*job->policy->progress) (job->spool, &job->stats, job->policy->userdata);
+    pthread_mutex_unlock (&job->lock);
+}
+
+
+/*
+ * Directory zero is "tmp", the rest are the buckets of "wip".
+ */
+static void
+recover_dir (struct recover_job *job, unsigned dir, struct dirscan *scan, struct reap_batch *batch)
+{
+    spooldir *spool = job->spool;
+    const bool is_tmp = (dir == 0);
+    const int src_fd = is_tmp ? spool->tmp_fd : spool->wip_fd;
+    const int dst_fd = is_tmp ? -1 : spool->new_fd;
+    const unsigned timeout = is_tmp ? job->policy->tmp_age : job->policy->wip_timeout;
+
+    char name[BUCKET_NAME_BUFSZ];
+    if (is_tmp)
+        strcpy (name, ".");
+    else
+        bucket_name (spool, dir - 1, name);
+
+    if (dirscan_init (scan, src_fd, name) < 0) {
+        recover_report (job, 0, 0, 0, true, errno);
+        return;
+    }
+
+    size_t scanned = 0, finished = 0;
+    unsigned batches = 0;
+    int retval;
+    do {
+        const char *entry;
+        batch->n = 0;
+        while (batch->n < REAP_BATCH && (retval = dirscan_next_file (scan, &entry)) > 0) {
+            if (bucket_entry_path (spool, name, entry, batch->paths[batch->n]))
+                batch->n++;
+        }
+        if (batch->n) {
+            reap_batch_stat (spool, src_fd, batch, timeout, !is_tmp);
+            ssize_t count = reap_batch_move (spool, src_fd, dst_fd, batch, &job->now);
+            if (count < 0) {
+                retval = -1;
+                break;
+            }
+            scanned += batch->n;
+            finished += (size_t) count;
+        }
+        if (++batches % RECOVER_PROGRESS_EVERY == 0 && retval > 0) {
+            recover_report (job, scanned, is_tmp ? finished : 0, is_tmp ? 0 : finished, false, 0);
+            scanned = finished = 0;
+        }
+    } while (retval > 0);
+
+    int error = (retval < 0) ? errno : 0;
+    dirscan_fini (scan);
+    recover_report (job, scanned, is_tmp ? finished : 0, is_tmp ? 0 : finished, true, error);
+}
+
+
+static void*
+recover_work (void *data)
+{
+    struct recover_job *job = data;
+    struct dirscan *scan = malloc (sizeof (struct dirscan));
+    struct reap_batch *batch = malloc (sizeof (struct reap_batch));
+    if (!scan || !batch) {
+        recover_report (job, 0, 0, 0, false, ENOMEM);
+    } else {
+        unsigned dir;
+        while ((dir = atomic_fetch_add (&job->next_dir, 1)) < job->n_dirs)
+            recover_dir (job, dir, scan, batch);
+    }
+    free (scan);
+    free (batch);
+    return NULL;
+}
+
+
+int
+spooldir_recover (spooldir *spool, const struct spooldir_recover_policy *policy,
+                  struct spooldir_recover_stats *stats)
+{
+    api_check_return_val (spool, -1);
+
+    static const struct spooldir_recover_policy default_policy = {
+        .tmp_age = SPOOLDIR_RECOVER_TMP_AGE,
+    };
+    if (!policy)
+        policy = &default_policy;
+
+    struct recover_job job = {
+        .spool = spool,
+        .policy = policy,
+        .n_dirs = 1 + spool_nbuckets (spool),
+        .stats = { .dirs_total = 1 + spool_nbuckets (spool) },
+    };
+    clock_gettime (CLOCK_REALTIME, &job.now);
+    atomic_init (&job.next_dir, 0);
+    pthread_mutex_init (&job.lock, NULL);
+
+    unsigned n_threads = policy->n_threads;
+    if (!n_threads) {
+        long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0) ? (unsigned) n_cpus : 1;
+    }
+    if (n_threads > RECOVER_MAX_THREADS)
+        n_threads = RECOVER_MAX_THREADS;
+    if (n_threads > job.n_dirs)
+        n_threads = job.n_dirs;
+
+    /* The calling thread does its share of the work, too. */
+    pthread_t threads[RECOVER_MAX_THREADS];
+    unsigned n_started = 0;
+    while (n_started + 1 < n_threads &&
+           pthread_create (&threads[n_started], NULL, recover_work, &job) == 0)
+        n_started++;
+    recover_work (&job);
+    for (unsigned i = 0; i < n_started; i++)
+        pthread_join (threads[i], NULL);
+
+    pthread_mutex_destroy (&job.lock);
+    if (stats)
+        *stats = job.stats;
+    if (job.error) {
+        errno = job.error;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Candidates for ordered picking, kept in a binary min-heap.
+ */
+enum { ORDER_BATCH = 256 };
+
+struct order_item {
+    unsigned        priority;
+    bool            prefetched;
+    struct timespec mtime;
+    const char     *name;  /* Points into "path", without a priority prefix. */
+    char            path[KEY_PATH_BUFSZ];
+};
+
+struct order_heap {
+    size_t             len;
+    struct order_item *heap[ORDER_BATCH];
+    struct order_item  items[ORDER_BATCH];
+};
+
+struct _spooldir_cursor {
+    spooldir          *spool;
+    unsigned           bucket;
+    unsigned           idle_scans;  /* Complete scans without picking anything. */
+    struct dirscan     scan;
+    struct order_heap *order;       /* Allocated for ordered picking. */
+#if HAVE_GETDENTS64
+    unsigned           prefetch_fill;  /* Scan buffer fill of "prefetch_pos". */
+    size_t             prefetch_pos;   /* Entries before it have been read ahead. */
+#endif
+};
+
+
+static int
+cursor_open_bucket (spooldir_cursor *cursor)
+{
+    char name[BUCKET_NAME_BUFSZ];
+    bucket_name (cursor->spool, cursor->bucket, name);
+#if HAVE_GETDENTS64
+    cursor->prefetch_fill = 0;
+    cursor->prefetch_pos = 0;
+#endif
+    return dirscan_init (&cursor->scan, cursor->spool->new_fd, name);
+}
+
+
+/*
+ * Elements about to be picked are read ahead, so their contents are in the
+ * page cache by the time they are handled. Entries are opened only to
+ * give the advice; claiming them later uses a new descriptor.
+ */
+enum {
+    PREFETCH_MAX_BYTES = 1024 * 1024,  /* Read ahead at most this much of each. */
+};
+
+
+static inline void
+prefetch_fd (int fd)
+{
+#if HAVE_POSIX_FADVISE
+    (void) posix_fadvise (fd, 0, PREFETCH_MAX_BYTES, POSIX_FADV_WILLNEED);
+#else
+    (void) fd;
+#endif
+}
+
+
+static void
+prefetch_path (spooldir *spool, const char *path)
+{
+    int fd = openat (spool->new_fd, path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | SPOOLDIR_FILE_O_FLAGS);
+    if (fd >= 0) {
+        prefetch_fd (fd);
+        close (fd);
+    }
+}
+
+
+/*
+ * Reads ahead the next entries of the directory scan, without consuming
+ * them, up to the prefetch window. Entries already read ahead are skipped.
+ */
+static void
+cursor_prefetch (spooldir_cursor *cursor)
+{
+#if HAVE_GETDENTS64 && HAVE_POSIX_FADVISE
+    spooldir *spool = cursor->spool;
+    const struct dirscan *scan = &cursor->scan;
+
+    if (cursor->prefetch_fill != scan->fills || cursor->prefetch_pos < scan->pos) {
+        cursor->prefetch_fill = scan->fills;
+        cursor->prefetch_pos = scan->pos;
+    }
+
+    unsigned ahead = 0;
+    for (size_t pos = scan->pos; pos < scan->len && ahead < spool->prefetch_window;) {
+        const struct linux_dirent64 *de = (const struct linux_dirent64*) (scan->buf + pos);
+        pos += de->d_reclen;
+        if (de->d_name[0] == '.' || (de->d_type != DT_REG && de->d_type != DT_UNKNOWN))
+            continue;
+
+        if (pos > cursor->prefetch_pos) {
+            char path[KEY_PATH_BUFSZ];
+            prefetch_path (spool, key_path (spool, de->d_name, path));
+            cursor->prefetch_pos = pos;
+        }
+        ahead++;
+    }
+#else
+    (void) cursor;
+#endif
+}
+
+
+/*
+ * Moves a cursor to the start of the next bucket, which is the beginning of
+ * the same directory when fan-out is not in use.
+ */
+static int
+cursor_advance (spooldir_cursor *cursor)
+{
+    const unsigned nbuckets = spool_nbuckets (cursor->spool);
+    if (nbuckets == 1) {
+        dirscan_rewind (&cursor->scan);
+        return 0;
+    }
+
+    dirscan_fini (&cursor->scan);
+    cursor->bucket = (cursor->bucket + 1) % nbuckets;
+    return cursor_open_bucket (cursor);
+}
+
+
+spooldir_cursor*
+spooldir_cursor_open (spooldir *spool)
+{
+    api_check_return_val (spool, NULL);
+    api_check_return_val (spool->new_fd >= 0, NULL);
+
+    spooldir_cursor *cursor = (spooldir_cursor*) malloc (sizeof (spooldir_cursor));
+    if (!cursor)
+        return NULL;
+
+    cursor->spool = spool;
+    cursor->bucket = 0;
+    cursor->idle_scans = 1;
+    cursor->order = NULL;
+
+    if (cursor_open_bucket (cursor) < 0) {
+        int saved_errno = errno;
+        free (cursor);
+        errno = saved_errno;
+        return NULL;
+    }
+    return cursor;
+}
+
+
+void
+spooldir_cursor_close (spooldir_cursor *cursor)
+{
+    api_check_return (cursor);
+
+    dirscan_fini (&cursor->scan);
+    free (cursor->order);
+    free (cursor);
+}
+
+
+enum cursor_scan {
+    CURSOR_ERROR = -1,
+    CURSOR_BUCKET_END,  /* Moved to the next bucket. */
+    CURSOR_NAME,        /* Found a candidate element. */
+    CURSOR_IDLE,        /* Scanned all the buckets without picking. */
+};
+
+static enum cursor_scan
+cursor_next_name (spooldir_cursor *cursor, const char **name)
+{
+    int retval = dirscan_next_file (&cursor->scan, name);
+    if (retval < 0)
+        return CURSOR_ERROR;
+    if (retval > 0) {
+        STAT_INC (cursor->spool, entries_scanned);
+        return CURSOR_NAME;
+    }
+
+    /*
+     * Elements may have been added behind the current position: there are
+     * no elements only after scanning all the buckets (or the whole
+     * directory) from their start without picking.
+     */
+    if (cursor_advance (cursor) < 0)
+        return CURSOR_ERROR;
+    if (++cursor->idle_scans > spool_nbuckets (cursor->spool)) {
+        cursor->idle_scans = 1;
+        return CURSOR_IDLE;
+    }
+    return CURSOR_BUCKET_END;
+}
+
+
+static int lease_stamp (int fd, unsigned seconds);
+
+static inline void
+txn_claimed (spooldir *spool, spooltxn *txn, int fd, const char *name)
+{
+    STAT_INC (spool, picks);
+    spool_moved (spool, SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP, name);
+    if (spool->lease_secs)
+        (void) lease_stamp (fd, spool->lease_secs);  /* Reaping uses ctime otherwise. */
+    txn->fd = fd;
+    txn->key = txn_key_from_name (txn, name);
+    txn->status = SPOOLDIR_STATUS_WIP;
+    txn_priv_init (txn);
+}
+
+
+static bool
+order_item_less (enum spooldir_pick_order order, const struct order_item *a,
+                 const struct order_item *b)
+{
+    if (a->priority != b->priority)
+        return a->priority < b->priority;
+    if (order == SPOOLDIR_PICK_FIFO) {
+        if (a->mtime.tv_sec != b->mtime.tv_sec)
+            return a->mtime.tv_sec < b->mtime.tv_sec;
+        if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+            return a->mtime.tv_nsec < b->mtime.tv_nsec;
+    }
+    return strcmp (a->name, b->name) < 0;
+}
+
+
+static void
+order_heap_push (struct order_heap *h, enum spooldir_pick_order order, struct order_item *item)
+{
+    size_t i = h->len++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!order_item_less (order, item, h->heap[parent]))
+            break;
+        h->heap[i] = h->heap[parent];
+        i = parent;
+    }
+    h->heap[i] = item;
+}
+
+
+static struct order_item*
+order_heap_pop (struct order_heap *h, enum spooldir_pick_order order)
+{
+    struct order_item *top = h->heap[0];
+    struct order_item *last = h->heap[--h->len];
+
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= h->len)
+            break;
+        if (child + 1 < h->len && order_item_less (order, h->heap[child + 1], h->heap[child]))
+            child++;
+        if (!order_item_less (order, h->heap[child], last))
+            break;
+        h->heap[i] = h->heap[child];
+        i = child;
+    }
+    if (h->len)
+        h->heap[i] = last;
+    return top;
+}
+
+
+/*
+ * Reads the next batch of candidates. Buckets are walked until the batch
+ * is full, but never more than once, to avoid having duplicates.
+ */
+static enum cursor_scan
+order_fill (spooldir_cursor *cursor, enum spooldir_pick_order order)
+{
+    spooldir *spool = cursor->spool;
+    struct order_heap *h = cursor->order;
+    const unsigned nbuckets = spool_nbuckets (spool);
+    unsigned bucket_ends = 0;
+    enum cursor_scan scan;
+
+    h->len = 0;
+    while (h->len < ORDER_BATCH) {
+        const char *name;
+        if ((scan = cursor_next_name (cursor, &name)) != CURSOR_NAME) {
+            if (scan == CURSOR_BUCKET_END && ++bucket_ends < nbuckets)
+                continue;
+            break;
+        }
+
+        struct order_item *item = &h->items[h->len];
+        const char *path = key_path (spool, name, item->path);
+        if (path != item->path)
+            memcpy (item->path, path, strlen (path) + 1);
+
+        if (order == SPOOLDIR_PICK_FIFO) {
+            struct stat sb;
+            if (fstatat (spool->new_fd, item->path, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;  /* Probably picked by another process. */
+            item->mtime = sb.st_mtim;
+        }
+
+        const char *slash = strrchr (item->path, '/');
+        item->name = slash ? slash + 1 : item->path;
+        item->prefetched = false;
+        item->priority = name_priority (item->name);
+        if (item->priority != SPOOLDIR_PRIORITY_DEFAULT)
+            item->name += 2;
+        order_heap_push (h, order, item);
+    }
+    return scan;
+}
+
+
+/*
+ * The first entries of the heap are among the next ones to be picked,
+ * which is close enough for reading ahead.
+ */
+static void
+order_prefetch (spooldir_cursor *cursor)
+{
+    struct order_heap *h = cursor->order;
+    const size_t n = (h->len < cursor->spool->prefetch_window) ? h->len : cursor->spool->prefetch_window;
+    for (size_t i = 0; i < n; i++) {
+        if (!h->heap[i]->prefetched) {
+            prefetch_path (cursor->spool, h->heap[i]->path);
+            h->heap[i]->prefetched = true;
+        }
+    }
+}
+
+
+static int
+cursor_next_ordered (spooldir_cursor *cursor, enum spooldir_pick_order order, spooltxn *txn)
+{
+    spooldir *spool = cursor->spool;
+
+    if (!cursor->order && !(cursor->order = calloc (1, sizeof (struct order_heap))))
+        return -1;
+
+    for (;;) {
+        if (cursor->order->len == 0) {
+            enum cursor_scan scan = order_fill (cursor, order);
+            if (scan == CURSOR_ERROR)
+                return -1;
+            if (cursor->order->len == 0) {
+                if (scan == CURSOR_IDLE) {
+                    errno = 0;
+                    return EOF;
+                }
+                continue;
+            }
+        }
+
+        struct order_item *item = order_heap_pop (cursor->order, order);
+        int fd = move_and_open (spool, spool->new_fd, spool->wip_fd, item->path);
+        if (fd == -ENOENT || fd == -EEXIST)
+            continue;  /* Another process claimed the element first. */
+        if (fd < 0)
+            return -1;
+
+        const char *slash = strrchr (item->path, '/');
+        cursor->idle_scans = 0;
+        txn_claimed (spool, txn, fd, slash ? slash + 1 : item->path);
+        if (spool->prefetch_window)
+            order_prefetch (cursor);
+        return 0;
+    }
+}
+
+
+int
+spooldir_cursor_next (spooldir_cursor *cursor, spooltxn *txn)
+{
+    api_check_return_val (cursor, -1);
+    api_check_return_val (txn, -1);
+
+    spooldir *spool = cursor->spool;
+    const char *name;
+
+    if (spool->pick_order != SPOOLDIR_PICK_ANY)
+        return cursor_next_ordered (cursor, spool->pick_order, txn);
+
+    for (;;) {
+        switch (cursor_next_name (cursor, &name)) {
+            case CURSOR_ERROR:
+                return -1;
+            case CURSOR_IDLE:
+                errno = 0;
+                return EOF;
+            case CURSOR_BUCKET_END:
+                continue;
+            case CURSOR_NAME:
+                break;
+        }
+
+        char path[KEY_PATH_BUFSZ];
+        int fd = move_and_open (spool, spool->new_fd, spool->wip_fd,
+                                key_path (spool, name, path));
+        if (fd == -ENOENT || fd == -EEXIST)
+            continue;  /* Another process claimed the element first. */
+        if (fd < 0)
+            return -1;
+
+        cursor->idle_scans = 0;
+        txn_claimed (spool, txn, fd, name);
+        if (spool->prefetch_window)
+            cursor_prefetch (cursor);
+        return 0;
+    }
+}
+
+
+#if HAVE_IO_URING
+/*
+ * Claims the elements found in a bucket in batches: the rename from "new"
+ * to "wip" of each one is linked to its opening, and all of them are
+ * submitted at once. Returns the number of elements picked.
+ */
+static ssize_t
+cursor_next_uring (spooldir_cursor *cursor, spooltxn *txns, size_t n)
+{
+    spooldir *spool = cursor->spool;
+    struct uring *r = spool->uring;
+    char paths[URING_BATCH][KEY_PATH_BUFSZ];
+    int32_t results[2 * URING_BATCH];
+    size_t count = 0;
+    int saved_errno = 0;
+
+    while (count < n) {
+        /* Names are copied: scanning further may reuse their storage. */
+        enum cursor_scan scan = CURSOR_BUCKET_END;
+        unsigned batch = 0;
+        while (batch < URING_BATCH && batch < n - count) {
+            const char *name;
+            if ((scan = cursor_next_name (cursor, &name)) != CURSOR_NAME)
+                break;
+            const char *path = key_path (spool, name, paths[batch]);
+            if (path != paths[batch])
+                memcpy (paths[batch], path, strlen (path) + 1);
+            batch++;
+        }
+        if (scan == CURSOR_ERROR && !saved_errno)
+            saved_errno = errno;
+
+        pthread_mutex_lock (&r->lock);
+        for (unsigned i = 0; i < batch; i++) {
+            struct io_uring_sqe *sqe = uring_sqe (r, IORING_OP_RENAMEAT, spool->new_fd, 2 * i);
+            uring_prep_rename (sqe, paths[i], spool->wip_fd, paths[i]);
+            sqe->flags |= IOSQE_IO_LINK;
+
+            sqe = uring_sqe (r, IORING_OP_OPENAT, spool->wip_fd, 2 * i + 1);
+            sqe->addr = (uintptr_t) paths[i];
+            sqe->open_flags = O_RDWR | SPOOLDIR_FILE_O_FLAGS;
+        }
+        int retval = uring_submit_and_wait (r, results, 2 * batch, 2 * batch);
+        pthread_mutex_unlock (&r->lock);
+        if (retval < 0) {
+            saved_errno = errno;
+            break;
+        }
+
+        for (unsigned i = 0; i < batch; i++) {
+            const char *path = paths[i];
+            const char *name = strrchr (path, '/');
+            name = name ? name + 1 : path;
+
+            int fd = results[2 * i + 1];
+            if (results[2 * i] == -EINVAL || results[2 * i] == -ENOSYS) {
+                /* Let the synchronous version choose a fall-back. */
+                fd = move_and_open (spool, spool->new_fd, spool->wip_fd, path);
+            } else if (results[2 * i] < 0) {
+                fd = results[2 * i];
+            } else if (fd < 0) {
+                rename_noreplace (spool, spool->wip_fd, path, spool->new_fd, path);
+            }
+
+            if (fd == -ENOENT || fd == -EEXIST) {
+                STAT_INC (spool, pick_races);
+                continue;  /* Another process claimed the element first. */
+            }
+            if (fd < 0) {
+                if (!saved_errno)
+                    saved_errno = -fd;
+                continue;
+            }
+
+            /* Elements after the first one in the batch are handled later. */
+            if (spool->prefetch_window && count > 0)
+                prefetch_fd (fd);
+            cursor->idle_scans = 0;
+            txn_claimed (spool, &txns[count++], fd, name);
+        }
+        if (spool->prefetch_window)
+            cursor_prefetch (cursor);
+
+        if (scan == CURSOR_ERROR || (scan == CURSOR_IDLE && cursor->idle_scans))
+            break;
+        if (!atomic_load_explicit (&spool->have_renameat2, memory_order_relaxed))
+            break;
+    }
+
+    if (count == 0 && saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return (ssize_t) count;
+}
+#endif /* HAVE_IO_URING */
+
+
+ssize_t
+spooldir_cursor_next_many (spooldir_cursor *cursor, spooltxn *txns, size_t n)
+{
+    api_check_return_val (cursor, -1);
+    api_check_return_val (txns, -1);
+
+    size_t count = 0;
+
+#if HAVE_IO_URING
+    if (use_uring (cursor->spool, false) && cursor->spool->pick_order == SPOOLDIR_PICK_ANY) {
+        ssize_t retval = cursor_next_uring (cursor, txns, n);
+        if (retval < 0)
+            return -1;
+        if (use_uring (cursor->spool, false)) {
+            errno = 0;
+            return retval;
+        }
+        count = (size_t) retval;  /* Continue without RENAME_NOREPLACE. */
+    }
+#endif
+
+    while (count < n) {
+        int retval = spooldir_cursor_next (cursor, &txns[count]);
+        if (retval == 0) {
+            count++;
+        } else if (retval == EOF && errno == 0) {
+            break;
+        } else {
+            /* Report the error only if nothing was picked. */
+            if (count == 0)
+                return -1;
+            break;
+        }
+    }
+
+    errno = 0;
+    return (ssize_t) count;
+}
+
+
+/*
+ * The in-memory index is implemented below; these return "INDEX_STALE"
+ * when the file system needs to be used instead.
+ */
+enum { INDEX_STALE = 1 };
+static int index_pick (spooldir *spool, spooltxn *txn);
+static ssize_t index_count (const spooldir *spool, enum spooldir_status status);
+static int index_has_status (const spooldir *spool, const spoolkey *key,
+                             enum spooldir_status status);
+
+
+int
+spooldir_pick (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (spool->new_fd >= 0, -1);
+    api_check_return_val (spool->wip_fd >= 0, -1);
+    api_check_return_val (txn, -1);
+
+    int retval = -1;
+
+    pthread_mutex_lock (&spool->pick_lock);
+    if (!spool->index || (retval = index_pick (spool, txn)) == INDEX_STALE) {
+        if (!spool->pick_cursor)
+            spool->pick_cursor = spooldir_cursor_open (spool);
+        retval = spool->pick_cursor ? spooldir_cursor_next (spool->pick_cursor, txn) : -1;
+    }
+    pthread_mutex_unlock (&spool->pick_lock);
+
+    return retval;
+}
+
+
+ssize_t
+spooldir_pick_many (spooldir *spool, spooltxn *txns, size_t n)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (txns, -1);
+
+    ssize_t retval = -1;
+
+    pthread_mutex_lock (&spool->pick_lock);
+    size_t count = 0;
+    int status = INDEX_STALE;
+    if (spool->index) {
+        while (count < n && (status = index_pick (spool, &txns[count])) == 0)
+            count++;
+    }
+    if (status == INDEX_STALE) {
+        if (!spool->pick_cursor)
+            spool->pick_cursor = spooldir_cursor_open (spool);
+        retval = spool->pick_cursor
+            ? spooldir_cursor_next_many (spool->pick_cursor, &txns[count], n - count) : -1;
+        retval = (retval < 0) ? (count ? (ssize_t) count : -1) : retval + (ssize_t) count;
+    } else {
+        /* Report the error only if nothing was picked. */
+        retval = (count == 0 && status < 0 && errno != 0) ? -1 : (ssize_t) count;
+    }
+    pthread_mutex_unlock (&spool->pick_lock);
+
+    if (retval >= 0)
+        errno = 0;
+    return retval;
+}
+
+
+_Bool
+spooldir_has_status (const spooldir *spool, const spoolkey *key,
                      enum spooldir_status status)
 {
-    api_check_return_val (spool, false);
+    api_check_return_val (spool, false);
+    api_check_return_val (key, false);
+
+    if (spool->index) {
+        int retval = index_has_status (spool, key, status);
+        if (retval != INDEX_STALE)
+            return retval;
+    }
+
+    int subdir_fd = status_to_fd (spool, status);
+    if (subdir_fd < 0)
+        return false;
+
+    char path[KEY_PATH_BUFSZ];
+    const char *name = (status == SPOOLDIR_STATUS_TMP)
+        ? key->bytes : key_path (spool, key->bytes, path);
+
+    struct stat sb;
+    return (fstatat (subdir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+        && (S_ISREG (sb.st_mode));
+}
+
+
+ssize_t
+spooldir_count (const spooldir *spool, enum spooldir_status status, unsigned flags)
+{
+    api_check_return_val (spool, -1);
+
+    if (status_to_counts (status) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (spool->index) {
+        ssize_t count = index_count (spool, status);
+        if (count >= 0)
+            return count;
+    }
+
+    if (spool->counts && !(flags & SPOOLDIR_COUNT_EXACT)) {
+        long long count = atomic_load_explicit (&spool->counts->count[status_to_counts (status)],
+                                                memory_order_relaxed);
+        return (count > 0) ? (ssize_t) count : 0;
+    }
+
+    return count_scan (spool, status);
+}
+
+
+/*
+ * Subdirectories watched for changes, and the status which corresponds to
+ * elements appearing in each of them.
+ */
+static const enum spooldir_status notify_status[] = {
+    SPOOLDIR_STATUS_NEW,
+    SPOOLDIR_STATUS_WIP,
+    SPOOLDIR_STATUS_CUR,
+};
+
+enum {
+    N_NOTIFY_STATUS = sizeof (notify_status) / sizeof (notify_status[0]),
+};
+
+
+/*
+ * With fan-out enabled, each bucket directory needs its own watch.
+ */
+struct notify_watch {
+    int                  id;  /* inotify watch descriptor or directory fd. */
+    enum spooldir_status status;
+};
+
+struct _spooldir_notifier {
+    spooldir   *spool;
+    spooldircfn callback;
+    void       *userdata;
+    int         fd;
+    bool        overflowed;  /* Some events were lost. */
+    size_t      n_watches;
+    struct notify_watch watches[];
+};
+
+
+#if HAVE_INOTIFY
+static int
+notify_watch_compare (const void *a, const void *b)
+{
+    const struct notify_watch *wa = a, *wb = b;
+    return (wa->id > wb->id) - (wa->id < wb->id);
+}
+#endif
+
+
+#if HAVE_INOTIFY || HAVE_KQUEUE
+static int
+notifier_add_watch (spooldir_notifier *notifier, enum spooldir_status status,
+                    const char *bucket)
+{
+    struct notify_watch *watch = &notifier->watches[notifier->n_watches];
+    watch->status = status;
+
+#if HAVE_INOTIFY
+    /*
+     * Subdirectories are opened with O_PATH: watch them through their
+     * /proc entries, as inotify only accepts path names.
+     */
+    char path[sizeof ("/proc/self/fd/") + 3 * sizeof (int) + BUCKET_NAME_BUFSZ];
+    snprintf (path, sizeof (path), "/proc/self/fd/%d/%s",
+              status_to_fd (notifier->spool, status), bucket);
+
+    /* Elements leaving the spool, moves between subdirectories excepted. */
+    uint32_t mask = IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_ONLYDIR;
+    if (status == SPOOLDIR_STATUS_CUR)
+        mask |= IN_MOVED_FROM;
+
+    if ((watch->id = inotify_add_watch (notifier->fd, path, mask)) < 0)
+        return -1;
+#elif HAVE_KQUEUE
+    /* EVFILT_VNODE needs descriptors which can be read. */
+    if ((watch->id = openat (status_to_fd (notifier->spool, status), bucket,
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+
+    struct kevent ev;
+    EV_SET (&ev, watch->id, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0,
+            (void*) (uintptr_t) notifier->n_watches);
+    if (kevent (notifier->fd, &ev, 1, NULL, 0, NULL) < 0) {
+        int saved_errno = errno;
+        close (watch->id);
+        errno = saved_errno;
+        return -1;
+    }
+#endif
+
+    notifier->n_watches++;
+    return 0;
+}
+#endif /* HAVE_INOTIFY || HAVE_KQUEUE */
+
+
+spooldir_notifier*
+spooldir_notifier_new (spooldir *spool, spooldircfn callback, void *userdata)
+{
+    api_check_return_val (spool, NULL);
+    api_check_return_val (callback, NULL);
+
+#if HAVE_INOTIFY || HAVE_KQUEUE
+    const unsigned nbuckets = spool_nbuckets (spool);
+    spooldir_notifier *notifier = (spooldir_notifier*)
+        calloc (1, sizeof (spooldir_notifier) +
+                N_NOTIFY_STATUS * nbuckets * sizeof (struct notify_watch));
+    if (!notifier)
+        return NULL;
+
+    notifier->spool = spool;
+    notifier->callback = callback;
+    notifier->userdata = userdata;
+
+#if HAVE_INOTIFY
+    notifier->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+#else
+    notifier->fd = kqueue ();
+#endif
+    if (notifier->fd < 0)
+        goto error;
+
+    for (unsigned i = 0; i < N_NOTIFY_STATUS; i++) {
+        for (unsigned bucket = 0; bucket < nbuckets; bucket++) {
+            char name[BUCKET_NAME_BUFSZ];
+            bucket_name (spool, bucket, name);
+            if (notifier_add_watch (notifier, notify_status[i], name) < 0)
+                goto error;
+        }
+    }
+
+#if HAVE_INOTIFY
+    /* Sorted, to find watches using bsearch(). */
+    qsort (notifier->watches, notifier->n_watches, sizeof (struct notify_watch),
+           notify_watch_compare);
+#endif
+    return notifier;
+
+error:
+    {
+        int saved_errno = errno;
+        spooldir_notifier_free (notifier);
+        errno = saved_errno;
+    }
+    return NULL;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+
+void
+spooldir_notifier_free (spooldir_notifier *notifier)
+{
+    api_check_return (notifier);
+
+#if HAVE_KQUEUE
+    for (size_t i = 0; i < notifier->n_watches; i++)
+        close (notifier->watches[i].id);
+#endif
+    if (notifier->fd >= 0)
+        close (notifier->fd);
+    free (notifier);
+}
+
+
+int
+spooldir_notifier_fd (const spooldir_notifier *notifier)
+{
+    api_check_return_val (notifier, -1);
+    return notifier->fd;
+}
+
+
+static void
+notifier_emit (spooldir_notifier *notifier, enum spooldir_status status, const char *name)
+{
+    if (name[0] == '.')  /* Skip hidden files */
+        return;
+
+    spooltxn txn = {
+        .status = status,
+        .fd = -1,
+    };
+    txn.key = txn_key_from_name (&txn, name);
+    (*notifier->callback) (notifier->spool, status, &txn, notifier->userdata);
+
+    /* The callback may have taken ownership of the key. */
+    if (txn.key)
+        spoolkey_free (txn.key);
+    if (txn.fd >= 0)
+        close (txn.fd);
+}
+
+
+int
+spooldir_notifier_dispatch (spooldir_notifier *notifier)
+{
+    api_check_return_val (notifier, -1);
+
+    int count = 0;
+
+#if HAVE_INOTIFY
+    char buffer[16 * 1024]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    for (;;) {
+        ssize_t nread = read (notifier->fd, buffer, sizeof (buffer));
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        for (char *p = buffer; p < buffer + nread;) {
+            const struct inotify_event *ev = (const struct inotify_event*) p;
+            p += sizeof (struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+                notifier->overflowed = true;
+
+            if (!ev->len || (ev->mask & IN_ISDIR))
+                continue;
+
+            const struct notify_watch key = { .id = ev->wd };
+            const struct notify_watch *watch =
+                bsearch (&key, notifier->watches, notifier->n_watches,
+                         sizeof (struct notify_watch), notify_watch_compare);
+            if (!watch)
+                continue;
+
+            enum spooldir_status status = watch->status;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                status = SPOOLDIR_STATUS_FIN;
+            notifier_emit (notifier, status, ev->name);
+            count++;
+        }
+    }
+#elif HAVE_KQUEUE
+    struct kevent events[16];
+    const struct timespec ts = { 0, 0 };
+
+    int nevents = kevent (notifier->fd, NULL, 0, events, 16, &ts);
+    if (nevents < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    /*
+     * Vnode events do not carry the names of the elements which changed,
+     * so all the elements present in the directory are reported.
+     */
+    for (int i = 0; i < nevents; i++) {
+        const struct notify_watch *watch =
+            &notifier->watches[(size_t) (uintptr_t) events[i].udata];
+        struct dirscan scan;
+        const char *name;
+
+        if (dirscan_init (&scan, watch->id, ".") < 0)
+            return -1;
+        while (dirscan_next_file (&scan, &name) > 0) {
+            notifier_emit (notifier, watch->status, name);
+            count++;
+        }
+        dirscan_fini (&scan);
+    }
+#endif
+
+    return count;
+}
+
+
+int
+spooldir_notify (spooldir *spool, spooldircfn callback, void *userdata)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (callback, -1);
+
+    if (!spool->notifier &&
+        !(spool->notifier = spooldir_notifier_new (spool, callback, userdata)))
+        return -1;
+
+    spool->notifier->callback = callback;
+    spool->notifier->userdata = userdata;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = spool->notifier->fd, .events = POLLIN };
+        if (poll (&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        int count = spooldir_notifier_dispatch (spool->notifier);
+        if (count != 0)
+            return count;
+    }
+}
+
+
+/*
+ * Segments start with a magic value, followed by the records, each one
+ * prefixed by its length as a 32-bit little-endian value.
+ */
+static const uint8_t segment_magic[8] = { 'S', 'P', 'O', 'O', 'L', 'S', 'E', 'G' };
+
+enum {
+    SEGMENT_HEADER_SIZE = 4,
+    SEGMENT_BUFSZ = 64 * 1024,
+};
+
+struct _spooldir_segment {
+    spooldir *spool;
+    spooltxn  txn;
+    size_t    count;
+    size_t    used;
+    off_t     flushed;  /* Bytes written to the file. */
+    bool      failed;   /* A write failed part-way. */
+    uint8_t   buffer[SEGMENT_BUFSZ];
+};
+
+
+static int
+write_all (int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[2];
+    assert_ok (iovcnt <= 2);
+    memcpy (v, iov, iovcnt * sizeof (struct iovec));
+
+    for (struct iovec *cur = v; iovcnt > 0;) {
+        ssize_t written = writev (fd, cur, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) written >= cur->iov_len) {
+            written -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (uint8_t*) cur->iov_base + written;
+            cur->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+static int
+segment_flush (spooldir_segment *segment, const void *data, size_t len)
+{
+    struct iovec iov[2] = {
+        { .iov_base = segment->buffer, .iov_len = segment->used },
+        { .iov_base = (void*) data, .iov_len = len },
+    };
+    if (write_all (segment->txn.fd, iov, len ? 2 : 1) < 0) {
+        /* Records written partially cannot be told apart from the rest. */
+        int saved_errno = errno;
+        if (lseek (segment->txn.fd, 0, SEEK_CUR) != segment->flushed)
+            segment->failed = true;
+        errno = saved_errno;
+        return -1;
+    }
+    segment->flushed += (off_t) (segment->used + len);
+    segment->used = 0;
+    return 0;
+}
+
+
+spooldir_segment*
+spooldir_segment_new (spooldir *spool)
+{
+    api_check_return_val (spool, NULL);
+
+    spooldir_segment *segment = malloc (sizeof (spooldir_segment));
+    if (!segment)
+        return NULL;
+
+    if (spooldir_add (spool, &segment->txn) < 0) {
+        int saved_errno = errno;
+        free (segment);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    segment->spool = spool;
+    segment->count = 0;
+    segment->flushed = 0;
+    segment->failed = false;
+    segment->used = sizeof (segment_magic);
+    memcpy (segment->buffer, segment_magic, sizeof (segment_magic));
+    return segment;
+}
+
+
+int
+spooldir_segment_append (spooldir_segment *segment, const void *data, size_t len)
+{
+    api_check_return_val (segment, -1);
+    api_check_return_val (data || !len, -1);
+
+    if (len > UINT32_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (segment->failed) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (segment->used + SEGMENT_HEADER_SIZE > SEGMENT_BUFSZ && segment_flush (segment, NULL, 0) < 0)
+        return -1;
+
+    uint8_t *header = segment->buffer + segment->used;
+    header[0] = len & 0xFF;
+    header[1] = (len >> 8) & 0xFF;
+    header[2] = (len >> 16) & 0xFF;
+    header[3] = (len >> 24) & 0xFF;
+    segment->used += SEGMENT_HEADER_SIZE;
+
+    if (segment->used + len > SEGMENT_BUFSZ) {
+        /* Large records are written along with the buffered data. */
+        if (segment_flush (segment, data, len) < 0) {
+            segment->used -= SEGMENT_HEADER_SIZE;
+            return -1;
+        }
+    } else {
+        memcpy (segment->buffer + segment->used, data, len);
+        segment->used += len;
+    }
+
+    segment->count++;
+    return 0;
+}
+
+
+size_t
+spooldir_segment_count (const spooldir_segment *segment)
+{
+    api_check_return_val (segment, 0);
+    return segment->count;
+}
+
+
+const spoolkey*
+spooldir_segment_key (const spooldir_segment *segment)
+{
+    api_check_return_val (segment, NULL);
+    return segment->txn.key;
+}
+
+
+int
+spooldir_segment_commit (spooldir_segment *segment)
+{
+    api_check_return_val (segment, -1);
+
+    int retval = -1;
+    if (segment->failed)
+        errno = EIO;
+    if (segment->failed || segment_flush (segment, NULL, 0) < 0) {
+        int saved_errno = errno;
+        spooldir_rollback (segment->spool, &segment->txn);
+        errno = saved_errno;
+    } else {
+        retval = spooldir_commit (segment->spool, &segment->txn);
+    }
+
+    int saved_errno = errno;
+    free (segment);
+    errno = saved_errno;
+    return retval;
+}
+
+
+void
+spooldir_segment_rollback (spooldir_segment *segment)
+{
+    api_check_return (segment);
+
+    spooldir_rollback (segment->spool, &segment->txn);
+    free (segment);
+}
+
+
+struct _spooldir_segment_reader {
+    spooldir      *spool;
+    const uint8_t *data;    /* Mapped by the transaction. */
+    size_t         size;
+    size_t         pos;
+    size_t         index;    /* Index of the next record. */
+    size_t         count;
+    size_t         acked;
+    int            ack_fd;
+    uint8_t       *bitmap;
+    char           ack_path[KEY_PATH_BUFSZ + sizeof (".ack")];
+};
+
+
+static inline uint32_t
+segment_record_len (const uint8_t *header)
+{
+    return (uint32_t) header[0] | (uint32_t) header[1] << 8 |
+        (uint32_t) header[2] << 16 | (uint32_t) header[3] << 24;
+}
+
+
+/*
+ * Counts the records in a segment, checking that they are complete.
+ */
+static bool
+segment_count_records (const uint8_t *data, size_t size, size_t *count)
+{
+    if (size < sizeof (segment_magic) || memcmp (data, segment_magic, sizeof (segment_magic)))
+        return false;
+
+    *count = 0;
+    for (size_t pos = sizeof (segment_magic); pos < size; (*count)++) {
+        if (size - pos < SEGMENT_HEADER_SIZE)
+            return false;
+        uint32_t len = segment_record_len (data + pos);
+        pos += SEGMENT_HEADER_SIZE;
+        if (size - pos < len)
+            return false;
+        pos += len;
+    }
+    return true;
+}
+
+
+/*
+ * The bitmap is stored as a hidden file next to the place where the
+ * element will be in the "cur" directory: "<bucket>/.<key>.ack".
+ */
+static void
+segment_ack_path (const spooldir *spool, const char *name, char *buf, size_t bufsz)
+{
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, name, path_buf);
+    const char *slash = strrchr (path, '/');
+    if (slash) {
+        snprintf (buf, bufsz, "%.*s.%s.ack", (int) (slash - path + 1), path, slash + 1);
+    } else {
+        snprintf (buf, bufsz, ".%s.ack", path);
+    }
+}
+
+
+/*
+ * Removes the bitmap of acknowledged records kept for a segment, if any.
+ * Names in "cur" starting with a dot are not scanned, so they would leak.
+ */
+static void
+segment_ack_unlink (const spooldir *spool, const char *name)
+{
+    char ack_path[KEY_PATH_BUFSZ + sizeof (".ack")];
+    segment_ack_path (spool, name, ack_path, sizeof (ack_path));
+    (void) unlinkat (spool->cur_fd, ack_path, 0);
+}
+
+
+spooldir_segment_reader*
+spooldir_segment_reader_open (spooldir *spool, spooltxn *txn)
+{
+    api_check_return_val (spool, NULL);
+    api_check_return_val (txn, NULL);
+    api_check_return_val (txn->status == SPOOLDIR_STATUS_WIP, NULL);
+    api_check_return_val (txn->fd >= 0, NULL);
+
+    spooldir_segment_reader *reader = calloc (1, sizeof (spooldir_segment_reader));
+    if (!reader)
+        return NULL;
+
+    reader->spool = spool;
+    reader->ack_fd = -1;
+    reader->pos = sizeof (segment_magic);
+
+    const void *data;
+    if (spooldir_map (txn, &data, &reader->size) < 0)
+        goto error;
+    reader->data = data;
+    if (!segment_count_records (reader->data, reader->size, &reader->count)) {
+        errno = EBADMSG;
+        goto error;
+    }
+    if (!(reader->bitmap = calloc (1, reader->count / 8 + 1)))
+        goto error;
+
+    segment_ack_path (spool, txn->key->bytes, reader->ack_path, sizeof (reader->ack_path));
+    reader->ack_fd = openat (spool->cur_fd, reader->ack_path,
+                             O_RDWR | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS);
+    if (reader->ack_fd >= 0) {
+        /* Picked again: continue after the acknowledged records. */
+        ssize_t count = pread (reader->ack_fd, reader->bitmap, reader->count / 8 + 1, 0);
+        for (ssize_t i = 0; i < count; i++)
+            reader->acked += (size_t) __builtin_popcount (reader->bitmap[i]);
+    } else if (errno != ENOENT) {
+        goto error;
+    }
+    return reader;
+
+error:
+    {
+        int saved_errno = errno;
+        if (reader->ack_fd >= 0)
+            close (reader->ack_fd);
+        free (reader->bitmap);
+        free (reader);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+
+int
+spooldir_segment_next (spooldir_segment_reader *reader, const void **data, size_t *len)
+{
+    api_check_return_val (reader, -1);
+    api_check_return_val (data, -1);
+    api_check_return_val (len, -1);
+
+    while (reader->pos < reader->size) {
+        uint32_t record_len = segment_record_len (reader->data + reader->pos);
+        const size_t index = reader->index++;
+        reader->pos += SEGMENT_HEADER_SIZE + record_len;
+
+        if (!(reader->bitmap[index / 8] & (1u << (index % 8)))) {
+            *data = reader->data + reader->pos - record_len;
+            *len = record_len;
+            return 0;
+        }
+    }
+
+    errno = 0;
+    return EOF;
+}
+
+
+int
+spooldir_segment_ack (spooldir_segment_reader *reader)
+{
+    api_check_return_val (reader, -1);
+    api_check_return_val (reader->index > 0, -1);
+
+    const size_t index = reader->index - 1;
+    uint8_t *byte = &reader->bitmap[index / 8];
+    if (*byte & (1u << (index % 8)))
+        return 0;
+
+    if (reader->ack_fd < 0) {
+        reader->ack_fd = openat (reader->spool->cur_fd, reader->ack_path,
+                                 O_CREAT | O_RDWR | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS, 0666);
+        if (reader->ack_fd < 0)
+            return -1;
+    }
+
+    *byte |= 1u << (index % 8);
+    if (pwrite (reader->ack_fd, byte, 1, (off_t) (index / 8)) != 1) {
+        *byte &= ~(1u << (index % 8));
+        return -1;
+    }
+    reader->acked++;
+    return 0;
+}
+
+
+void
+spooldir_segment_reader_close (spooldir_segment_reader *reader)
+{
+    api_check_return (reader);
+
+    if (reader->ack_fd >= 0) {
+        close (reader->ack_fd);
+        if (reader->acked == reader->count)
+            unlinkat (reader->spool->cur_fd, reader->ack_path, 0);
+    }
+    free (reader->bitmap);
+    free (reader);
+}
+
+
+int
+spooldir_delete (spooldir *spool, const spoolkey *key)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (key, -1);
+
+    /* Elements in "wip" are being handled, and cannot be deleted. */
+    static const enum spooldir_status statuses[] = {
+        SPOOLDIR_STATUS_CUR,
+        SPOOLDIR_STATUS_NEW,
+    };
+
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, key->bytes, path_buf);
+    for (unsigned i = 0; i < sizeof (statuses) / sizeof (statuses[0]); i++) {
+        if (unlinkat (status_to_fd (spool, statuses[i]), path, 0) == 0) {
+            spool_moved (spool, statuses[i], SPOOLDIR_STATUS_FIN, path);
+            segment_ack_unlink (spool, key->bytes);
+            return 0;
+        }
+        if (errno != ENOENT)
+            return -1;
+    }
+    return -1;
+}
+
+
+int
+spooldir_set_archive (spooldir *spool, int fd)
+{
+    api_check_return_val (spool, -1);
+    spool->archive_fd = fd;
+    return 0;
+}
+
+
+/*
+ * Purged elements may be archived first to a tarball, as one ustar member
+ * each, named after the key. Archives are only appended to: the end marker
+ * is never written, which tar(1) tolerates.
+ */
+enum {
+    TAR_BLOCK_SIZE = 512,
+    PURGE_BATCH = 32,
+};
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+_Static_assert (sizeof (struct tar_header) == TAR_BLOCK_SIZE,
+                "struct tar_header must fill one block");
+
+
+/*
+ * Appends an element to the archive. On failure the archive is truncated
+ * back, so that a member written partially does not hide the ones after.
+ */
+static int
+archive_element (int archive_fd, int subdir_fd, const char *path)
+{
+    int fd = openat (subdir_fd, path, O_RDONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS);
+    if (fd < 0)
+        return -1;
+
+    struct stat sb, archive_sb;
+    if (fstat (fd, &sb) < 0 || fstat (archive_fd, &archive_sb) < 0)
+        goto error;
+
+    const char *name = strrchr (path, '/');
+    name = name ? name + 1 : path;
+
+    struct tar_header header;
+    memset (&header, 0, sizeof (header));
+    snprintf (header.name, sizeof (header.name), "%s", name);
+    snprintf (header.mode, sizeof (header.mode), "%07o", (unsigned) (sb.st_mode & 0777));
+    snprintf (header.uid, sizeof (header.uid), "%07o", 0u);
+    snprintf (header.gid, sizeof (header.gid), "%07o", 0u);
+    snprintf (header.size, sizeof (header.size), "%011llo", (unsigned long long) sb.st_size);
+    snprintf (header.mtime, sizeof (header.mtime), "%011llo", (unsigned long long) sb.st_mtime);
+    header.typeflag = '0';
+    memcpy (header.magic, "ustar", 6);
+    memcpy (header.version, "00", 2);
+
+    /* The checksum is computed with its own field filled with spaces. */
+    memset (header.chksum, ' ', sizeof (header.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof (header); i++)
+        sum += ((const uint8_t*) &header)[i];
+    snprintf (header.chksum, sizeof (header.chksum), "%06o", sum);
+
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof (header) };
+    if (write_all (archive_fd, &iov, 1) < 0)
+        goto truncate;
+
+    off_t left = sb.st_size;
+#if HAVE_COPY_FILE_RANGE
+    while (left > 0) {
+        ssize_t count = copy_file_range (fd, NULL, archive_fd, NULL,
+                                         (left < COPY_CHUNK_SIZE) ? (size_t) left : COPY_CHUNK_SIZE, 0);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                errno != EOPNOTSUPP && errno != EBADF)
+                goto truncate;
+            break;
+        }
+        left -= count;
+    }
+#endif
+    if (left > 0 && copy_fd_buffered (fd, archive_fd) < 0)
+        goto truncate;
+
+    /*
+     * Everything read has been written, so the offset of the element is the
+     * amount copied; a different size than in the header breaks the archive.
+     */
+    if (lseek (fd, 0, SEEK_CUR) != sb.st_size) {
+        errno = EIO;
+        goto truncate;
+    }
+
+    static const uint8_t padding[TAR_BLOCK_SIZE];
+    iov.iov_base = (void*) padding;
+    iov.iov_len = (TAR_BLOCK_SIZE - (size_t) (sb.st_size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    if (iov.iov_len && write_all (archive_fd, &iov, 1) < 0)
+        goto truncate;
+    close (fd);
+    return 0;
+
+truncate:
+    {
+        int saved_errno = errno;
+        if (ftruncate (archive_fd, archive_sb.st_size) == 0)
+            (void) lseek (archive_fd, archive_sb.st_size, SEEK_SET);
+        errno = saved_errno;
+    }
+error:
+    {
+        int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+
+struct purge_batch {
+    unsigned n;
+    char     paths[PURGE_BATCH][KEY_PATH_BUFSZ];
+};
+
+
+/*
+ * Archives and removes the elements of a batch, returning how many.
+ */
+static ssize_t
+purge_batch_run (spooldir *spool, enum spooldir_status status, struct purge_batch *batch)
+{
+    const int subdir_fd = status_to_fd (spool, status);
+    ssize_t count = 0;
+    int saved_errno = 0;
+
+    /* Elements which cannot be archived are kept. */
+    unsigned n = 0;
+    for (unsigned i = 0; i < batch->n; i++) {
+        if (spool->archive_fd >= 0 && archive_element (spool->archive_fd, subdir_fd, batch->paths[i]) < 0) {
+            if (errno == ENOENT)
+                continue;
+            saved_errno = errno;
+            break;
+        }
+        if (n != i)
+            memcpy (batch->paths[n], batch->paths[i], KEY_PATH_BUFSZ);
+        n++;
+    }
+
+    int32_t results[PURGE_BATCH];
+    for (unsigned i = 0; i < n; i++)
+        results[i] = -ECANCELED;
+
+#if HAVE_IO_URING
+    if (use_uring (spool, false)) {
+        struct uring *r = spool->uring;
+        pthread_mutex_lock (&r->lock);
+        for (unsigned i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = uring_sqe (r, IORING_OP_UNLINKAT, subdir_fd, i);
+            sqe->addr = (uintptr_t) batch->paths[i];
+        }
+        if (uring_submit_and_wait (r, results, n, n) < 0) {
+            for (unsigned i = 0; i < n; i++)
+                results[i] = -ECANCELED;
+        }
+        pthread_mutex_unlock (&r->lock);
+    }
+#endif
+
+    for (unsigned i = 0; i < n; i++) {
+        int retval = results[i];
+        if (retval == -ECANCELED)
+            retval = unlinkat (subdir_fd, batch->paths[i], 0) < 0 ? -errno : 0;
+        if (retval == 0) {
+            const char *name = strrchr (batch->paths[i], '/');
+            segment_ack_unlink (spool, name ? name + 1 : batch->paths[i]);
+            spool_moved (spool, status, SPOOLDIR_STATUS_FIN, batch->paths[i]);
+            count++;
+        } else if (retval != -ENOENT && !saved_errno) {
+            saved_errno = -retval;
+        }
+    }
+    batch->n = 0;
+
+    if (saved_errno) {
+        errno = saved_errno;
+        return -1;
+    }
+    return count;
+}
+
+
+static inline ssize_t
+purge_batch_add (spooldir *spool, enum spooldir_status status, struct purge_batch *batch,
+                 const char *path)
+{
+    strcpy (batch->paths[batch->n++], path);
+    return (batch->n == PURGE_BATCH) ? purge_batch_run (spool, status, batch) : 0;
+}
+
+
+struct purge_candidate {
+    struct timespec mtime;
+    char           *path;
+};
+
+
+static int
+purge_candidate_compare (const void *a, const void *b)
+{
+    const struct purge_candidate *ca = a, *cb = b;
+    if (ca->mtime.tv_sec != cb->mtime.tv_sec)
+        return (ca->mtime.tv_sec < cb->mtime.tv_sec) ? -1 : 1;
+    if (ca->mtime.tv_nsec != cb->mtime.tv_nsec)
+        return (ca->mtime.tv_nsec < cb->mtime.tv_nsec) ? -1 : 1;
+    return strcmp (ca->path, cb->path);
+}
+
+
+ssize_t
+spooldir_purge (spooldir *spool, enum spooldir_status status, unsigned max_age, size_t max_count)
+{
+    api_check_return_val (spool, -1);
+
+    if (status != SPOOLDIR_STATUS_CUR && status != SPOOLDIR_STATUS_NEW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct dirscan *scan = malloc (sizeof (struct dirscan));
+    struct purge_batch *batch = malloc (sizeof (struct purge_batch));
+    if (!scan || !batch) {
+        free (scan);
+        free (batch);
+        return -1;
+    }
+    batch->n = 0;
+
+    /* Elements young enough are candidates to be kept, if they are limited. */
+    const bool limited = (max_count != SIZE_MAX) && max_count > 0;
+    struct purge_candidate *kept = NULL;
+    size_t n_kept = 0, kept_capacity = 0;
+
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    const time_t cutoff = now.tv_sec - (time_t) max_age;
+
+    const int subdir_fd = status_to_fd (spool, status);
+    const unsigned nbuckets = spool_nbuckets (spool);
+    ssize_t count = 0;
+    for (unsigned bucket = 0; bucket < nbuckets && count >= 0; bucket++) {
+        char name[BUCKET_NAME_BUFSZ];
+        bucket_name (spool, bucket, name);
+        if (dirscan_init (scan, subdir_fd, name) < 0) {
+            count = -1;
+            break;
+        }
+
+        const char *entry;
+        int retval;
+        while (count >= 0 && (retval = dirscan_next_file (scan, &entry)) > 0) {
+            char path[KEY_PATH_BUFSZ];
+            if (!bucket_entry_path (spool, name, entry, path))
+                continue;
+
+            struct stat sb;
+            if ((max_age || limited) && fstatat (scan->fd, entry, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+
+            ssize_t purged = 0;
+            if (max_count == 0 || (max_age && sb.st_mtime < cutoff)) {
+                purged = purge_batch_add (spool, status, batch, path);
+            } else if (limited) {
+                if (n_kept == kept_capacity) {
+                    size_t capacity = kept_capacity ? kept_capacity * 2 : 1024;
+                    struct purge_candidate *k = realloc (kept, capacity * sizeof (struct purge_candidate));
+                    if (!k) {
+                        count = -1;
+                        break;
+                    }
+                    kept = k;
+                    kept_capacity = capacity;
+                }
+                if (!(kept[n_kept].path = strdup (path))) {
+                    count = -1;
+                    break;
+                }
+                kept[n_kept++].mtime = sb.st_mtim;
+            }
+            if (purged < 0)
+                count = -1;
+            else
+                count += purged;
+        }
+        if (retval < 0)
+            count = -1;
+
+        int saved_errno = errno;
+        dirscan_fini (scan);
+        errno = saved_errno;
+    }
+
+    /* Of the remaining elements only the newest "max_count" are kept. */
+    if (count >= 0 && n_kept > max_count) {
+        qsort (kept, n_kept, sizeof (struct purge_candidate), purge_candidate_compare);
+        for (size_t i = 0; i < n_kept - max_count && count >= 0; i++) {
+            ssize_t purged = purge_batch_add (spool, status, batch, kept[i].path);
+            count = (purged < 0) ? -1 : count + purged;
+        }
+    }
+    if (count >= 0 && batch->n) {
+        ssize_t purged = purge_batch_run (spool, status, batch);
+        count = (purged < 0) ? -1 : count + purged;
+    }
+
+    int saved_errno = errno;
+    for (size_t i = 0; i < n_kept; i++)
+        free (kept[i].path);
+    free (kept);
+    free (scan);
+    free (batch);
+    errno = saved_errno;
+    return count;
+}
+
+
+/*
+ * Worker pools have a single thread scanning the "new" directory, which
+ * feeds the names of candidate elements to the workers through a bounded
+ * multi-producer, multi-consumer queue (Dmitry Vyukov's design). Each
+ * slot has a sequence number indicating whether it is ready to be written
+ * or read in the current lap, so the queue itself needs no locks; the
+ * semaphores are only used to sleep when it is empty or full.
+ */
+enum {
+    WORK_RING_SIZE = 1024,  /* Must be a power of two. */
+    WORK_POLL_MSEC = 1000,  /* Rescan interval when notifications fail. */
+};
+
+struct work_slot {
+    atomic_size_t seq;
+    char          path[KEY_PATH_BUFSZ];
+};
+
+struct work_ring {
+    _Alignas (64) atomic_size_t head;
+    _Alignas (64) atomic_size_t tail;
+    struct work_slot slots[WORK_RING_SIZE];
+};
+
+
+static void
+work_ring_init (struct work_ring *ring)
+{
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+    for (size_t i = 0; i < WORK_RING_SIZE; i++)
+        atomic_init (&ring->slots[i].seq, i);
+}
+
+
+static bool
+work_ring_push (struct work_ring *ring, const char *path)
+{
+    size_t pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    for (;;) {
+        struct work_slot *slot = &ring->slots[pos & (WORK_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit (&ring->tail, &pos, pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed)) {
+                memcpy (slot->path, path, strlen (path) + 1);
+                atomic_store_explicit (&slot->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  /* Full. */
+        } else {
+            pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+
+static bool
+work_ring_pop (struct work_ring *ring, char path[KEY_PATH_BUFSZ])
+{
+    size_t pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    for (;;) {
+        struct work_slot *slot = &ring->slots[pos & (WORK_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit (&ring->head, &pos, pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed)) {
+                memcpy (path, slot->path, strlen (slot->path) + 1);
+                atomic_store_explicit (&slot->seq, pos + WORK_RING_SIZE, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  /* Empty. */
+        } else {
+            pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+
+struct _spooldir_worker_pool {
+    spooldir          *spool;
+    spooldir_worker_fn handler;
+    void              *userdata;
+    spooldir_cursor   *cursor;
+    spooldir_notifier *notifier;
+    int                wake_fds[2];  /* Pipe used to stop the scanner. */
+    atomic_bool        stop;
+    sem_t              items;        /* Names ready in the queue. */
+    sem_t              slots;        /* Free slots in the queue. */
+    sem_t              drained;      /* Posted when "in_flight" drops to zero. */
+    atomic_size_t      in_flight;    /* Names queued or being claimed. */
+    struct work_ring   ring;
+    pthread_t          scanner;
+    unsigned           n_workers;
+    pthread_t          workers[];
+};
+
+
+static void
+worker_pool_notify_cb (spooldir *spool, enum spooldir_status status, spooltxn *txn,
+                       void *userdata)
+{
+}
+
+
+/*
+ * Blocks until new elements may have been added, or the pool is stopped.
+ */
+static void
+worker_pool_wait_events (spooldir_worker_pool *pool)
+{
+    struct pollfd pfd[2] = {
+        { .fd = pool->wake_fds[0], .events = POLLIN },
+        { .fd = pool->notifier ? spooldir_notifier_fd (pool->notifier) : -1, .events = POLLIN },
+    };
+    if (poll (pfd, 2, pool->notifier ? -1 : WORK_POLL_MSEC) > 0 && pool->notifier)
+        spooldir_notifier_dispatch (pool->notifier);
+}
+
+
+static void*
+worker_pool_scan (void *data)
+{
+    spooldir_worker_pool *pool = data;
+    unsigned queued = 0;  /* During the current pass. */
+
+    while (!atomic_load (&pool->stop)) {
+        const char *name;
+        switch (cursor_next_name (pool->cursor, &name)) {
+            case CURSOR_NAME: {
+                char path[KEY_PATH_BUFSZ];
+                const char *p = key_path (pool->spool, name, path);
+                while (sem_wait (&pool->slots) < 0 && errno == EINTR)
+                    ;
+                if (atomic_load (&pool->stop))
+                    break;
+                atomic_fetch_add (&pool->in_flight, 1);
+                while (!work_ring_push (&pool->ring, p))
+                    sched_yield ();
+                sem_post (&pool->items);
+                queued++;
+                break;
+            }
+
+            case CURSOR_BUCKET_END:
+                break;
+
+            case CURSOR_IDLE:
+                /*
+                 * Wait for the workers to claim everything before scanning
+                 * again, otherwise the names still queued would be found
+                 * again. Sleep until notified if nothing was found.
+                 */
+                while (atomic_load (&pool->in_flight) > 0 && !atomic_load (&pool->stop))
+                    while (sem_wait (&pool->drained) < 0 && errno == EINTR)
+                        ;
+                if (queued == 0)
+                    worker_pool_wait_events (pool);
+                queued = 0;
+                break;
+
+            case CURSOR_ERROR:
+                worker_pool_wait_events (pool);
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+static void*
+worker_pool_work (void *data)
+{
+    spooldir_worker_pool *pool = data;
+    spooldir *spool = pool->spool;
+
+    for (;;) {
+        while (sem_wait (&pool->items) < 0 && errno == EINTR)
+            ;
+        if (atomic_load (&pool->stop))
+            break;
+
+        char path[KEY_PATH_BUFSZ];
+        while (!work_ring_pop (&pool->ring, path))
+            sched_yield ();
+        sem_post (&pool->slots);
+
+        int fd = move_and_open (spool, spool->new_fd, spool->wip_fd, path);
+        if (fd >= 0) {
+            const char *name = strrchr (path, '/');
+            name = name ? name + 1 : path;
+            spooltxn txn;
+            txn_claimed (spool, &txn, fd, name);
+            (*pool->handler) (spool, &txn, pool->userdata);
+
+            /* Handlers may take the key without finishing the transaction. */
+            if (txn.status == SPOOLDIR_STATUS_WIP) {
+                if (!txn.key)
+                    txn.key = txn_key_from_name (&txn, name);
+                if (txn.key) {
+                    spooldir_rollback (spool, &txn);
+                } else {
+                    if (txn.fd >= 0)
+                        close (txn.fd);
+                    if (rename_noreplace (spool, spool->wip_fd, path, spool->new_fd, path) == 0)
+                        spool_moved (spool, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_NEW, path);
+                }
+            }
+        }
+
+        if (atomic_fetch_sub (&pool->in_flight, 1) == 1)
+            sem_post (&pool->drained);
+    }
+    return NULL;
+}
+
+
+static void
+worker_pool_stop (spooldir_worker_pool *pool, unsigned n_workers, bool scanner)
+{
+    atomic_store (&pool->stop, true);
+
+    /* Wake up all the threads, wherever they are blocked. */
+    if (write (pool->wake_fds[1], "", 1) < 0) { /* Cannot fail, ignore. */ }
+    sem_post (&pool->slots);
+    sem_post (&pool->drained);
+    for (unsigned i = 0; i < n_workers; i++)
+        sem_post (&pool->items);
+
+    if (scanner)
+        pthread_join (pool->scanner, NULL);
+    for (unsigned i = 0; i < n_workers; i++)
+        pthread_join (pool->workers[i], NULL);
+}
+
+
+static void
+worker_pool_free (spooldir_worker_pool *pool)
+{
+    if (pool->notifier)
+        spooldir_notifier_free (pool->notifier);
+    if (pool->cursor)
+        spooldir_cursor_close (pool->cursor);
+    if (pool->wake_fds[0] >= 0) {
+        close (pool->wake_fds[0]);
+        close (pool->wake_fds[1]);
+    }
+    sem_destroy (&pool->items);
+    sem_destroy (&pool->slots);
+    sem_destroy (&pool->drained);
+    free (pool);
+}
+
+
+spooldir_worker_pool*
+spooldir_worker_pool_new (spooldir *spool, unsigned n_workers,
+                          spooldir_worker_fn handler, void *userdata)
+{
+    api_check_return_val (spool, NULL);
+    api_check_return_val (n_workers > 0, NULL);
+    api_check_return_val (handler, NULL);
+
+    spooldir_worker_pool *pool =
+        calloc (1, sizeof (spooldir_worker_pool) + n_workers * sizeof (pthread_t));
+    if (!pool)
+        return NULL;
+
+    pool->spool = spool;
+    pool->handler = handler;
+    pool->userdata = userdata;
+    pool->wake_fds[0] = pool->wake_fds[1] = -1;
+    atomic_init (&pool->stop, false);
+    atomic_init (&pool->in_flight, 0);
+    work_ring_init (&pool->ring);
+    sem_init (&pool->items, 0, 0);
+    sem_init (&pool->slots, 0, WORK_RING_SIZE);
+    sem_init (&pool->drained, 0, 0);
+
+    /* Without notifications, the directory is scanned periodically. */
+    pool->notifier = spooldir_notifier_new (spool, worker_pool_notify_cb, NULL);
+
+    if (pipe (pool->wake_fds) < 0 || !(pool->cursor = spooldir_cursor_open (spool)))
+        goto error;
+
+    int err;
+    for (pool->n_workers = 0; pool->n_workers < n_workers; pool->n_workers++) {
+        if ((err = pthread_create (&pool->workers[pool->n_workers], NULL,
+                                   worker_pool_work, pool)) != 0) {
+            worker_pool_stop (pool, pool->n_workers, false);
+            errno = err;
+            goto error;
+        }
+    }
+    if ((err = pthread_create (&pool->scanner, NULL, worker_pool_scan, pool)) != 0) {
+        worker_pool_stop (pool, pool->n_workers, false);
+        errno = err;
+        goto error;
+    }
+    return pool;
+
+error:
+    {
+        int saved_errno = errno;
+        worker_pool_free (pool);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+
+void
+spooldir_worker_pool_free (spooldir_worker_pool *pool)
+{
+    api_check_return (pool);
+
+    worker_pool_stop (pool, pool->n_workers, true);
+    worker_pool_free (pool);
+}
+
+
+/*
+ * Asynchronous requests are queued for a pool of threads which run the
+ * synchronous functions. Completed requests are collected in a list, and
+ * an eventfd (or a pipe) becomes readable when it stops being empty.
+ */
+enum {
+    ASYNC_MAX_REQUESTS = 1024,
+};
+
+enum async_op {
+    ASYNC_ADD,
+    ASYNC_COMMIT,
+    ASYNC_ROLLBACK,
+    ASYNC_PICK,
+};
+
+struct async_request {
+    enum async_op         op;
+    spooltxn             *txn;
+    spooldir_async_fn     callback;
+    void                 *userdata;
+    int                   result;
+    int                   error;
+    struct async_request *next;
+};
+
+struct async_queue {
+    struct async_request  *head;
+    struct async_request **tail;
+};
+
+struct _spooldir_async {
+    spooldir            *spool;
+    pthread_mutex_t      lock;
+    pthread_cond_t       cond;
+    bool                 stop;
+    struct async_queue   pending;
+    struct async_queue   completed;
+    struct async_request *free_list;
+    struct async_request *requests;
+    size_t               in_flight;  /* Submitted, not yet dispatched. */
+    int                  event_fds[2];
+    unsigned             n_threads;
+    pthread_t            threads[];
+};
+
+
+static inline void
+async_queue_init (struct async_queue *queue)
+{
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+
+static inline void
+async_queue_push (struct async_queue *queue, struct async_request *req)
+{
+    req->next = NULL;
+    *queue->tail = req;
+    queue->tail = &req->next;
+}
+
+
+static inline struct async_request*
+async_queue_pop (struct async_queue *queue)
+{
+    struct async_request *req = queue->head;
+    if (req && !(queue->head = req->next))
+        queue->tail = &queue->head;
+    return req;
+}
+
+
+static void
+async_signal (spooldir_async *async)
+{
+#if HAVE_EVENTFD
+    const uint64_t value = 1;
+    if (write (async->event_fds[1], &value, sizeof (value)) < 0) { /* Cannot fail, ignore. */ }
+#else
+    if (write (async->event_fds[1], "", 1) < 0) { /* Full pipes are readable too. */ }
+#endif
+}
+
+
+static void
+async_drain (spooldir_async *async)
+{
+    uint64_t buffer[16];
+    while (read (async->event_fds[0], buffer, sizeof (buffer)) > 0)
+        if (HAVE_EVENTFD)
+            break;
+}
+
+
+static void*
+async_work (void *data)
+{
+    spooldir_async *async = data;
+
+    pthread_mutex_lock (&async->lock);
+    for (;;) {
+        struct async_request *req;
+        while (!(req = async_queue_pop (&async->pending)) && !async->stop)
+            pthread_cond_wait (&async->cond, &async->lock);
+        if (!req)
+            break;
+        pthread_mutex_unlock (&async->lock);
+
+        errno = 0;
+        switch (req->op) {
+            case ASYNC_ADD:
+                req->result = spooldir_add (async->spool, req->txn);
+                break;
+            case ASYNC_COMMIT:
+                req->result = spooldir_commit (async->spool, req->txn);
+                break;
+            case ASYNC_ROLLBACK:
+                req->result = spooldir_rollback (async->spool, req->txn);
+                break;
+            case ASYNC_PICK:
+                req->result = spooldir_pick (async->spool, req->txn);
+                break;
+        }
+        req->error = errno;
+
+        pthread_mutex_lock (&async->lock);
+        const bool was_empty = !async->completed.head;
+        async_queue_push (&async->completed, req);
+        if (was_empty)
+            async_signal (async);
+    }
+    pthread_mutex_unlock (&async->lock);
+    return NULL;
+}
+
+
+static int
+async_submit (spooldir_async *async, enum async_op op, spooltxn *txn,
+              spooldir_async_fn callback, void *userdata)
+{
+    pthread_mutex_lock (&async->lock);
+    struct async_request *req = async->free_list;
+    if (!req) {
+        pthread_mutex_unlock (&async->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    async->free_list = req->next;
+    async->in_flight++;
+
+    req->op = op;
+    req->txn = txn;
+    req->callback = callback;
+    req->userdata = userdata;
+    async_queue_push (&async->pending, req);
+    pthread_cond_signal (&async->cond);
+    pthread_mutex_unlock (&async->lock);
+    return 0;
+}
+
+
+int
+spooldir_async_add (spooldir_async *async, spooltxn *txn,
+                    spooldir_async_fn callback, void *userdata)
+{
+    api_check_return_val (async, -1);
+    api_check_return_val (txn, -1);
+    return async_submit (async, ASYNC_ADD, txn, callback, userdata);
+}
+
+
+int
+spooldir_async_commit (spooldir_async *async, spooltxn *txn,
+                       spooldir_async_fn callback, void *userdata)
+{
+    api_check_return_val (async, -1);
+    api_check_return_val (txn, -1);
+    return async_submit (async, ASYNC_COMMIT, txn, callback, userdata);
+}
+
+
+int
+spooldir_async_rollback (spooldir_async *async, spooltxn *txn,
+                         spooldir_async_fn callback, void *userdata)
+{
+    api_check_return_val (async, -1);
+    api_check_return_val (txn, -1);
+    return async_submit (async, ASYNC_ROLLBACK, txn, callback, userdata);
+}
+
+
+int
+spooldir_async_pick (spooldir_async *async, spooltxn *txn,
+                     spooldir_async_fn callback, void *userdata)
+{
+    api_check_return_val (async, -1);
+    api_check_return_val (txn, -1);
+    return async_submit (async, ASYNC_PICK, txn, callback, userdata);
+}
+
+
+int
+spooldir_async_fd (const spooldir_async *async)
+{
+    api_check_return_val (async, -1);
+    return async->event_fds[0];
+}
+
+
+int
+spooldir_async_dispatch (spooldir_async *async)
+{
+    api_check_return_val (async, -1);
+
+    /* Drain first: completions arriving later signal again. */
+    async_drain (async);
+
+    pthread_mutex_lock (&async->lock);
+    struct async_request *list = async->completed.head;
+    async_queue_init (&async->completed);
+    pthread_mutex_unlock (&async->lock);
+
+    int count = 0;
+    while (list) {
+        struct async_request *req = list;
+        list = req->next;
+
+        if (req->callback) {
+            errno = req->error;
+            (*req->callback) (async->spool, req->txn, req->result, req->userdata);
+        }
+        count++;
+
+        /* Callbacks may submit more requests, do not hold the lock. */
+        pthread_mutex_lock (&async->lock);
+        req->next = async->free_list;
+        async->free_list = req;
+        async->in_flight--;
+        pthread_mutex_unlock (&async->lock);
+    }
+    return count;
+}
+
+
+static void
+async_stop (spooldir_async *async, unsigned n_threads)
+{
+    pthread_mutex_lock (&async->lock);
+    async->stop = true;
+    pthread_cond_broadcast (&async->cond);
+    pthread_mutex_unlock (&async->lock);
+
+    for (unsigned i = 0; i < n_threads; i++)
+        pthread_join (async->threads[i], NULL);
+}
+
+
+static void
+async_free (spooldir_async *async)
+{
+    if (async->event_fds[0] >= 0)
+        close (async->event_fds[0]);
+    if (async->event_fds[1] >= 0 && async->event_fds[1] != async->event_fds[0])
+        close (async->event_fds[1]);
+    pthread_mutex_destroy (&async->lock);
+    pthread_cond_destroy (&async->cond);
+    free (async->requests);
+    free (async);
+}
+
+
+spooldir_async*
+spooldir_async_new (spooldir *spool, unsigned n_threads)
+{
+    api_check_return_val (spool, NULL);
+    api_check_return_val (n_threads > 0, NULL);
+
+    spooldir_async *async = calloc (1, sizeof (spooldir_async) + n_threads * sizeof (pthread_t));
+    if (!async)
+        return NULL;
+
+    async->spool = spool;
+    async->event_fds[0] = async->event_fds[1] = -1;
+    pthread_mutex_init (&async->lock, NULL);
+    pthread_cond_init (&async->cond, NULL);
+    async_queue_init (&async->pending);
+    async_queue_init (&async->completed);
+
+    if (!(async->requests = calloc (ASYNC_MAX_REQUESTS, sizeof (struct async_request))))
+        goto error;
+    for (size_t i = 0; i < ASYNC_MAX_REQUESTS; i++) {
+        async->requests[i].next = async->free_list;
+        async->free_list = &async->requests[i];
+    }
+
+#if HAVE_EVENTFD
+    if ((async->event_fds[0] = async->event_fds[1] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+        goto error;
+#else
+    if (pipe (async->event_fds) < 0 ||
+        fcntl (async->event_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl (async->event_fds[1], F_SETFL, O_NONBLOCK) < 0)
+        goto error;
+#endif
+
+    int err;
+    for (async->n_threads = 0; async->n_threads < n_threads; async->n_threads++) {
+        if ((err = pthread_create (&async->threads[async->n_threads], NULL,
+                                   async_work, async)) != 0) {
+            async_stop (async, async->n_threads);
+            errno = err;
+            goto error;
+        }
+    }
+    return async;
+
+error:
+    {
+        int saved_errno = errno;
+        async_free (async);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+
+void
+spooldir_async_free (spooldir_async *async)
+{
+    api_check_return (async);
+
+    /* Callbacks may submit more requests, keep going until none are left. */
+    for (;;) {
+        pthread_mutex_lock (&async->lock);
+        const size_t in_flight = async->in_flight;
+        pthread_mutex_unlock (&async->lock);
+        if (!in_flight)
+            break;
+
+        struct pollfd pfd = { .fd = async->event_fds[0], .events = POLLIN };
+        if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        spooldir_async_dispatch (async);
+    }
+
+    async_stop (async, async->n_threads);
+    async_free (async);
+}
+
+
+/*
+ * Replication streams start with a header, followed by records made of a
+ * fixed part, the key, and the payload (only for added elements):
+ *
+ *   "SPOOLREP" LE32 version
+ *   u8 op, u8 status, LE16 key length, LE64 payload length, key, payload
+ *
+ * Receivers acknowledge by sending back the number of records applied so
+ * far as LE64 values, without the sender waiting for each of them.
+ */
+static const char rep_magic[8] = "SPOOLREP";
+
+enum {
+    REP_VERSION = 1,
+    REP_HEADER_SIZE = 12,
+    REP_RECORD_SIZE = 12,
+    REP_OP_ADD = 1,
+    REP_OP_STATUS = 2,
+    REP_BUFSZ = 64 * 1024,
+    REP_INLINE_MAX = 16 * 1024,  /* Larger payloads are sent with sendfile(). */
+    REP_ACK_EVERY = 64,
+};
+
+struct rep_sender {
+    spooldir *spool;
+    int       out_fd;
+    int       ack_fd;
+    int       error;   /* First error found while sending, or zero. */
+    uint64_t  sent;
+    uint64_t  acked;
+    size_t    len;
+    uint8_t   buffer[REP_BUFSZ];
+};
+
+
+static inline void
+store_le16 (uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+
+static inline uint16_t
+load_le16 (const uint8_t *p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+
+static inline void
+store_le32 (uint8_t *p, uint32_t v)
+{
+    for (unsigned i = 0; i < 4; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+
+static inline uint32_t
+load_le32 (const uint8_t *p)
+{
+    uint32_t v = 0;
+    for (unsigned i = 0; i < 4; i++)
+        v |= ((uint32_t) p[i]) << (8 * i);
+    return v;
+}
+
+
+/*
+ * Reads exactly "len" bytes. Returns "1" on success, "0" at end of file
+ * before reading anything, and "-1" on failure.
+ */
+static int
+read_full (int fd, void *data, size_t len)
+{
+    for (size_t done = 0; done < len;) {
+        ssize_t count = read (fd, (uint8_t*) data + done, len - done);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (count == 0) {
+            if (!done)
+                return 0;
+            errno = EBADMSG;  /* Truncated stream. */
+            return -1;
+        }
+        done += (size_t) count;
+    }
+    return 1;
+}
+
+
+static int
+rep_flush (struct rep_sender *sender)
+{
+    size_t len = sender->len;
+    sender->len = 0;
+    return len ? write_full (sender->out_fd, sender->buffer, len) : 0;
+}
+
+
+static int
+rep_put (struct rep_sender *sender, const void *data, size_t len)
+{
+    if (sender->len + len > REP_BUFSZ && rep_flush (sender) < 0)
+        return -1;
+    if (len > REP_BUFSZ)
+        return write_full (sender->out_fd, data, len);
+    memcpy (sender->buffer + sender->len, data, len);
+    sender->len += len;
+    return 0;
+}
+
+
+static int
+rep_put_record (struct rep_sender *sender, uint8_t op, enum spooldir_status status,
+                const char *name, uint64_t payload_len)
+{
+    size_t name_len = strlen (name);
+    uint8_t record[REP_RECORD_SIZE];
+    record[0] = op;
+    record[1] = (uint8_t) status;
+    store_le16 (record + 2, (uint16_t) name_len);
+    store_le64 (record + 4, payload_len);
+    if (rep_put (sender, record, sizeof (record)) < 0 || rep_put (sender, name, name_len) < 0)
+        return -1;
+    sender->sent++;
+    return 0;
+}
+
+
+static int
+rep_send_payload (struct rep_sender *sender, int fd, uint64_t len)
+{
+    if (len <= REP_INLINE_MAX) {
+        if (sender->len + len > REP_BUFSZ && rep_flush (sender) < 0)
+            return -1;
+        for (uint64_t done = 0; done < len;) {
+            ssize_t count = pread (fd, sender->buffer + sender->len, len - done, (off_t) done);
+            if (count <= 0) {
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count == 0)
+                    errno = EIO;  /* Elements are not modified once committed. */
+                return -1;
+            }
+            sender->len += (size_t) count;
+            done += (uint64_t) count;
+        }
+        return 0;
+    }
+
+    if (rep_flush (sender) < 0)
+        return -1;
+
+    off_t offset = 0;
+#if HAVE_SENDFILE
+    while ((uint64_t) offset < len) {
+        ssize_t count = sendfile (sender->out_fd, fd, &offset, len - (uint64_t) offset);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0 && (errno == EINVAL || errno == ENOSYS))
+                break;
+            if (count == 0)
+                errno = EIO;
+            return -1;
+        }
+    }
+#endif
+    if ((uint64_t) offset < len && lseek (fd, offset, SEEK_SET) >= 0)
+        return copy_fd_buffered (fd, sender->out_fd);
+    return ((uint64_t) offset < len) ? -1 : 0;
+}
+
+
+/*
+ * Sends an element with its contents, looking for it in all the
+ * directories, as it may have been picked meanwhile.
+ */
+static int
+rep_send_add (struct rep_sender *sender, const char *name)
+{
+    static const enum spooldir_status statuses[] = {
+        SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_CUR,
+    };
+
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (sender->spool, name, path_buf);
+    int fd = -1;
+    for (unsigned i = 0; fd < 0 && i < sizeof (statuses) / sizeof (statuses[0]); i++)
+        fd = openat (status_to_fd (sender->spool, statuses[i]), path,
+                     O_RDONLY | O_CLOEXEC | SPOOLDIR_FILE_O_FLAGS);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;  /* Gone already. */
+
+    struct stat sb;
+    int retval = -1;
+    if (fstat (fd, &sb) == 0 &&
+        rep_put_record (sender, REP_OP_ADD, SPOOLDIR_STATUS_NEW, name, (uint64_t) sb.st_size) == 0)
+        retval = rep_send_payload (sender, fd, (uint64_t) sb.st_size);
+
+    int saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return retval;
+}
+
+
+static void
+rep_notify_cb (spooldir *spool, enum spooldir_status status, spooltxn *txn, void *userdata)
+{
+    struct rep_sender *sender = userdata;
+    if (sender->error)
+        return;
+
+    /* Elements appearing in "new" may also be rolled back ones. */
+    int retval = (status == SPOOLDIR_STATUS_NEW)
+        ? rep_send_add (sender, txn->key->bytes)
+        : rep_put_record (sender, REP_OP_STATUS, status, txn->key->bytes, 0);
+    if (retval < 0)
+        sender->error = errno;
+}
+
+
+static int
+rep_send_snapshot (struct rep_sender *sender)
+{
+    static const enum spooldir_status statuses[] = {
+        SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP,
+    };
+
+    struct dirscan *scan = malloc (sizeof (struct dirscan));
+    if (!scan)
+        return -1;
+
+    spooldir *spool = sender->spool;
+    int retval = 0;
+    for (unsigned i = 0; !retval && i < sizeof (statuses) / sizeof (statuses[0]); i++) {
+        for (unsigned bucket = 0; !retval && bucket < spool_nbuckets (spool); bucket++) {
+            char name[BUCKET_NAME_BUFSZ];
+            bucket_name (spool, bucket, name);
+            if (dirscan_init (scan, status_to_fd (spool, statuses[i]), name) < 0) {
+                retval = -1;
+                break;
+            }
+
+            const char *entry;
+            int status;
+            while (!retval && (status = dirscan_next_file (scan, &entry)) > 0) {
+                if (rep_send_add (sender, entry) < 0 ||
+                    (statuses[i] != SPOOLDIR_STATUS_NEW &&
+                     rep_put_record (sender, REP_OP_STATUS, statuses[i], entry, 0) < 0))
+                    retval = -1;
+            }
+            if (status < 0)
+                retval = -1;
+
+            int saved_errno = errno;
+            dirscan_fini (scan);
+            errno = saved_errno;
+        }
+    }
+
+    int saved_errno = errno;
+    free (scan);
+    errno = saved_errno;
+    return retval;
+}
+
+
+static int
+rep_read_ack (struct rep_sender *sender)
+{
+    uint8_t ack[8];
+    int retval = read_full (sender->ack_fd, ack, sizeof (ack));
+    if (retval == 0)
+        errno = EPIPE;  /* The receiver went away. */
+    if (retval <= 0)
+        return -1;
+    sender->acked = load_le64 (ack);
+    return 0;
+}
+
+
+int
+spooldir_replicate_send (spooldir *spool, int out_fd, int ack_fd, unsigned flags)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (out_fd >= 0, -1);
+
+    struct rep_sender *sender = calloc (1, sizeof (struct rep_sender));
+    if (!sender)
+        return -1;
+    sender->spool = spool;
+    sender->out_fd = out_fd;
+    sender->ack_fd = ack_fd;
+
+    /* Start watching before the snapshot, to avoid missing changes. */
+    spooldir_notifier *notifier = NULL;
+    int retval = -1;
+    if ((flags & SPOOLDIR_REPLICATE_FOLLOW) &&
+        !(notifier = spooldir_notifier_new (spool, rep_notify_cb, sender)))
+        goto out;
+
+    uint8_t header[REP_HEADER_SIZE];
+    memcpy (header, rep_magic, sizeof (rep_magic));
+    store_le32 (header + 8, REP_VERSION);
+    if (rep_put (sender, header, sizeof (header)) < 0 ||
+        rep_send_snapshot (sender) < 0 || rep_flush (sender) < 0)
+        goto out;
+
+    if (notifier) {
+        for (;;) {
+            struct pollfd pfds[2] = {
+                { .fd = spooldir_notifier_fd (notifier), .events = POLLIN },
+                { .fd = ack_fd, .events = POLLIN },
+            };
+            if (poll (pfds, (ack_fd >= 0) ? 2 : 1, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                goto out;
+            }
+            if ((pfds[0].revents & POLLIN) && spooldir_notifier_dispatch (notifier) < 0)
+                goto out;
+            if (sender->error) {
+                errno = sender->error;
+                goto out;
+            }
+            if (rep_flush (sender) < 0)
+                goto out;
+            if (ack_fd >= 0 && (pfds[1].revents & (POLLIN | POLLHUP)) && rep_read_ack (sender) < 0)
+                goto out;
+        }
+    }
+
+    /* Without following changes, wait until everything has been applied. */
+    while (ack_fd >= 0 && sender->acked < sender->sent)
+        if (rep_read_ack (sender) < 0)
+            goto out;
+    retval = 0;
+
+out:
+    {
+        int saved_errno = errno;
+        if (notifier)
+            spooldir_notifier_free (notifier);
+        free (sender);
+        errno = saved_errno;
+    }
+    return retval;
+}
+
+
+/*
+ * Copies exactly "len" bytes between descriptors, or discards them when
+ * "dst_fd" is negative.
+ */
+static int
+rep_copy_payload (int src_fd, int dst_fd, uint64_t len)
+{
+#if HAVE_SPLICE
+    struct stat sb;
+    if (dst_fd >= 0 && fstat (src_fd, &sb) == 0 && S_ISFIFO (sb.st_mode)) {
+        while (len > 0) {
+            ssize_t count = splice (src_fd, NULL, dst_fd, NULL,
+                                    (len < COPY_CHUNK_SIZE) ? (size_t) len : COPY_CHUNK_SIZE,
+                                    SPLICE_F_MOVE);
+            if (count <= 0) {
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0 && (errno == EINVAL || errno == ENOSYS))
+                    break;
+                if (count == 0)
+                    errno = EBADMSG;
+                return -1;
+            }
+            len -= (uint64_t) count;
+        }
+    }
+#endif
+
+    uint8_t buffer[16 * 1024];
+    while (len > 0) {
+        size_t chunk = (len < sizeof (buffer)) ? (size_t) len : sizeof (buffer);
+        if (read_full (src_fd, buffer, chunk) <= 0) {
+            if (!errno || errno == EINTR)
+                errno = EBADMSG;
+            return -1;
+        }
+        if (dst_fd >= 0 && write_full (dst_fd, buffer, chunk) < 0)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+static inline bool
+rep_move (spooldir *spool, const char *path, enum spooldir_status from, enum spooldir_status to)
+{
+    if (rename_noreplace (spool, status_to_fd (spool, from), path, status_to_fd (spool, to), path) < 0)
+        return false;
+    spool_moved (spool, from, to, path);
+    return true;
+}
+
+
+static int
+rep_apply_add (spooldir *spool, int in_fd, const char *name, uint64_t len)
+{
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, name, path_buf);
+
+    /* Elements which exist already are left alone; claimed ones were rolled back. */
+    struct stat sb;
+    if (fstatat (spool->wip_fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        rep_move (spool, path, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_NEW);
+        return rep_copy_payload (in_fd, -1, len);
+    }
+    if (fstatat (spool->new_fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0 ||
+        fstatat (spool->cur_fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+        return rep_copy_payload (in_fd, -1, len);
+
+    spooltxn txn;
+    if (!(txn.key = txn_key_from_name (&txn, name)))
+        return -1;
+    if (add_with_key (spool, &txn) < 0)
+        return -1;
+    if (rep_copy_payload (in_fd, txn.fd, len) < 0) {
+        int saved_errno = errno;
+        spooldir_rollback (spool, &txn);
+        errno = saved_errno;
+        return -1;
+    }
+    return (spooldir_commit (spool, &txn) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+
+static void
+rep_apply_status (spooldir *spool, const char *name, enum spooldir_status status)
+{
+    char path_buf[KEY_PATH_BUFSZ];
+    const char *path = key_path (spool, name, path_buf);
+
+    /* Records for elements not replicated (yet) are ignored. */
+    switch (status) {
+        case SPOOLDIR_STATUS_NEW:
+            rep_move (spool, path, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_NEW);
+            break;
+        case SPOOLDIR_STATUS_WIP:
+            rep_move (spool, path, SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP);
+            break;
+        case SPOOLDIR_STATUS_CUR:
+            if (!rep_move (spool, path, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_CUR))
+                rep_move (spool, path, SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_CUR);
+            break;
+        case SPOOLDIR_STATUS_FIN: {
+            spooltxn txn;
+            if ((txn.key = txn_key_from_name (&txn, name))) {
+                spooldir_delete (spool, txn.key);
+                spoolkey_free (txn.key);
+            }
+            break;
+        }
+        case SPOOLDIR_STATUS_TMP:
+            break;
+    }
+}
+
+
+static int
+rep_send_ack (int ack_fd, uint64_t applied)
+{
+    uint8_t ack[8];
+    store_le64 (ack, applied);
+    return write_full (ack_fd, ack, sizeof (ack));
+}
+
+
+int
+spooldir_replicate_recv (spooldir *spool, int in_fd, int ack_fd)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (in_fd >= 0, -1);
+
+    uint8_t header[REP_HEADER_SIZE];
+    int retval = read_full (in_fd, header, sizeof (header));
+    if (retval <= 0)
+        return retval;
+    if (memcmp (header, rep_magic, sizeof (rep_magic)) || load_le32 (header + 8) != REP_VERSION) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    uint64_t applied = 0, unacked = 0;
+    for (;;) {
+        /* Acknowledge in batches, and whenever the sender pauses. */
+        if (unacked && ack_fd >= 0) {
+            struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+            if (unacked >= REP_ACK_EVERY || poll (&pfd, 1, 0) == 0) {
+                if (rep_send_ack (ack_fd, applied) < 0)
+                    return -1;
+                unacked = 0;
+            }
+        }
+
+        uint8_t record[REP_RECORD_SIZE];
+        if ((retval = read_full (in_fd, record, sizeof (record))) <= 0)
+            break;
+
+        const uint8_t op = record[0];
+        const uint8_t status = record[1];
+        const size_t name_len = load_le16 (record + 2);
+        const uint64_t payload_len = load_le64 (record + 4);
+
+        char name[NAME_MAX + 1];
+        if (!name_len || name_len > NAME_MAX || status > SPOOLDIR_STATUS_FIN ||
+            (op != REP_OP_ADD && op != REP_OP_STATUS)) {
+            errno = EBADMSG;
+            return -1;
+        }
+        if ((retval = read_full (in_fd, name, name_len)) <= 0)
+            break;
+        name[name_len] = '\0';
+        if (name[0] == '.' || memchr (name, '/', name_len) || memchr (name, '\0', name_len)) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        if (op == REP_OP_ADD) {
+            if (rep_apply_add (spool, in_fd, name, payload_len) < 0)
+                return -1;
+        } else {
+            rep_apply_status (spool, name, (enum spooldir_status) status);
+        }
+        applied++;
+        unacked++;
+    }
+
+    if (retval == 0 && unacked && ack_fd >= 0 && rep_send_ack (ack_fd, applied) < 0)
+        return -1;
+    if (retval == 0 || retval == 1)
+        return 0;
+    if (errno == 0)
+        errno = EBADMSG;
+    return -1;
+}
+
+
+struct _spoolset {
+    enum spoolset_route route;
+    atomic_uint         next_add;
+    atomic_uint         next_pick;
+    unsigned            n_spools;
+    spooldir           *spools[];
+};
+
+
+spoolset*
+spoolset_open_paths (const char *const *paths, unsigned n, uint32_t mode)
+{
+    api_check_return_val (paths, NULL);
+    api_check_return_val (n > 0 && n <= UINT16_MAX, NULL);
+
+    spoolset *set = calloc (1, sizeof (spoolset) + n * sizeof (spooldir*));
+    if (!set)
+        return NULL;
+
+    set->route = SPOOLSET_ROUTE_HASH;
+    atomic_init (&set->next_add, 0);
+    atomic_init (&set->next_pick, 0);
+
+    for (set->n_spools = 0; set->n_spools < n; set->n_spools++) {
+        if (!(set->spools[set->n_spools] = spooldir_open_path (paths[set->n_spools], mode))) {
+            int saved_errno = errno;
+            spoolset_close (set);
+            errno = saved_errno;
+            return NULL;
+        }
+    }
+    return set;
+}
+
+
+void
+spoolset_close (spoolset *set)
+{
+    api_check_return (set);
+
+    for (unsigned i = 0; i < set->n_spools; i++)
+        spooldir_close (set->spools[i]);
+    free (set);
+}
+
+
+unsigned
+spoolset_size (const spoolset *set)
+{
+    api_check_return_val (set, 0);
+    return set->n_spools;
+}
+
+
+spooldir*
+spoolset_get (const spoolset *set, unsigned index)
+{
+    api_check_return_val (set, NULL);
+    api_check_return_val (index < set->n_spools, NULL);
+    return set->spools[index];
+}
+
+
+int
+spoolset_set_route (spoolset *set, enum spoolset_route route)
+{
+    api_check_return_val (set, -1);
+
+    switch (route) {
+        case SPOOLSET_ROUTE_HASH:
+        case SPOOLSET_ROUTE_ROUND_ROBIN:
+            set->route = route;
+            return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+static inline unsigned
+spoolset_key_shard (const spoolset *set, const spoolkey *key)
+{
+    return fnv1a (key->bytes, key->length) % set->n_spools;
+}
+
+
+int
+spoolset_add (spoolset *set, spooltxn *txn)
+{
+    api_check_return_val (set, -1);
+    api_check_return_val (txn, -1);
+
+    unsigned shard;
+    if (set->route == SPOOLSET_ROUTE_HASH) {
+        txn->key = spoolkey_init_new (&txn->__key, set->spools[0]->key_mode);
+        shard = spoolset_key_shard (set, txn->key);
+    } else {
+        shard = atomic_fetch_add_explicit (&set->next_add, 1, memory_order_relaxed) % set->n_spools;
+        txn->key = spoolkey_init_new (&txn->__key, set->spools[shard]->key_mode);
+    }
+
+    if (add_with_key (set->spools[shard], txn) < 0)
+        return -1;
+    txn_priv (txn)->shard = (uint16_t) shard;
+    return txn->fd;
+}
+
+
+/*
+ * Estimates how many elements are waiting in a spool, when its counters or
+ * index make that cheap. Otherwise all look the same, and shards are stolen
+ * from in turns.
+ */
+static ssize_t
+spool_backlog_hint (const spooldir *spool)
+{
+    if (!spool->counts && !spool->index)
+        return 0;
+    ssize_t count = spooldir_count (spool, SPOOLDIR_STATUS_NEW, 0);
+    return (count > 0) ? count : 0;
+}
+
+
+/*
+ * Picks from the shards in turns; a shard found empty steals from the
+ * others, the ones which look fullest first.
+ */
+int
+spoolset_pick (spoolset *set, spooltxn *txn)
+{
+    api_check_return_val (set, -1);
+    api_check_return_val (txn, -1);
+
+    const unsigned n = set->n_spools;
+    unsigned first = atomic_fetch_add_explicit (&set->next_pick, 1, memory_order_relaxed) % n;
+
+    int retval = spooldir_pick (set->spools[first], txn);
+    if (retval == 0) {
+        txn_priv (txn)->shard = (uint16_t) first;
+        return 0;
+    }
+    if (retval != EOF || errno != 0 || n == 1)
+        return retval;
+
+    /* Order by backlog; shards too many to sort go in turns. */
+    enum { STEAL_MAX = 64 };
+    unsigned order[STEAL_MAX];
+    ssize_t hint[STEAL_MAX];
+    unsigned count = 0;
+    for (unsigned i = 1; i < n && count < STEAL_MAX; i++) {
+        unsigned shard = (first + i) % n;
+        ssize_t h = spool_backlog_hint (set->spools[shard]);
+        unsigned j = count++;
+        for (; j > 0 && hint[j - 1] < h; j--) {
+            hint[j] = hint[j - 1];
+            order[j] = order[j - 1];
+        }
+        hint[j] = h;
+        order[j] = shard;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if ((retval = spooldir_pick (set->spools[order[i]], txn)) == 0) {
+            txn_priv (txn)->shard = (uint16_t) order[i];
+            return 0;
+        }
+        if (retval != EOF || errno != 0)
+            return retval;
+    }
+
+    errno = 0;
+    return EOF;
+}
+
+
+ssize_t
+spoolset_pick_many (spoolset *set, spooltxn *txns, size_t n)
+{
+    api_check_return_val (set, -1);
+    api_check_return_val (txns, -1);
+
+    size_t count = 0;
+    unsigned empty = 0;  /* Consecutive shards without elements. */
+    while (count < n && empty < set->n_spools) {
+        unsigned shard = atomic_fetch_add_explicit (&set->next_pick, 1, memory_order_relaxed)
+            % set->n_spools;
+        ssize_t picked = spooldir_pick_many (set->spools[shard], &txns[count], n - count);
+        if (picked < 0) {
+            if (count == 0)
+                return -1;
+            break;
+        }
+        for (ssize_t i = 0; i < picked; i++)
+            txn_priv (&txns[count + i])->shard = (uint16_t) shard;
+        count += (size_t) picked;
+        empty = picked ? 0 : empty + 1;
+    }
+
+    errno = 0;
+    return (ssize_t) count;
+}
+
+
+static inline spooldir*
+spoolset_txn_spool (spoolset *set, spooltxn *txn)
+{
+    unsigned shard = txn_priv (txn)->shard;
+    return (shard < set->n_spools) ? set->spools[shard] : NULL;
+}
+
+
+int
+spoolset_commit (spoolset *set, spooltxn *txn)
+{
+    api_check_return_val (set, -1);
+    api_check_return_val (txn, -1);
+
+    spooldir *spool = spoolset_txn_spool (set, txn);
+    api_check_return_val (spool, -1);
+    return spooldir_commit (spool, txn);
+}
+
+
+int
+spoolset_rollback (spoolset *set, spooltxn *txn)
+{
+    api_check_return_val (set, -1);
+    api_check_return_val (txn, -1);
+
+    spooldir *spool = spoolset_txn_spool (set, txn);
+    api_check_return_val (spool, -1);
+    return spooldir_rollback (spool, txn);
+}
+
+
+_Bool
+spoolset_has_status (const spoolset *set, const spoolkey *key, enum spooldir_status status)
+{
+    api_check_return_val (set, false);
     api_check_return_val (key, false);
 
-    int subdir_fd = status_to_fd (spool, status);
-    if (subdir_fd < 0)
+    if (set->route == SPOOLSET_ROUTE_HASH)
+        return spooldir_has_status (set->spools[spoolset_key_shard (set, key)], key, status);
+
+    for (unsigned i = 0; i < set->n_spools; i++)
+        if (spooldir_has_status (set->spools[i], key, status))
+            return true;
+    return false;
+}
+
+
+/*
+ * The in-memory index keeps the names of the elements in each status in
+ * hash sets (open addressing with linear probing), and the elements which
+ * can be picked in a FIFO. It is kept current using inotify events; elsewhere
+ * changes done through the handle are recorded as they happen, and buckets
+ * whose modification times change are scanned again.
+ */
+enum {
+    INDEX_NEW,
+    INDEX_WIP,
+    INDEX_CUR,
+    INDEX_N_SETS,
+    INDEX_MIN_CAPACITY = 64,  /* Must be a power of two. */
+};
+
+static char index_tombstone;
+#define INDEX_TOMBSTONE (&index_tombstone)
+
+struct index_entry {
+    uint32_t hash;
+    char    *name;  /* NULL when empty. */
+};
+
+struct index_set {
+    struct index_entry *entries;
+    size_t              capacity;
+    size_t              used;  /* Including tombstones. */
+    size_t              count;
+};
+
+struct index_fifo {
+    char  **names;
+    size_t  capacity;
+    size_t  head;
+    size_t  count;
+};
+
+struct index_bucket {
+    struct timespec mtime;
+    bool            settled;  /* Read after its resolution had passed. */
+};
+
+struct spool_index {
+    pthread_mutex_t      lock;
+    spooldir            *spool;
+    spooldir_notifier   *notifier;     /* NULL when using modification times. */
+    bool                 stale;
+    long long            mtime_grain;  /* Resolution of time stamps, in ns. */
+    struct index_bucket *buckets;      /* One per status and bucket. */
+    struct index_set     sets[INDEX_N_SETS];
+    struct index_fifo    fifo;
+};
+
+
+static void
+index_set_clear (struct index_set *set)
+{
+    for (size_t i = 0; i < set->capacity; i++)
+        if (set->entries[i].name != INDEX_TOMBSTONE)
+            free (set->entries[i].name);
+    free (set->entries);
+    memset (set, 0, sizeof (struct index_set));
+}
+
+
+static struct index_entry*
+index_set_lookup (const struct index_set *set, const char *name, uint32_t hash)
+{
+    if (!set->capacity)
+        return NULL;
+
+    for (size_t i = hash & (set->capacity - 1);; i = (i + 1) & (set->capacity - 1)) {
+        struct index_entry *entry = &set->entries[i];
+        if (!entry->name)
+            return NULL;
+        if (entry->name != INDEX_TOMBSTONE && entry->hash == hash && !strcmp (entry->name, name))
+            return entry;
+    }
+}
+
+
+static bool
+index_set_resize (struct index_set *set, size_t capacity)
+{
+    struct index_entry *entries = calloc (capacity, sizeof (struct index_entry));
+    if (!entries)
+        return false;
+
+    size_t used = 0;
+    for (size_t i = 0; i < set->capacity; i++) {
+        struct index_entry *entry = &set->entries[i];
+        if (!entry->name || entry->name == INDEX_TOMBSTONE)
+            continue;
+
+        size_t j = entry->hash & (capacity - 1);
+        while (entries[j].name)
+            j = (j + 1) & (capacity - 1);
+        entries[j] = *entry;
+        used++;
+    }
+
+    free (set->entries);
+    set->entries = entries;
+    set->capacity = capacity;
+    set->used = used;
+    return true;
+}
+
+
+/*
+ * Returns 1 if the name was added, 0 if already present, and -1 on error.
+ */
+static int
+index_set_add (struct index_set *set, const char *name, uint32_t hash)
+{
+    if (index_set_lookup (set, name, hash))
+        return 0;
+
+    /* Keep the load, tombstones included, under 75%. */
+    if ((set->used + 1) * 4 > set->capacity * 3) {
+        size_t capacity = set->capacity ? set->capacity : INDEX_MIN_CAPACITY;
+        while ((set->used + 1) * 2 > capacity)
+            capacity *= 2;
+        if (!index_set_resize (set, capacity))
+            return -1;
+    }
+
+    char *copy = strdup (name);
+    if (!copy)
+        return -1;
+
+    size_t i = hash & (set->capacity - 1);
+    while (set->entries[i].name && set->entries[i].name != INDEX_TOMBSTONE)
+        i = (i + 1) & (set->capacity - 1);
+    if (!set->entries[i].name)
+        set->used++;
+    set->entries[i].hash = hash;
+    set->entries[i].name = copy;
+    set->count++;
+    return 1;
+}
+
+
+static void
+index_set_remove (struct index_set *set, const char *name, uint32_t hash)
+{
+    struct index_entry *entry = index_set_lookup (set, name, hash);
+    if (entry) {
+        free (entry->name);
+        entry->name = INDEX_TOMBSTONE;
+        set->count--;
+    }
+}
+
+
+static void
+index_fifo_clear (struct index_fifo *fifo)
+{
+    for (size_t i = 0; i < fifo->count; i++)
+        free (fifo->names[(fifo->head + i) % fifo->capacity]);
+    free (fifo->names);
+    memset (fifo, 0, sizeof (struct index_fifo));
+}
+
+
+static bool
+index_fifo_push (struct index_fifo *fifo, const char *name)
+{
+    if (fifo->count == fifo->capacity) {
+        size_t capacity = fifo->capacity ? fifo->capacity * 2 : INDEX_MIN_CAPACITY;
+        char **names = malloc (capacity * sizeof (char*));
+        if (!names)
+            return false;
+        for (size_t i = 0; i < fifo->count; i++)
+            names[i] = fifo->names[(fifo->head + i) % fifo->capacity];
+        free (fifo->names);
+        fifo->names = names;
+        fifo->capacity = capacity;
+        fifo->head = 0;
+    }
+
+    char *copy = strdup (name);
+    if (!copy)
         return false;
+    fifo->names[(fifo->head + fifo->count++) % fifo->capacity] = copy;
+    return true;
+}
+
+
+static char*
+index_fifo_pop (struct index_fifo *fifo)
+{
+    if (!fifo->count)
+        return NULL;
+
+    char *name = fifo->names[fifo->head];
+    fifo->head = (fifo->head + 1) % fifo->capacity;
+    fifo->count--;
+    return name;
+}
+
+
+/*
+ * Applies a change to the index. Elements only enter "new" when added or
+ * rolled back, and "cur" from "wip", but can be deleted from anywhere; a
+ * failure to record one marks the index stale.
+ */
+static void
+index_update (struct spool_index *index, enum spooldir_status status, const char *name)
+{
+    const uint32_t hash = fnv1a (name, strlen (name));
+    int added = 0;
+
+    switch (status) {
+        case SPOOLDIR_STATUS_NEW:
+            index_set_remove (&index->sets[INDEX_WIP], name, hash);
+            added = index_set_add (&index->sets[INDEX_NEW], name, hash);
+            if (added > 0 && !index_fifo_push (&index->fifo, name))
+                added = -1;
+            break;
+        case SPOOLDIR_STATUS_WIP:
+            index_set_remove (&index->sets[INDEX_NEW], name, hash);
+            added = index_set_add (&index->sets[INDEX_WIP], name, hash);
+            break;
+        case SPOOLDIR_STATUS_CUR:
+            index_set_remove (&index->sets[INDEX_WIP], name, hash);
+            added = index_set_add (&index->sets[INDEX_CUR], name, hash);
+            break;
+        case SPOOLDIR_STATUS_FIN:
+            /* Elements may be deleted from any subdirectory. */
+            for (unsigned set = 0; set < INDEX_N_SETS; set++)
+                index_set_remove (&index->sets[set], name, hash);
+            break;
+        case SPOOLDIR_STATUS_TMP:
+            break;
+    }
+
+    if (added < 0)
+        index->stale = true;
+}
+
+
+static void
+index_notify_cb (spooldir *spool, enum spooldir_status status, spooltxn *txn, void *userdata)
+{
+    index_update (userdata, status, txn->key->bytes);
+}
+
 
+static const enum spooldir_status index_set_status[INDEX_N_SETS] = {
+    SPOOLDIR_STATUS_NEW, SPOOLDIR_STATUS_WIP, SPOOLDIR_STATUS_CUR,
+};
+
+static inline int
+index_subdir_fd (const spooldir *spool, unsigned set)
+{
+    return status_to_fd (spool, index_set_status[set]);
+}
+
+
+static inline long long
+timespec_ns (const struct timespec *ts)
+{
+    return (long long) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+
+/*
+ * Reads the modification time of a bucket. Changes done later within the
+ * resolution of the time stamps leave it as is, and the bucket has to be
+ * scanned again until that much time has passed.
+ */
+static int
+index_bucket_stat (struct spool_index *index, unsigned set, unsigned bucket, bool *changed)
+{
+    const unsigned nbuckets = spool_nbuckets (index->spool);
+    struct index_bucket *b = &index->buckets[set * nbuckets + bucket];
+    char name[BUCKET_NAME_BUFSZ];
+    struct timespec now;
     struct stat sb;
-    return (fstatat (subdir_fd, key->bytes, &sb, AT_SYMLINK_NOFOLLOW) == 0)
-        && (S_ISREG (sb.st_mode));
+
+    bucket_name (index->spool, bucket, name);
+    clock_gettime (CLOCK_REALTIME, &now);
+    if (fstatat (index_subdir_fd (index->spool, set), name, &sb, 0) < 0)
+        return -1;
+
+    /* Whole seconds are all some file systems keep. */
+    const long long grain = sb.st_mtim.tv_nsec ? index->mtime_grain : 2000000000LL;
+    *changed = !b->settled
+        || sb.st_mtim.tv_sec != b->mtime.tv_sec || sb.st_mtim.tv_nsec != b->mtime.tv_nsec;
+    b->mtime = sb.st_mtim;
+    b->settled = timespec_ns (&now) - timespec_ns (&sb.st_mtim) >= grain;
+    return 0;
+}
+
+
+static inline bool
+index_in_bucket (const spooldir *spool, const char *name, const char *bucket)
+{
+    char path[KEY_PATH_BUFSZ];
+    return !spool->fanout_digits
+        || !memcmp (key_path (spool, name, path), bucket, spool->fanout_digits);
+}
+
+
+/*
+ * Scans a bucket, adding the names found and removing those which are
+ * gone. Other buckets, and the order of the FIFO, are left as they are.
+ */
+static int
+index_rescan_bucket (struct spool_index *index, unsigned set, unsigned bucket)
+{
+    spooldir *spool = index->spool;
+    struct index_set *entries = &index->sets[set];
+    struct index_set found = { 0 };
+    struct dirscan scan;
+    const char *name;
+    int retval;
+
+    char bucket_buf[BUCKET_NAME_BUFSZ];
+    bucket_name (spool, bucket, bucket_buf);
+    if (dirscan_init (&scan, index_subdir_fd (spool, set), bucket_buf) < 0)
+        return -1;
+    while ((retval = dirscan_next_file (&scan, &name)) > 0)
+        if (index_set_add (&found, name, fnv1a (name, strlen (name))) < 0)
+            retval = -1;
+    dirscan_fini (&scan);
+    if (retval < 0)
+        goto out;
+
+    for (size_t i = 0; i < entries->capacity; i++) {
+        struct index_entry *entry = &entries->entries[i];
+        if (entry->name && entry->name != INDEX_TOMBSTONE
+            && index_in_bucket (spool, entry->name, bucket_buf)
+            && !index_set_lookup (&found, entry->name, entry->hash))
+            index_set_remove (entries, entry->name, entry->hash);
+    }
+    for (size_t i = 0; i < found.capacity; i++) {
+        struct index_entry *entry = &found.entries[i];
+        if (entry->name && entry->name != INDEX_TOMBSTONE
+            && !index_set_lookup (entries, entry->name, entry->hash))
+            index_update (index, index_set_status[set], entry->name);
+    }
+    retval = index->stale ? -1 : 0;
+
+out:
+    index_set_clear (&found);
+    return retval;
+}
+
+
+static int
+index_rebuild (struct spool_index *index)
+{
+    spooldir *spool = index->spool;
+    const unsigned nbuckets = spool_nbuckets (spool);
+
+    for (unsigned set = 0; set < INDEX_N_SETS; set++)
+        index_set_clear (&index->sets[set]);
+    index_fifo_clear (&index->fifo);
+
+    /* Events queued before scanning are already reflected in the scan. */
+    if (index->notifier) {
+        index->notifier->overflowed = false;
+        if (spooldir_notifier_dispatch (index->notifier) < 0)
+            return -1;
+    }
+    index->stale = false;
+
+    for (unsigned set = 0; set < INDEX_N_SETS; set++) {
+        for (unsigned i = 0; i < nbuckets; i++) {
+            bool changed;
+            if (index_bucket_stat (index, set, i, &changed) < 0)
+                return -1;
+
+            char bucket[BUCKET_NAME_BUFSZ];
+            struct dirscan scan;
+            const char *name;
+            int retval;
+            bucket_name (spool, i, bucket);
+            if (dirscan_init (&scan, index_subdir_fd (spool, set), bucket) < 0)
+                return -1;
+            while ((retval = dirscan_next_file (&scan, &name)) > 0)
+                index_update (index, index_set_status[set], name);
+            dirscan_fini (&scan);
+            if (retval < 0)
+                return -1;
+        }
+    }
+    return index->stale ? -1 : 0;
+}
+
+
+/*
+ * Brings the index up to date. Returns false if it cannot be used.
+ */
+static bool
+index_refresh (struct spool_index *index)
+{
+    if (index->notifier) {
+        if (spooldir_notifier_dispatch (index->notifier) < 0 || index->notifier->overflowed)
+            index->stale = true;
+    } else if (!index->stale) {
+        /* Changes done through this handle are recorded as they happen. */
+        const unsigned nbuckets = spool_nbuckets (index->spool);
+        for (unsigned set = 0; set < INDEX_N_SETS && !index->stale; set++) {
+            for (unsigned i = 0; i < nbuckets && !index->stale; i++) {
+                bool changed;
+                if (index_bucket_stat (index, set, i, &changed) < 0
+                    || (changed && index_rescan_bucket (index, set, i) < 0))
+                    index->stale = true;
+            }
+        }
+    }
+
+    if (index->stale && index_rebuild (index) < 0)
+        index->stale = true;
+    return !index->stale;
+}
+
+
+/*
+ * Records a change done through the handle. With a notifier the events
+ * report it already.
+ */
+static void
+index_record (spooldir *spool, enum spooldir_status status, const char *path)
+{
+    struct spool_index *index = spool->index;
+    if (!index || index->notifier)
+        return;
+
+    const char *name = strrchr (path, '/');
+    pthread_mutex_lock (&index->lock);
+    index_update (index, status, name ? name + 1 : path);
+    pthread_mutex_unlock (&index->lock);
+}
+
+
+static void
+index_free (struct spool_index *index)
+{
+    if (index->notifier)
+        spooldir_notifier_free (index->notifier);
+    for (unsigned set = 0; set < INDEX_N_SETS; set++)
+        index_set_clear (&index->sets[set]);
+    index_fifo_clear (&index->fifo);
+    pthread_mutex_destroy (&index->lock);
+    free (index->buckets);
+    free (index);
+}
+
+
+int
+spooldir_set_index (spooldir *spool, _Bool enable)
+{
+    api_check_return_val (spool, -1);
+
+    if (!enable) {
+        if (spool->index) {
+            index_free (spool->index);
+            spool->index = NULL;
+        }
+        return 0;
+    }
+    if (spool->index)
+        return 0;
+
+    struct spool_index *index = calloc (1, sizeof (struct spool_index));
+    if (!index)
+        return -1;
+
+    pthread_mutex_init (&index->lock, NULL);
+    index->spool = spool;
+    if (!(index->buckets = calloc (INDEX_N_SETS * spool_nbuckets (spool),
+                                   sizeof (struct index_bucket))))
+        goto error;
+
+    /* Modification times come from the coarse clock, where there is one. */
+    index->mtime_grain = 1000000000LL;
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec res;
+    if (clock_getres (CLOCK_REALTIME_COARSE, &res) == 0)
+        index->mtime_grain = timespec_ns (&res);
+#endif
+
+#if HAVE_INOTIFY
+    /* Start watching before scanning, to avoid missing changes. */
+    if (!(index->notifier = spooldir_notifier_new (spool, index_notify_cb, index)))
+        goto error;
+#endif
+
+    if (index_rebuild (index) < 0)
+        goto error;
+
+    spool->index = index;
+    return 0;
+
+error:
+    {
+        int saved_errno = errno;
+        index_free (index);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+
+static int
+index_pick (spooldir *spool, spooltxn *txn)
+{
+    struct spool_index *index = spool->index;
+    int retval = INDEX_STALE;
+
+    pthread_mutex_lock (&index->lock);
+    if (!index_refresh (index))
+        goto out;
+
+    char *name;
+    while ((name = index_fifo_pop (&index->fifo))) {
+        /* Elements claimed since they were queued are not in the set. */
+        const uint32_t hash = fnv1a (name, strlen (name));
+        if (!index_set_lookup (&index->sets[INDEX_NEW], name, hash)) {
+            free (name);
+            continue;
+        }
+
+        char path[KEY_PATH_BUFSZ];
+        int fd = move_and_open (spool, spool->new_fd, spool->wip_fd,
+                                key_path (spool, name, path));
+        if (fd >= 0 || fd == -ENOENT || fd == -EEXIST)
+            index_set_remove (&index->sets[INDEX_NEW], name, hash);
+        if (fd >= 0) {
+            /* Claiming records the element in "wip", taking the lock. */
+            pthread_mutex_unlock (&index->lock);
+            txn_claimed (spool, txn, fd, name);
+            free (name);
+            return 0;
+        }
+        free (name);
+        if (fd != -ENOENT && fd != -EEXIST) {
+            errno = -fd;
+            retval = -1;
+            goto out;
+        }
+    }
+
+    errno = 0;
+    retval = EOF;
+
+out:
+    pthread_mutex_unlock (&index->lock);
+    return retval;
+}
+
+
+/*
+ * Returns the number of elements with a status, or -1 if the index is stale.
+ */
+static ssize_t
+index_count (const spooldir *spool, enum spooldir_status status)
+{
+    struct spool_index *index = spool->index;
+    ssize_t count = -1;
+    int set = (status == SPOOLDIR_STATUS_NEW) ? INDEX_NEW
+        : (status == SPOOLDIR_STATUS_WIP) ? INDEX_WIP
+        : INDEX_CUR;
+
+    pthread_mutex_lock (&index->lock);
+    if (index_refresh (index))
+        count = (ssize_t) index->sets[set].count;
+    pthread_mutex_unlock (&index->lock);
+    return count;
+}
+
+
+static int
+index_has_status (const spooldir *spool, const spoolkey *key, enum spooldir_status status)
+{
+    struct spool_index *index = spool->index;
+    int retval = INDEX_STALE;
+    int set = (status == SPOOLDIR_STATUS_NEW) ? INDEX_NEW
+        : (status == SPOOLDIR_STATUS_WIP) ? INDEX_WIP
+        : (status == SPOOLDIR_STATUS_CUR) ? INDEX_CUR
+        : -1;
+    if (set < 0)
+        return INDEX_STALE;
+
+    pthread_mutex_lock (&index->lock);
+    if (index_refresh (index))
+        retval = index_set_lookup (&index->sets[set], key->bytes,
+                                   fnv1a (key->bytes, key->length)) != NULL;
+    pthread_mutex_unlock (&index->lock);
+    return retval;
+}
+
+
+int
+spooldir_stats (const spooldir *spool, struct spooldir_stats *stats)
+{
+    api_check_return_val (spool, -1);
+    api_check_return_val (stats, -1);
+
+#if SPOOLDIR_ENABLE_STATS
+    const struct stats *s = &spool->stats;
+    stats->adds = atomic_load_explicit (&s->adds, memory_order_relaxed);
+    stats->commits = atomic_load_explicit (&s->commits, memory_order_relaxed);
+    stats->rollbacks = atomic_load_explicit (&s->rollbacks, memory_order_relaxed);
+    stats->picks = atomic_load_explicit (&s->picks, memory_order_relaxed);
+    stats->pick_races = atomic_load_explicit (&s->pick_races, memory_order_relaxed);
+    stats->entries_scanned = atomic_load_explicit (&s->entries_scanned, memory_order_relaxed);
+    stats->bytes_written = atomic_load_explicit (&s->bytes_written, memory_order_relaxed);
+    for (unsigned stage = 0; stage < SPOOLDIR_STAGE_COUNT; stage++)
+        for (unsigned i = 0; i < SPOOLDIR_STATS_BUCKETS; i++)
+            stats->latency[stage][i] = atomic_load_explicit (&s->latency[stage][i],
+                                                             memory_order_relaxed);
+    return 0;
+#else
+    memset (stats, 0, sizeof (struct spooldir_stats));
+    errno = ENOSYS;
+    return -1;
+#endif
 }
@@ -13,14 +13,41 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct _spooldir spooldir;
 typedef struct _spoolkey spoolkey;
+typedef struct _spooldir_cursor spooldir_cursor;
+typedef struct _spooldir_notifier spooldir_notifier;
+typedef struct _spooldir_segment spooldir_segment;
+typedef struct _spooldir_segment_reader spooldir_segment_reader;
+typedef struct _spooldir_worker_pool spooldir_worker_pool;
+typedef struct _spooldir_async spooldir_async;
+typedef struct _spooldir_producer spooldir_producer;
+typedef struct _spoolset spoolset;
 
 /*
+ * Algorithms used to generate new keys.
+ */
+enum spoolkey_mode {
+    SPOOLKEY_HMAC_SHA256,   /* HMAC-SHA256 of a counter, 64 characters (default). */
+    SPOOLKEY_SIPHASH,       /* SipHash of a counter, 32 characters. */
+    SPOOLKEY_TIME_ORDERED,  /* Timestamp and counter prefix, 32 characters. */
+};
+
+/*
+ * Generates a new unique key using HMAC-SHA256.
  */
 spoolkey* spoolkey_new (void);
 
+/*
+ * Generates a new unique key using the given algorithm. Sorting keys
+ * generated with "SPOOLKEY_TIME_ORDERED" by name yields approximately
+ * their creation order.
+ */
+spoolkey* spoolkey_new_with_mode (enum spoolkey_mode mode);
+
 /*
  * Creates a new key given a new key from a C string.
  */
@@ -32,6 +59,31 @@ spoolkey_new_from_string (const char *str, _Bool copy, _Bool take_ownership)
     return spoolkey_new_from_mem (str, strlen (str), copy, take_ownership);
 }
 
+/*
+ * Storage for keys which avoids allocating memory from the heap. Keys of up
+ * to "SPOOLKEY_INLINE_SIZE" characters, which includes all generated keys
+ * along with a priority prefix, can be stored inline. Freeing an inline key
+ * does nothing.
+ */
+enum { SPOOLKEY_INLINE_SIZE = 64 + 2 };
+
+typedef struct {
+    uintptr_t __priv[2];                        /* Private. */
+    char      __bytes[SPOOLKEY_INLINE_SIZE + 1];  /* Private. */
+} spoolkey_inline;
+
+/*
+ * Generates a new unique key using the given algorithm, using "storage"
+ * for it. Any key previously stored there becomes invalid.
+ */
+spoolkey* spoolkey_init_new (spoolkey_inline *storage, enum spoolkey_mode mode);
+
+/*
+ * Creates a key given its bytes, copying them to "storage". Any key
+ * previously stored there becomes invalid.
+ */
+spoolkey* spoolkey_init_inline (spoolkey_inline *storage, const void *bytes, size_t len);
+
 /*
  * Creates a copy of a key.
  */
@@ -42,6 +94,11 @@ spoolkey* spoolkey_copy (const spoolkey *key);
  */
 const char* spoolkey_cstr (const spoolkey *key);
 
+/*
+ * Obtains the length of a key.
+ */
+size_t spoolkey_length (const spoolkey *key);
+
 /*
  * Frees memory used by a key.
  */
@@ -71,12 +128,50 @@ typedef struct {
     enum spooldir_status status;
     spoolkey            *key;
     int                  fd;
+    _Alignas (uintptr_t)
     uint8_t              __pad[SPOOLTXN__PAD];  /* Private. */
+    spoolkey_inline      __key;                 /* Private. */
 } spooltxn;
 
+/*
+ * Takes ownership of the key of a transaction. Keys are usually stored
+ * inline in the transaction itself, so a copy allocated in the heap is
+ * returned; use "spooltxn_take_key_inline()" to avoid the allocation.
+ */
 spoolkey* spooltxn_take_key (spooltxn *txn);
+
+/*
+ * Moves the key of a transaction to "storage", which is returned.
+ */
+spoolkey* spooltxn_take_key_inline (spooltxn *txn, spoolkey_inline *storage);
+
+/*
+ * Takes ownership of the file descriptor of a transaction. For elements
+ * being added the transaction may need to keep its descriptor until it is
+ * committed, and a duplicate is returned instead.
+ */
 int spooltxn_take_fd (spooltxn *txn);
 
+/*
+ * Provides read-only access to the contents of the element of a
+ * transaction, mapping it in memory. The mapping is released when the
+ * transaction is committed or rolled back, or with "spooldir_unmap()".
+ */
+int spooldir_map (spooltxn *txn, const void **data, size_t *len);
+
+/*
+ * Like "spooldir_map()", but elements which fit in "buf" are read into it,
+ * which is faster than mapping small files.
+ */
+int spooldir_map_buf (spooltxn *txn, void *buf, size_t bufsz,
+                      const void **data, size_t *len);
+
+/*
+ * Releases the mapping created for a transaction, if any. Pointers
+ * obtained with "spooldir_map()" become invalid.
+ */
+void spooldir_unmap (spooltxn *txn);
+
 /*
  * Opens a spool directory given an open file descriptor to a directory.
  */
@@ -86,6 +181,189 @@ spooldir* spooldir_open (int dir_fd);
  */
 spooldir* spooldir_open_path (const char *path, uint32_t mode);
 
+/*
+ * Configures the spool to shard the "new", "wip" and "cur" directories into
+ * "buckets" subdirectories, which can be 256 or 4096; zero disables fan-out.
+ * The setting is saved in the spool, and used by all the processes which
+ * open it afterwards. The layout, fan-out or not, can be changed while the
+ * spool does not contain elements, otherwise "EBUSY" is reported.
+ */
+int spooldir_set_fanout (spooldir *spool, unsigned buckets);
+
+/*
+ * Obtains the number of fan-out buckets used by a spool, or zero.
+ */
+unsigned spooldir_get_fanout (const spooldir *spool);
+
+/*
+ * Enables deduplication: keys of new elements are derived from their
+ * contents when committing them, and adding contents which are present
+ * already in the spool becomes a no-op. Priority prefixes are kept, so
+ * the same contents may be present once per priority class. The setting
+ * is saved in the spool.
+ */
+int spooldir_set_dedup (spooldir *spool, _Bool enable);
+_Bool spooldir_get_dedup (const spooldir *spool);
+
+/*
+ * Replaces the key of an element being added by one derived from its
+ * contents, which must not be modified afterwards. This is done by
+ * "spooldir_commit()" in spools with deduplication enabled, calling it
+ * before allows knowing the resulting key.
+ */
+int spooldir_derive_key (spooldir *spool, spooltxn *txn);
+
+enum spooldir_codec {
+    SPOOLDIR_CODEC_NONE = 0,
+    SPOOLDIR_CODEC_ZSTD = 1,  /* Needs building with "ZSTD=1". */
+    SPOOLDIR_CODEC_LZ4  = 2,  /* Reserved, not supported yet. */
+};
+
+/*
+ * Compresses the contents of elements added with "spooldir_add_from_fd()",
+ * "spooldir_add_iov()" and producers; "level" zero picks the default of
+ * the codec. Writes to the descriptor of a transaction are stored as-is.
+ * Reading with "spooldir_map()" transparently decodes elements, which may
+ * be compressed or not in the same spool. The setting is saved in the
+ * spool, "ENOTSUP" is reported for codecs not built in.
+ */
+int spooldir_set_codec (spooldir *spool, enum spooldir_codec codec, unsigned level);
+enum spooldir_codec spooldir_get_codec (const spooldir *spool);
+
+/*
+ * Chooses the algorithm used to generate keys for elements added to the
+ * spool using this handle. The default is "SPOOLKEY_HMAC_SHA256".
+ */
+int spooldir_set_key_mode (spooldir *spool, enum spoolkey_mode mode);
+enum spoolkey_mode spooldir_get_key_mode (const spooldir *spool);
+
+/*
+ * Order in which elements are picked.
+ */
+enum spooldir_pick_order {
+    SPOOLDIR_PICK_ANY,   /* Directory order, the cheapest (default). */
+    SPOOLDIR_PICK_FIFO,  /* Oldest modification time first. */
+    SPOOLDIR_PICK_KEY,   /* Lowest key first. */
+};
+
+/*
+ * Chooses the order in which this handle picks elements. Ordering is done
+ * by batches of candidates read from the directory, so it is approximate:
+ * an element is never picked before older ones in the same batch. Higher
+ * priorities (see "spooldir_add_with_priority()") are picked first in the
+ * ordered modes. "SPOOLDIR_PICK_KEY" gives FIFO order for elements added
+ * with "SPOOLKEY_TIME_ORDERED" keys, without the cost of stat()ing them.
+ */
+int spooldir_set_pick_order (spooldir *spool, enum spooldir_pick_order order);
+enum spooldir_pick_order spooldir_get_pick_order (const spooldir *spool);
+
+enum {
+    SPOOLDIR_PREFETCH_MAX = 64,
+};
+
+/*
+ * Makes picks through a handle read ahead the contents of up to "window"
+ * of the candidates which follow in the current batch, hiding the latency
+ * of cold reads while handling the picked element. Zero disables it (the
+ * default).
+ */
+int spooldir_set_prefetch (spooldir *spool, unsigned window);
+
+/*
+ * Durability guarantees for elements being added.
+ */
+enum spooldir_durability {
+    SPOOLDIR_DURABILITY_NONE,   /* Rely on the operating system (default). */
+    SPOOLDIR_DURABILITY_ITEM,   /* Sync each element when committing it. */
+    SPOOLDIR_DURABILITY_GROUP,  /* Sync elements committed together. */
+};
+
+/*
+ * Chooses the durability guarantees for elements added to the spool using
+ * this handle. Once "spooldir_commit()" returns for such an element, its
+ * contents and its entry in the "new" directory are on disk.
+ *
+ * With "SPOOLDIR_DURABILITY_GROUP", commits done from different threads
+ * during "window_usec" microseconds, or until "max_count" of them are
+ * waiting, are synced together; committers block until their group is
+ * durable. The other parameters are ignored for the other modes.
+ *
+ * Other transitions are not synced: after a crash an element may show up
+ * again in a previous status, so handling is done at least once.
+ */
+int spooldir_set_durability (spooldir *spool, enum spooldir_durability durability,
+                             unsigned window_usec, unsigned max_count);
+enum spooldir_durability spooldir_get_durability (const spooldir *spool);
+
+/*
+ * Engines used to move elements between directories.
+ */
+enum spooldir_io_engine {
+    SPOOLDIR_IO_SYNC,   /* One system call at a time (default). */
+    SPOOLDIR_IO_URING,  /* Batches of operations submitted using io_uring. */
+};
+
+/*
+ * Chooses the engine used by this handle to claim elements, and to commit
+ * or roll back transactions. With "SPOOLDIR_IO_URING", the renames and
+ * opens for a whole batch are submitted with a single system call; if
+ * io_uring or any of the needed operations is unavailable, -1 is returned
+ * with errno set (ENOSYS when unsupported) and the engine is not changed.
+ * Durability modes other than "SPOOLDIR_DURABILITY_NONE" always commit
+ * new elements synchronously.
+ */
+int spooldir_set_io_engine (spooldir *spool, enum spooldir_io_engine engine);
+enum spooldir_io_engine spooldir_get_io_engine (const spooldir *spool);
+
+/*
+ * Keeps an in-memory index of the elements in the spool, which makes
+ * picking and "spooldir_has_status()" cheap for long-lived processes. The
+ * index is filled by scanning the spool, and kept current with file system
+ * notifications when available. Otherwise changes done through the handle
+ * are recorded directly, and buckets changed by others are scanned again.
+ * The file system is used while the index is stale.
+ */
+int spooldir_set_index (spooldir *spool, _Bool enable);
+
+/*
+ * Stages whose latency is recorded when statistics are compiled in.
+ */
+enum spooldir_stage {
+    SPOOLDIR_STAGE_CREATE,   /* Creating the file of a new element. */
+    SPOOLDIR_STAGE_CLAIM,    /* Moving an element from "new" to "wip". */
+    SPOOLDIR_STAGE_PUBLISH,  /* Moving a new element into "new". */
+    SPOOLDIR_STAGE_FINISH,   /* Moving a claimed element out of "wip". */
+    SPOOLDIR_STAGE_SYNC,     /* Flushing data and directories to disk. */
+    SPOOLDIR_STAGE_COUNT,
+};
+
+enum {
+    SPOOLDIR_STATS_BUCKETS = 32,
+};
+
+/*
+ * Counters collected by a spool handle. Bucket "i" of each histogram counts
+ * operations which took between 2^i and 2^(i+1) nanoseconds; the last one
+ * also counts everything slower.
+ */
+struct spooldir_stats {
+    uint64_t adds;
+    uint64_t commits;
+    uint64_t rollbacks;
+    uint64_t picks;
+    uint64_t pick_races;       /* Elements claimed by someone else first. */
+    uint64_t entries_scanned;  /* Directory entries read by cursors. */
+    uint64_t bytes_written;    /* Size of the committed new elements. */
+    uint64_t latency[SPOOLDIR_STAGE_COUNT][SPOOLDIR_STATS_BUCKETS];
+};
+
+/*
+ * Takes a snapshot of the counters of a spool handle. The library must be
+ * built with "SPOOLDIR_ENABLE_STATS", otherwise -1 is returned with "errno"
+ * set to "ENOSYS".
+ */
+int spooldir_stats (const spooldir *spool, struct spooldir_stats *stats);
+
 /*
  * Closes a spool directory, possibly freeing resources.
  */
@@ -97,11 +375,83 @@ void spooldir_close (spooldir *spool);
 int spooldir__open_file (spooldir *spool, const spoolkey *key,
                          enum spooldir_status status, int oflag);
 
+enum {
+    SPOOLDIR_DUPLICATE = 1,  /* Commit found the same contents in the spool. */
+};
+
 /*
+ * Finishes a transaction. Committing an element being added in a spool
+ * with deduplication enabled returns "SPOOLDIR_DUPLICATE", and discards
+ * it, when an element with the same contents exists already.
  */
 int spooldir_commit (spooldir *spool, spooltxn *txn);
 int spooldir_rollback (spooldir *spool, spooltxn *txn);
 
+/*
+ * Commits or rolls back "n" transactions. All of them are always
+ * finished; if any fails "-1" is returned and "errno" is set to the
+ * error of the first failure.
+ */
+int spooldir_commit_many (spooldir *spool, spooltxn *txns, size_t n);
+int spooldir_rollback_many (spooldir *spool, spooltxn *txns, size_t n);
+
+/*
+ * Makes picks through a handle stamp a lease on the claimed elements, which
+ * expires after "seconds"; zero disables stamping (the default). Leases can
+ * be extended while handling an element with "spooldir_renew_lease()".
+ */
+int spooldir_set_lease (spooldir *spool, unsigned seconds);
+int spooldir_renew_lease (spooltxn *txn, unsigned seconds);
+
+/*
+ * Moves claimed elements whose lease has expired back to "new", so they can
+ * be picked again, and returns how many; or -1 on failure. Elements are
+ * considered expired when both their lease, if any, and "timeout" seconds
+ * since they were claimed have passed.
+ */
+ssize_t spooldir_reap (spooldir *spool, unsigned timeout);
+
+/*
+ * Progress of "spooldir_recover()". Directories are "tmp" and each of the
+ * fan-out buckets of "wip".
+ */
+struct spooldir_recover_stats {
+    size_t   scanned;     /* Entries examined. */
+    size_t   removed;     /* Files removed from "tmp". */
+    size_t   restored;    /* Elements moved back from "wip" to "new". */
+    unsigned dirs_done;
+    unsigned dirs_total;
+};
+
+enum {
+    SPOOLDIR_RECOVER_TMP_AGE = 3600,  /* Default age of stale files in "tmp". */
+};
+
+/*
+ * What "spooldir_recover()" considers stale. Files in "tmp" are removed
+ * after "tmp_age" seconds without modifications, and elements in "wip" are
+ * moved back to "new" as done by "spooldir_reap()" with "wip_timeout".
+ * Zero threads uses one per online CPU. The progress callback, if any, is
+ * called with the running totals, one thread at a time.
+ */
+struct spooldir_recover_policy {
+    unsigned tmp_age;
+    unsigned wip_timeout;
+    unsigned n_threads;
+    void   (*progress) (spooldir *spool, const struct spooldir_recover_stats *stats, void *userdata);
+    void    *userdata;
+};
+
+/*
+ * Cleans up after a crash, scanning directories in parallel and handling
+ * their entries in batches. Without a policy files in "tmp" older than
+ * "SPOOLDIR_RECOVER_TMP_AGE" are removed, and all the elements in "wip"
+ * without a valid lease are moved back to "new". The totals are stored in
+ * "stats", if not NULL, also on failure.
+ */
+int spooldir_recover (spooldir *spool, const struct spooldir_recover_policy *policy,
+                      struct spooldir_recover_stats *stats);
+
 /*
  * Starts the creation of a new element in the spool directory.
  *
@@ -116,18 +466,154 @@ int spooldir_rollback (spooldir *spool, spooltxn *txn);
 int spooldir_add (spooldir *spool, spooltxn *txn);
 
 /*
+ * Priority classes, lower values are more urgent.
+ */
+enum {
+    SPOOLDIR_PRIORITY_MAX = 9,
+    SPOOLDIR_PRIORITY_DEFAULT = 5,
+};
+
+/*
+ * Same as "spooldir_add()", giving a priority class to the new element,
+ * which is stored as a "<priority>-" prefix in front of its generated key.
+ * Elements with the default priority get no prefix.
+ */
+int spooldir_add_with_priority (spooldir *spool, spooltxn *txn, unsigned priority);
+
+/*
+ * Starts the creation of a new element with the contents read from
+ * "src_fd", from its current position until the end. The data is copied
+ * by the kernel when possible (file cloning, copy_file_range(), splice()).
+ *
+ * Returns "0" on success, with the transaction ready to be committed; on
+ * failure "-1" is returned and "errno" set, and the element is discarded.
+ */
+int spooldir_add_from_fd (spooldir *spool, int src_fd, spooltxn *txn);
+
+/*
+ * Adds an element with the contents of "iovcnt" buffers and commits it, in
+ * a single call which honors the durability setting. On success the key of
+ * the element is stored in "out_key", if not NULL, and must be freed with
+ * "spoolkey_free()". On failure nothing is added. The result is the same
+ * as for "spooldir_commit()".
+ */
+int spooldir_add_iov (spooldir *spool, const struct iovec *iov, int iovcnt, spoolkey **out_key);
+
+/*
+ * Producers add elements to a spool without allocating memory for each
+ * one: they keep their own key generator, transaction and write buffer.
+ * A producer must be used by one thread at a time, and can hold a single
+ * transaction, obtained with "spooldir_producer_begin()". Writes done with
+ * "spooldir_producer_write()" are buffered until the transaction is
+ * committed. When "key" is not NULL, it is set to the key of the committed
+ * element, which is owned by the producer and valid until the next commit.
+ */
+spooldir_producer* spooldir_producer_new (spooldir *spool);
+void spooldir_producer_free (spooldir_producer *producer);
+spooltxn* spooldir_producer_begin (spooldir_producer *producer);
+int spooldir_producer_write (spooldir_producer *producer, const void *data, size_t len);
+int spooldir_producer_commit (spooldir_producer *producer, const spoolkey **key);
+int spooldir_producer_rollback (spooldir_producer *producer);
+
+/*
+ * Adds an element with the given contents, and commits it.
+ */
+int spooldir_producer_add (spooldir_producer *producer, const void *data, size_t len,
+                           const spoolkey **key);
+
+/*
+ * Picks an element from the spool directory for handling, moving it to
+ * the "wip" status. The transaction has to be finished either with
+ * "spooldir_commit()" or with "spooldir_rollback()".
+ *
+ * Returns "0" on success, "EOF" if there are no elements to pick, or "-1"
+ * in case of failure. As "EOF" may have the same value as "-1", "errno" is
+ * set to zero when there are no elements to pick.
  */
 int spooldir_pick (spooldir *spool, spooltxn *txn);
 
 /*
+ * Picks up to "n" elements in a single call, populating the first entries
+ * of the "txns" array. Returns the number of elements picked, which is
+ * zero when there are no elements to pick, or "-1" in case of failure.
+ */
+ssize_t spooldir_pick_many (spooldir *spool, spooltxn *txns, size_t n);
+
+/*
+ * Opens a cursor used to pick elements from a spool directory. A cursor
+ * keeps a single directory stream open and continues scanning from the
+ * position where the previous call to "spooldir_cursor_next()" stopped,
+ * which makes draining a directory with many elements a linear operation.
+ *
+ * A cursor must not be used concurrently from different threads.
+ */
+spooldir_cursor* spooldir_cursor_open (spooldir *spool);
+
+/*
+ * Picks the next element using a cursor. Return values are the same as for
+ * "spooldir_pick()".
+ */
+int spooldir_cursor_next (spooldir_cursor *cursor, spooltxn *txn);
+
+/*
+ * Picks up to "n" elements using a cursor. Return values are the same as
+ * for "spooldir_pick_many()".
+ */
+ssize_t spooldir_cursor_next_many (spooldir_cursor *cursor, spooltxn *txns, size_t n);
+
+/*
+ * Closes a cursor, freeing the resources used by it.
+ */
+void spooldir_cursor_close (spooldir_cursor *cursor);
+
+/*
+ * Removes a finished or new element from the spool directory. Elements
+ * being handled cannot be deleted. Returns "-1" with "errno" set to
+ * "ENOENT" if no such element exists.
  */
 int spooldir_delete (spooldir *spool, const spoolkey *key);
 
+/*
+ * Removes elements with a given status, which must be cur or new: those
+ * modified more than "max_age" seconds ago (zero keeps them regardless of
+ * age), and then the oldest ones until at most "max_count" remain ("SIZE_MAX"
+ * for no limit). Returns the number of elements removed, or "-1" on failure.
+ */
+ssize_t spooldir_purge (spooldir *spool, enum spooldir_status status,
+                        unsigned max_age, size_t max_count);
+
+/*
+ * Makes "spooldir_purge()" append elements to the tarball open at "fd"
+ * before removing them; "-1" disables archiving. The descriptor is not owned
+ * by the spool, and must remain valid while in use.
+ */
+int spooldir_set_archive (spooldir *spool, int fd);
+
 /*
  */
 _Bool spooldir_has_status (const spooldir *spool, const spoolkey *key,
                            enum spooldir_status status);
 
+enum {
+    SPOOLDIR_COUNT_EXACT = 1 << 0,  /* Do not return estimated counts. */
+};
+
+/*
+ * Returns the number of elements with a given status, which must be new,
+ * wip or cur; or -1 on failure. Counts are exact when the in-memory index is
+ * enabled. Otherwise, if the spool keeps a counters file they are read from
+ * it, which is cheap but may be off; unless "SPOOLDIR_COUNT_EXACT" is passed,
+ * in which case elements are counted by scanning directories.
+ */
+ssize_t spooldir_count (const spooldir *spool, enum spooldir_status status, unsigned flags);
+
+/*
+ * Creates or removes the counters file of a spool. When creating, it is
+ * initialized by counting the elements. All the handles opened afterwards
+ * keep it updated, so it should be enabled before using the spool.
+ */
+int spooldir_set_counters (spooldir *spool, _Bool enable);
+
 /*
  * Type of callback functions used for notifying of element status. The
  * transaction "txn" argument always has a valid key associated, the file
@@ -136,9 +622,259 @@ _Bool spooldir_has_status (const spooldir *spool, const spoolkey *key,
 typedef void (*spooldircfn) (spooldir*, enum spooldir_status, spooltxn *txn, void *userdata);
 
 /*
- * Listens for updates in a spool directory, and invokes the "callback"
- * function whenever an item changes their status.
+ * Waits for updates in a spool directory, and invokes the "callback"
+ * function for each item which changes their status. This function blocks
+ * until at least one item changes status, and returns the number of times
+ * the callback was invoked, or "-1" on failure.
+ *
+ * The notifier used is created on the first call and kept around by the
+ * spool directory; changes which happen before that are not reported.
  */
 int spooldir_notify (spooldir *spool, spooldircfn callback, void *userdata);
 
+/*
+ * Creates a notifier which watches the "new", "wip" and "cur" directories
+ * of a spool. Elements which leave the "cur" directory, or are deleted from
+ * "new" or "wip", are reported with the "SPOOLDIR_STATUS_FIN" status. On
+ * systems which use kqueue() the notifier reports all the elements in the
+ * directory that changed, so the callback may be invoked more than once for
+ * the same element.
+ */
+spooldir_notifier* spooldir_notifier_new (spooldir *spool, spooldircfn callback,
+                                          void *userdata);
+
+/*
+ * Frees a notifier.
+ */
+void spooldir_notifier_free (spooldir_notifier *notifier);
+
+/*
+ * Obtains a file descriptor which becomes readable when there are events
+ * pending to be dispatched. Suitable for use with poll(), epoll, etc.
+ */
+int spooldir_notifier_fd (const spooldir_notifier *notifier);
+
+/*
+ * Invokes the callback for all the pending events, without blocking.
+ * Returns the number of times the callback was invoked, or "-1" on failure.
+ */
+int spooldir_notifier_dispatch (spooldir_notifier *notifier);
+
+/*
+ * Segments pack many small records in a single element, which is added,
+ * picked and committed like any other one. Each record is prefixed by its
+ * length, and the element starts with a magic value which identifies it
+ * as a segment.
+ *
+ * Starts writing a new segment, which stays in the "tmp" directory until
+ * committed.
+ */
+spooldir_segment* spooldir_segment_new (spooldir *spool);
+
+/*
+ * Appends a record to a segment. Records are buffered, and written in
+ * batches to the element. A failed append leaves the segment unchanged,
+ * unless a write stopped part-way: then appending and committing fail
+ * with "EIO", and the segment can only be rolled back.
+ */
+int spooldir_segment_append (spooldir_segment *segment, const void *data, size_t len);
+
+/*
+ * Obtains the number of records appended to a segment.
+ */
+size_t spooldir_segment_count (const spooldir_segment *segment);
+
+/*
+ * Obtains the key of the element which contains a segment.
+ */
+const spoolkey* spooldir_segment_key (const spooldir_segment *segment);
+
+/*
+ * Publishes all the records of a segment at once, in the "new" directory,
+ * following the durability setting of the spool. Frees the segment, also
+ * on failure.
+ */
+int spooldir_segment_commit (spooldir_segment *segment);
+
+/*
+ * Discards a segment and all its records.
+ */
+void spooldir_segment_rollback (spooldir_segment *segment);
+
+/*
+ * Reads the records of a segment from a picked transaction, which is
+ * mapped with "spooldir_map()", and needs to be committed or rolled back
+ * as usual after closing the reader.
+ * Records acknowledged with "spooldir_segment_ack()" are recorded in a
+ * bitmap in the "cur" directory, and skipped if the segment is picked
+ * again after a failure. Returns NULL with "errno" set to "EBADMSG" if the
+ * element is not a valid segment.
+ */
+spooldir_segment_reader* spooldir_segment_reader_open (spooldir *spool, spooltxn *txn);
+
+/*
+ * Obtains the next record which has not been acknowledged. The data stays
+ * valid until the transaction is committed or rolled back. Returns "0" on
+ * success, or "EOF" (with "errno" set to zero) when there are no more
+ * records.
+ */
+int spooldir_segment_next (spooldir_segment_reader *reader, const void **data, size_t *len);
+
+/*
+ * Acknowledges the last record obtained with "spooldir_segment_next()".
+ */
+int spooldir_segment_ack (spooldir_segment_reader *reader);
+
+/*
+ * Closes a segment reader. When all the records have been acknowledged
+ * the bitmap is removed, and the transaction should be committed.
+ */
+void spooldir_segment_reader_close (spooldir_segment_reader *reader);
+
+/*
+ * Handler invoked by worker pools for each picked element. The handler
+ * should commit or roll back the transaction; transactions left in the
+ * "SPOOLDIR_STATUS_WIP" status are rolled back.
+ */
+typedef void (*spooldir_worker_fn) (spooldir *spool, spooltxn *txn, void *userdata);
+
+/*
+ * Starts "n_workers" threads which pick elements from a spool and pass them
+ * to "handler", which is invoked concurrently from all the workers. A
+ * single thread scans the "new" directory and distributes the names found
+ * to the workers, which then do not compete in picking the same elements.
+ * When the spool is empty, the scanner waits for new elements to be added.
+ */
+spooldir_worker_pool* spooldir_worker_pool_new (spooldir *spool, unsigned n_workers,
+                                                spooldir_worker_fn handler,
+                                                void *userdata);
+
+/*
+ * Stops a worker pool, waiting for the handlers being run to finish, and
+ * frees it. Elements not yet picked remain in the spool.
+ */
+void spooldir_worker_pool_free (spooldir_worker_pool *pool);
+
+/*
+ * Callback invoked when an asynchronous request completes. The "result" is
+ * the value the corresponding synchronous function would have returned,
+ * and on failure "errno" is set to the error.
+ */
+typedef void (*spooldir_async_fn) (spooldir *spool, spooltxn *txn, int result, void *userdata);
+
+/*
+ * Runs spool operations in "n_threads" background threads, so they do not
+ * block event loops. Each submission returns immediately, or fails with
+ * "EAGAIN" when too many requests are pending; the transaction must remain
+ * valid until its callback is invoked. Callbacks are run from
+ * "spooldir_async_dispatch()", which should be called when the descriptor
+ * returned by "spooldir_async_fd()" becomes readable. Picks do not wait for
+ * elements: poll the descriptor of a notifier as well to retry them.
+ */
+spooldir_async* spooldir_async_new (spooldir *spool, unsigned n_threads);
+int spooldir_async_fd (const spooldir_async *async);
+int spooldir_async_dispatch (spooldir_async *async);
+
+int spooldir_async_add (spooldir_async *async, spooltxn *txn,
+                        spooldir_async_fn callback, void *userdata);
+int spooldir_async_commit (spooldir_async *async, spooltxn *txn,
+                           spooldir_async_fn callback, void *userdata);
+int spooldir_async_rollback (spooldir_async *async, spooltxn *txn,
+                             spooldir_async_fn callback, void *userdata);
+int spooldir_async_pick (spooldir_async *async, spooltxn *txn,
+                         spooldir_async_fn callback, void *userdata);
+
+/*
+ * Waits for the pending requests to complete, invoking their callbacks and
+ * those of requests submitted meanwhile, and frees the resources used.
+ */
+void spooldir_async_free (spooldir_async *async);
+
+enum {
+    SPOOLDIR_REPLICATE_FOLLOW = 1 << 0,  /* Keep sending changes after the snapshot. */
+};
+
+/*
+ * Writes to "out_fd" a stream with the elements in "new" and "wip", and
+ * their contents. With "SPOOLDIR_REPLICATE_FOLLOW", later additions and
+ * status changes are sent until an error happens, e.g. the other end goes
+ * away. When "ack_fd" is not negative, acknowledgements are read from it,
+ * and without following changes the function returns once all the
+ * records have been applied by the receiver.
+ */
+int spooldir_replicate_send (spooldir *spool, int out_fd, int ack_fd, unsigned flags);
+
+/*
+ * Applies a stream written by "spooldir_replicate_send()" until the end of
+ * "in_fd", keeping the keys of the elements. Acknowledgements are written
+ * to "ack_fd" unless it is negative. Records for elements which already
+ * exist are skipped, so a stream can be replayed after reconnecting.
+ */
+int spooldir_replicate_recv (spooldir *spool, int in_fd, int ack_fd);
+
+/*
+ * A spoolset is a single logical queue made of several spool directories,
+ * which can be placed in different file systems.
+ *
+ * Opens the spools at the given paths, creating them if needed.
+ */
+spoolset* spoolset_open_paths (const char *const *paths, unsigned n, uint32_t mode);
+
+/*
+ * Closes all the spools in a set, and frees it.
+ */
+void spoolset_close (spoolset *set);
+
+/*
+ * Obtains the number of spools in a set, and each one of them, e.g. to
+ * configure them.
+ */
+unsigned spoolset_size (const spoolset *set);
+spooldir* spoolset_get (const spoolset *set, unsigned index);
+
+/*
+ * How new elements are distributed among the spools of a set.
+ */
+enum spoolset_route {
+    SPOOLSET_ROUTE_HASH,         /* By hash of the key (default). */
+    SPOOLSET_ROUTE_ROUND_ROBIN,  /* In turns. */
+};
+
+/*
+ * Chooses how new elements are distributed. With "SPOOLSET_ROUTE_HASH" the
+ * spool holding an element is known from its key, otherwise status
+ * queries need to check all the spools. All the processes using a set
+ * must agree on the routing and the order of the paths.
+ */
+int spoolset_set_route (spoolset *set, enum spoolset_route route);
+
+/*
+ * Same as "spooldir_add()", in the spool chosen by the routing. Keys are
+ * generated using the mode configured for the first spool.
+ */
+int spoolset_add (spoolset *set, spooltxn *txn);
+
+/*
+ * Same as "spooldir_pick()", taking elements from each spool in turns.
+ * When a spool is empty, elements are taken from the others.
+ */
+int spoolset_pick (spoolset *set, spooltxn *txn);
+
+/*
+ * Same as "spooldir_pick_many()", possibly from several spools.
+ */
+ssize_t spoolset_pick_many (spoolset *set, spooltxn *txns, size_t n);
+
+/*
+ * Commits or rolls back a transaction in the spool it belongs to.
+ */
+int spoolset_commit (spoolset *set, spooltxn *txn);
+int spoolset_rollback (spoolset *set, spooltxn *txn);
+
+/*
+ * Same as "spooldir_has_status()", in the spool which holds the element.
+ */
+_Bool spoolset_has_status (const spoolset *set, const spoolkey *key,
+                           enum spooldir_status status);
+
 #endif /* !SPOOLDIR_H */